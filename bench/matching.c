@@ -0,0 +1,96 @@
+// Microbenchmark of the matcher: time per string for each case mode and kind
+// of query, on synthetic paths. Run with `make bench`, which also runs it on a
+// build where all the queries use the generic DP row (GENERIC_MATCHING).
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "matching.h"
+#include "query.h"
+
+static const int n_paths = 20000;
+static const int n_rounds = 20;
+
+static const char *words[] = {
+    "src",     "lib",      "include", "Documents", "Projects", "build",
+    "main",    "test",     "jumper",  "config",    "node_modules", "dist",
+    "Music",   "Pictures", "backup",  "scripts",   "utils",    "README.md",
+    "index.js", "matching.c", "CMakeLists.txt", "docs", "old", "tmp",
+};
+
+static unsigned long next_random(unsigned long *seed) {
+  *seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+  return *seed >> 33;
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Sorted, as in a database, so that the DP rows of common prefixes are reused
+static char **make_paths(void) {
+  const int n_words = sizeof(words) / sizeof(words[0]);
+  char **paths = (char **)malloc(n_paths * sizeof(char *));
+  unsigned long seed = 42;
+  for (int i = 0; i < n_paths; i++) {
+    char path[1024] = "/home/user";
+    const int depth = 3 + next_random(&seed) % 8;
+    for (int d = 0; d < depth; d++) {
+      strcat(path, "/");
+      strcat(path, words[next_random(&seed) % n_words]);
+    }
+    paths[i] = strdup(path);
+  }
+  qsort(paths, n_paths, sizeof(char *), compare_strings);
+  return paths;
+}
+
+// Nanoseconds per string, on the fastest of the rounds
+static double run(Queries queries, CASE_MODE case_mode, char **paths) {
+  Matcher *matcher = matcher_create(queries, case_mode);
+  double total = 0;
+  double best = -1;
+  for (int r = 0; r < n_rounds; r++) {
+    const clock_t start = clock();
+    for (int i = 0; i < n_paths; i++) {
+      total += matcher_score(matcher, paths[i]);
+    }
+    const double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (best < 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  matcher_free(matcher);
+  if (total < 0) {
+    printf("Negative score.\n");
+  }
+  return 1e9 * best / n_paths;
+}
+
+int main(void) {
+  char **paths = make_paths();
+  const char *mode_names[] = {"sensitive", "insensitive", "semi-sensitive"};
+  const CASE_MODE modes[] = {CASE_MODE_sensitive, CASE_MODE_insensitive,
+                             CASE_MODE_semi_sensitive};
+  printf("%-16s %10s %10s %10s\n", "ns/string", "fuzzy", "mixed", "exact");
+  for (int k = 0; k < 3; k++) {
+    Queries fuzzy = make_extended_queries("prj mtch", false);
+    Queries mixed = make_extended_queries("prj 'mat", false);
+    Query exact_query = make_standard_query("src/main", false);
+    Queries exact = {.queries = &exact_query, .n = 1};
+    printf("%-16s %10.1f %10.1f %10.1f\n", mode_names[k],
+           run(fuzzy, modes[k], paths), run(mixed, modes[k], paths),
+           run(exact, modes[k], paths));
+    free_queries(fuzzy);
+    free(fuzzy.queries);
+    free_queries(mixed);
+    free(mixed.queries);
+    free_queries(exact);
+  }
+  for (int i = 0; i < n_paths; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+  return 0;
+}
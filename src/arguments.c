@@ -4,35 +4,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "arguments.h"
+#include "jumper.h"
 
 static const char VERSION[] = "v1.2";
 
 static const int default_n_results = 50000;
+static const int default_pick_results = 200;
+static const int default_clean_budget = 64;
 static const char default_dir_database[] = "/.jfolders";
 static const char default_files_database[] = "/.jfiles";
 static const char default_filters_database[] = "/.jfilters";
 static const char directories_env_variable[] = "__JUMPER_FOLDERS";
 static const char files_env_variable[] = "__JUMPER_FILES";
 static const char filters_env_variable[] = "__JUMPER_FILTERS";
+static const char max_entries_env_variable[] = "__JUMPER_MAX_ENTRIES";
+
+// Options without short form
+enum {
+  OPT_since = 256,
+  OPT_before,
+  OPT_explain_plan,
+  OPT_serve_stdin,
+  OPT_query,
+  OPT_cache,
+  OPT_db,
+  OPT_remap
+};
 
 static const char HELP_STRING[] =
     "Usage: %s [MODE] [OPTIONS] ARG\n"
-    "MODE has to be one of 'find', 'update', 'clean', 'status', 'shell'.\n\n"
+    "MODE has to be one of 'find', 'pick', 'update', 'clean', 'status',\n"
+    "'shell', 'merge'.\n\n"
     " -f, --file=FILE_PATH      Path to the database's file. If not supplied\n"
     "                           jumper will use ~/.jfolders and ~/.jfiles\n"
     "                           (or the environment variables __JUMPER_FOLDERS\n"
     "                           and __JUMPER_FILES if set) depending on --type.\n"
-    " -t, --type=TYPE           TYPE has to be 'files' or 'directories'.\n"
+    " -t, --type=TYPE           TYPE has to be 'files' or 'directories'\n"
+    "                           (or 'all' for find: both databases are\n"
+    "                           searched, see --db).\n"
     " -F, --filters=FILE_PATH   Path to a file that specifies which pathes to "
     "filter out.\n"
     "                           Jumper uses ~/.jfilters (or the environment\n"
     "                           variable __JUMPER_FILTERS if set).\n"
     "                           Leave empty to turn filtering off.\n"
     " -h, --help                Display this help and exit.\n"
-    " -v, --version             Print version.\n\n"
+    " -m, --max-entries=N       Maximum number of entries kept in the database\n"
+    "                           (default: $__JUMPER_MAX_ENTRIES, or no limit).\n"
+    "                           Less frecent entries are moved to an archive\n"
+    "                           <database>.cold, which is only searched when\n"
+    "                           it could contain better matches.\n"
+    " -v, --version             Print version.\n\n";
+
+// The modes are printed one after the other: ISO C only guarantees string
+// literals of 4095 characters.
+static const char *const MODES_HELP[] = {
     "MODE find: look for ARG in the database\n"
     " -n, --n-results=N         Maximum number of results to show.\n"
     " -c, --color               Highlight matches in outputs.\n"
@@ -50,22 +79,86 @@ static const char HELP_STRING[] =
     "results.\n"
     " -r, --relative=PATH       Outputs relative paths to PATH if\n"
     "                           specified (defaults to current directory).\n"
+    " -W, --within=DIR          Only search the entries of DIR's subtree\n"
+    "                           (defaults to current directory).\n"
+    "     --since=TIME          Only search the entries visited since TIME:\n"
+    "                           a duration ago (30s, 10m, 2h, 3d, 1w), a date\n"
+    "                           'YYYY-MM-DD[ HH:MM]' or a timestamp @SECONDS.\n"
+    "     --before=TIME         Only search the entries last visited before "
+    "TIME.\n"
+    "     --explain-plan        Print how the database was searched, with the\n"
+    "                           estimated and actual numbers of entries read\n"
+    "                           and matched (on stderr).\n"
+    "     --db=FILE_PATH        Also search the database FILE_PATH (can be\n"
+    "                           repeated). The databases are searched\n"
+    "                           concurrently, and each result is prefixed by\n"
+    "                           the tag of its database and a tab: d or f for\n"
+    "                           the databases of the types, the name of the\n"
+    "                           file for the others.\n"
+    "     --serve-stdin         Answer the queries read on stdin, one per line\n"
+    "                           of options and ARG, keeping the databases in\n"
+    "                           memory. The results of each query are\n"
+    "                           followed by an empty line.\n",
+    "MODE pick: pick an entry interactively, starting from the query ARG, and\n"
+    "print it. It takes the options of find (-n defaults to 200). Each\n"
+    "keystroke searches the databases, that are kept in memory. Tab switches\n"
+    "between the directories and the files (with --type), Enter prints the\n"
+    "selected entry, and Esc or Ctrl-C cancel.\n",
     "MODE update: update the record ARG in the database\n"
-    " -w, --weight=WEIGHT       Weight of the visit (default=1.0).\n\n"
+    " -w, --weight=WEIGHT       Weight of the visit (default=1.0).\n"
+    "     --query=QUERY         Query for which ARG has been selected: ARG\n"
+    "                           is then memoized as its result, if it is the\n"
+    "                           best one, so that 'find -n 1 QUERY' can skip\n"
+    "                           the search.\n"
+    " -C, --canonicalize        Resolve symbolic links in ARG before recording "
+    "it.\n\n",
     "MODE clean: remove entries that do not exist anymore, or that matches one "
     "of the filters.\n"
     "                           If --type is not specified, cleans both "
     "databases.\n"
     " -D, --dry-run             Create filtered tmp file without replacing the "
     "original database.\n"
-    "MODE status: print databases' locations and some statistics.\n"
+    " -i, --incremental[=N]     Only verify the next N entries (default=64),\n"
+    "                           resuming where the previous call stopped.\n"
+    " -C, --canonicalize        Resolve symbolic links and merge the entries "
+    "that point\n"
+    "                           to the same file/directory. Paths spelled\n"
+    "                           through links are kept as they were typed.\n",
+    "MODE status: print databases' locations and some statistics.\n",
     "MODE shell: print setup scripts. ARG has to be bash, zsh or fish.\n"
-    " -B, --no-bind             Do not bind keys.\n";
+    " -B, --no-bind             Do not bind keys.\n"
+    "     --cache               Also save the script, with fzf's features\n"
+    "                           resolved, to $XDG_CACHE_HOME/jumper/init.ARG\n"
+    "                           (bash and zsh). Sourcing it runs no other\n"
+    "                           process, and it is made again when jumper or\n"
+    "                           fzf are updated.\n",
+    "MODE merge: merge the databases ARG... (and their archives) into one,\n"
+    "combining the entries of the same path: their visits are decayed to the\n"
+    "latest one and summed. The databases are sorted by chunks, so that large\n"
+    "ones are merged in bounded memory.\n"
+    " -O, --output=FILE_PATH    Database to write (required). It may be one\n"
+    "                           of the merged databases.\n"
+    "     --remap=FROM=TO       Replace the prefix FROM of the paths of the\n"
+    "                           next database by TO (can be repeated), e.g.\n"
+    "                           --remap=/Users/me=/home/me.\n",
+    NULL};
 
-static void help(const char *argv0) { printf(HELP_STRING, argv0); }
+static void help(const char *argv0) {
+  printf(HELP_STRING, argv0);
+  for (const char *const *mode = MODES_HELP; *mode; mode++) {
+    fputs(*mode, stdout);
+  }
+}
 
 static void print_version(void) { printf("%s\n", VERSION); }
 
+#define SHORT_OPTIONS "csoeHISCt:f:n:m:w:b:x:r::W::F::i::BDO:"
+
+static const char short_options[] = SHORT_OPTIONS;
+// In merge mode, getopt returns the databases as options of code 1, in their
+// order among the --remap options.
+static const char merge_short_options[] = "-" SHORT_OPTIONS;
+
 static struct option longopts[] = {{"file", required_argument, NULL, 'f'},
                                    {"weight", required_argument, NULL, 'w'},
                                    {"scores", no_argument, NULL, 's'},
@@ -74,6 +167,7 @@ static struct option longopts[] = {{"file", required_argument, NULL, 'f'},
                                    {"case-insensitive", no_argument, NULL, 'I'},
                                    {"case-sensitive", no_argument, NULL, 'S'},
                                    {"relative", optional_argument, NULL, 'r'},
+                                   {"within", optional_argument, NULL, 'W'},
                                    {"filters", optional_argument, NULL, 'F'},
                                    {"beta", required_argument, NULL, 'b'},
                                    {"n-results", required_argument, NULL, 'n'},
@@ -83,6 +177,18 @@ static struct option longopts[] = {{"file", required_argument, NULL, 'f'},
                                    {"type", required_argument, NULL, 't'},
                                    {"no-bind", no_argument, NULL, 'B'},
                                    {"dry-run", no_argument, NULL, 'D'},
+                                   {"canonicalize", no_argument, NULL, 'C'},
+                                   {"incremental", optional_argument, NULL, 'i'},
+                                   {"max-entries", required_argument, NULL, 'm'},
+                                   {"since", required_argument, NULL, OPT_since},
+                                   {"before", required_argument, NULL, OPT_before},
+                                   {"explain-plan", no_argument, NULL, OPT_explain_plan},
+                                   {"serve-stdin", no_argument, NULL, OPT_serve_stdin},
+                                   {"query", required_argument, NULL, OPT_query},
+                                   {"cache", no_argument, NULL, OPT_cache},
+                                   {"db", required_argument, NULL, OPT_db},
+                                   {"output", required_argument, NULL, 'O'},
+                                   {"remap", required_argument, NULL, OPT_remap},
                                    {NULL, 0, NULL, 0}};
 
 static void args_init(Arguments *args) {
@@ -95,7 +201,12 @@ static void args_init(Arguments *args) {
   args->orderless = false;
   args->existing = false;
   args->type = TYPE_undefined;
+  args->all_types = false;
+  args->n_extra_databases = 0;
   args->relative_to = NULL;
+  args->within = NULL;
+  args->since = 0;
+  args->before = 0;
   args->filters = NULL;
   args->mode = MODE_search;
   args->syntax = SYNTAX_extended;
@@ -106,7 +217,22 @@ static void args_init(Arguments *args) {
   args->beta = 1.0;
   args->weight = 1.0;
   args->no_bind = false;
+  args->cache = false;
   args->dry_run = false;
+  args->canonicalize = false;
+  args->explain_plan = false;
+  args->serve_stdin = false;
+  args->query = NULL;
+  args->default_file_path = NULL;
+  args->default_filters = NULL;
+  args->clean_budget = 0;
+  args->sources = NULL;
+  args->n_sources = 0;
+  args->remaps = NULL;
+  args->n_remaps = 0;
+  args->output = NULL;
+  const char *max_entries = getenv(max_entries_env_variable);
+  args->max_entries = max_entries ? atoi(max_entries) : 0;
 }
 
 static MODE parse_mode(const char *mode) {
@@ -120,34 +246,115 @@ static MODE parse_mode(const char *mode) {
     return MODE_shell;
   } else if (strcmp(mode, "status") == 0) {
     return MODE_status;
+  } else if (strcmp(mode, "pick") == 0) {
+    return MODE_pick;
+  } else if (strcmp(mode, "merge") == 0) {
+    return MODE_merge;
   }
   fprintf(stderr, "ERROR: Invalid argument: %s\n", mode);
-  fprintf(stderr, "Accepted arguments: find, update, clean, status, shell.\n");
-  exit(EXIT_FAILURE);
+  fprintf(stderr, "Accepted arguments: find, pick, update, clean, status, "
+                  "shell, merge.\n");
+  jumper_exit(EXIT_FAILURE);
 }
 
-static TYPE parse_type(const char *arg) {
+// The parsers of the options' arguments print an error and return false if
+// the argument is invalid.
+static bool parse_type(const char *arg, TYPE *type) {
   if ((strcmp(arg, "f") == 0) || (strcmp(arg, "files") == 0)) {
-    return TYPE_files;
+    *type = TYPE_files;
+    return true;
   } else if ((strcmp(arg, "d") == 0) || (strcmp(arg, "directories") == 0)) {
-    return TYPE_directories;
+    *type = TYPE_directories;
+    return true;
   }
   fprintf(stderr, "ERROR: Invalid argument for -t (--type): %s\n", arg);
-  fprintf(stderr, "Accepted arguments: files, directories.\n");
-  exit(EXIT_FAILURE);
+  fprintf(stderr, "Accepted arguments: files, directories, all.\n");
+  return false;
 }
 
-static SYNTAX parse_syntax(const char *syntax) {
-  if (strcmp(syntax, "extended") == 0) {
-    return SYNTAX_extended;
-  } else if (strcmp(syntax, "fuzzy") == 0) {
-    return SYNTAX_fuzzy;
-  } else if (strcmp(syntax, "exact") == 0) {
-    return SYNTAX_exact;
+static bool parse_syntax(const char *arg, SYNTAX *syntax) {
+  if (strcmp(arg, "extended") == 0) {
+    *syntax = SYNTAX_extended;
+    return true;
+  } else if (strcmp(arg, "fuzzy") == 0) {
+    *syntax = SYNTAX_fuzzy;
+    return true;
+  } else if (strcmp(arg, "exact") == 0) {
+    *syntax = SYNTAX_exact;
+    return true;
   }
-  fprintf(stderr, "ERROR: Invalid argument for -x (--syntax): %s\n", syntax);
+  fprintf(stderr, "ERROR: Invalid argument for -x (--syntax): %s\n", arg);
   fprintf(stderr, "Accepted arguments: extended, fuzzy, exact.\n");
-  exit(EXIT_FAILURE);
+  return false;
+}
+
+// Parse a point in time: a duration before now (e.g. 2h), a local date
+// YYYY-MM-DD[ HH:MM] or a number of seconds since the epoch prefixed by @.
+static bool parse_time(const char *arg, const char *option, long long *time_) {
+  long long value;
+  char unit = 's';
+  char end;
+  int year, month, day, hour = 0, minute = 0;
+  if (sscanf(arg, "@%lld%c", &value, &end) == 1) {
+    *time_ = value;
+    return true;
+  }
+  if (sscanf(arg, "%d-%d-%d%c", &year, &month, &day, &end) == 3 ||
+      sscanf(arg, "%d-%d-%d %d:%d%c", &year, &month, &day, &hour, &minute,
+             &end) == 5) {
+    struct tm tm = {.tm_year = year - 1900,
+                    .tm_mon = month - 1,
+                    .tm_mday = day,
+                    .tm_hour = hour,
+                    .tm_min = minute,
+                    .tm_isdst = -1};
+    const time_t t = mktime(&tm);
+    if (t != (time_t)-1) {
+      *time_ = (long long)t;
+      return true;
+    }
+  } else if ((sscanf(arg, "%lld%c%c", &value, &unit, &end) == 2 ||
+              sscanf(arg, "%lld%c", &value, &end) == 1) &&
+             value >= 0) {
+    static const char units[] = "smhdw";
+    static const long long seconds[] = {1, 60, 3600, 24 * 3600,
+                                        7 * 24 * 3600};
+    const char *u = strchr(units, unit);
+    if (u && *u != '\0') {
+      *time_ = (long long)time(NULL) - value * seconds[u - units];
+      return true;
+    }
+  }
+  fprintf(stderr, "ERROR: Invalid argument for --%s: %s\n", option, arg);
+  fprintf(stderr, "Accepted arguments: 30s, 10m, 2h, 3d, 1w, YYYY-MM-DD, "
+                  "'YYYY-MM-DD HH:MM', @SECONDS.\n");
+  return false;
+}
+
+// Parse FROM=TO into a remap of the prefix FROM.
+static bool parse_remap(const char *arg, Remap *remap) {
+  const char *equal = strchr(arg, '=');
+  if (equal == NULL || equal == arg || strchr(equal + 1, '|') != NULL) {
+    fprintf(stderr, "ERROR: Invalid argument for --remap: %s\n", arg);
+    fprintf(stderr, "Accepted arguments: FROM=TO, where TO does not contain "
+                    "'|'.\n");
+    return false;
+  }
+  remap->from = arg;
+  remap->from_length = equal - arg;
+  remap->to = equal + 1;
+  return true;
+}
+
+// Default argument of -r and -W. The server answers many queries from the
+// same directory, so it is only asked once per command line.
+static char *cwd = NULL;
+
+static const char *working_directory(void) {
+  if (cwd == NULL) {
+    cwd = getcwd(NULL, 0);
+  }
+  return cwd;
 }
 
 char *get_home_path() {
@@ -159,7 +366,7 @@ char *get_home_path() {
             "%s to paths to jumper's files and folder's "
             "databases.\n",
             directories_env_variable, files_env_variable);
-    exit(EXIT_FAILURE);
+    jumper_exit(EXIT_FAILURE);
   }
   return home;
 }
@@ -192,25 +399,70 @@ char *get_default_filters_path() {
   return path;
 }
 
+// Exit after an error in the arguments (printed by the caller).
+static _Noreturn void invalid_arguments(Arguments *args) {
+  free_arguments(args);
+  jumper_exit(EXIT_FAILURE);
+}
+
 void set_filepath(Arguments *args) {
   if (args->file_path == NULL) {
     if (args->type != TYPE_undefined) {
       // no file path specified, trying to get it through environment variables.
-      args->file_path = get_default_database_path(args->type);
+      args->default_file_path = get_default_database_path(args->type);
+      args->file_path = args->default_file_path;
     } else {
       fprintf(stderr, "ERROR: no database's file or type specified.\n");
-      exit(EXIT_FAILURE);
+      invalid_arguments(args);
     }
   }
 }
+// Number of remaps that apply to the databases to merge given so far.
+static int assigned_remaps(const Arguments *args) {
+  if (args->n_sources == 0) {
+    return 0;
+  }
+  const MergeSource *last = args->sources + args->n_sources - 1;
+  return last->first_remap + last->n_remaps;
+}
+
+// Whether the search covers several databases (see --db).
+static bool federated(const Arguments *args) {
+  return args->all_types || args->n_extra_databases > 0;
+}
+
 void validate_arguments(Arguments *args) {
-  if (args->type == TYPE_undefined && args->existing) {
+  if (args->type == TYPE_undefined && !args->all_types && args->existing) {
     fprintf(stderr,
             "ERROR: missing --type when using the --existing (-e) flag.\n");
-    exit(EXIT_FAILURE);
+    invalid_arguments(args);
+  }
+  if (args->mode != MODE_search && federated(args)) {
+    fprintf(stderr, "ERROR: --type=all and --db only apply to find.\n");
+    invalid_arguments(args);
+  }
+  if (args->mode != MODE_merge && args->output != NULL) {
+    fprintf(stderr, "ERROR: --output (-O) only applies to merge.\n");
+    invalid_arguments(args);
   }
   switch (args->mode) {
   case MODE_search:
+    if (args->key == NULL) {
+      args->key = "";
+    }
+    if (args->serve_stdin && federated(args)) {
+      fprintf(stderr,
+              "ERROR: --type=all and --db do not apply to --serve-stdin.\n");
+      invalid_arguments(args);
+    }
+    // The server can also be given the type or the file with each query. The
+    // databases of a federated search may be the extra ones only.
+    if ((!args->serve_stdin || args->type != TYPE_undefined) &&
+        (!federated(args) || args->type != TYPE_undefined)) {
+      set_filepath(args);
+    }
+    break;
+  case MODE_pick:
     if (args->key == NULL) {
       args->key = "";
     }
@@ -220,16 +472,16 @@ void validate_arguments(Arguments *args) {
     set_filepath(args);
     if (args->key == NULL) {
       fprintf(stderr, "ERROR: nothing to add to the database.\n");
-      exit(EXIT_FAILURE);
+      invalid_arguments(args);
     }
     if (*args->key == '\0') {
       fprintf(stderr,
               "ERROR: can not add an empty argument to the database.\n");
-      exit(EXIT_FAILURE);
+      invalid_arguments(args);
     }
     if (strchr(args->key, '|') != NULL) {
       fprintf(stderr, "ERROR: the argument can not contain '|'.\n");
-      exit(EXIT_FAILURE);
+      invalid_arguments(args);
     }
     break;
   case MODE_clean:
@@ -250,140 +502,354 @@ void validate_arguments(Arguments *args) {
   case MODE_shell:
     if (args->key == NULL) {
       fprintf(stderr, "ERROR: missing argument for shell mode.\n");
-      exit(EXIT_FAILURE);
+      invalid_arguments(args);
+    }
+    break;
+  case MODE_merge:
+    if (args->n_sources == 0) {
+      fprintf(stderr, "ERROR: no database to merge.\n");
+      invalid_arguments(args);
+    }
+    if (args->output == NULL) {
+      fprintf(stderr, "ERROR: missing --output (-O) for merge mode.\n");
+      invalid_arguments(args);
+    }
+    if (assigned_remaps(args) < args->n_remaps) {
+      fprintf(stderr, "ERROR: --remap has to be followed by the database "
+                      "whose paths it remaps.\n");
+      invalid_arguments(args);
     }
     break;
   default:
     return;
   }
 }
-Arguments *parse_arguments(int argc, char **argv) {
-
-  Arguments *args = (Arguments *)malloc(sizeof(Arguments));
-  if (!args) {
-    fprintf(stderr, "ERROR: Failed to allocate memory for arguments.\n");
-    exit(EXIT_FAILURE);
+// Apply the option c of argument optarg. Prints an error and returns false if
+// the argument is invalid.
+static bool apply_option(Arguments *args, int c) {
+  switch (c) {
+  case 'f':
+    args->file_path = optarg;
+    break;
+  case 'I':
+    args->case_mode = CASE_MODE_insensitive;
+    break;
+  case 'S':
+    args->case_mode = CASE_MODE_sensitive;
+    break;
+  case 'e':
+    args->existing = true;
+    break;
+  case 'c':
+    args->highlight = true;
+    break;
+  case 'H':
+    args->home_tilde = true;
+    break;
+  case 't':
+    args->all_types = (strcmp(optarg, "all") == 0);
+    if (args->all_types) {
+      args->type = TYPE_undefined;
+      return true;
+    }
+    return parse_type(optarg, &args->type);
+  case OPT_db:
+    if (args->n_extra_databases == MAX_EXTRA_DATABASES) {
+      fprintf(stderr, "ERROR: --db can not be given more than %d times.\n",
+              MAX_EXTRA_DATABASES);
+      return false;
+    }
+    args->extra_databases[args->n_extra_databases++] = optarg;
+    break;
+  case 'x':
+    return parse_syntax(optarg, &args->syntax);
+  case 'o':
+    args->orderless = true;
+    break;
+  case 's':
+    args->print_scores = true;
+    break;
+  case 'r':
+    args->relative_to = optarg ? optarg : working_directory();
+    break;
+  case 'W':
+    args->within = optarg ? optarg : working_directory();
+    break;
+  case OPT_since:
+    return parse_time(optarg, "since", &args->since);
+  case OPT_before:
+    return parse_time(optarg, "before", &args->before);
+  case OPT_explain_plan:
+    args->explain_plan = true;
+    break;
+  case OPT_serve_stdin:
+    args->serve_stdin = true;
+    break;
+  case OPT_query:
+    args->query = optarg;
+    break;
+  case OPT_cache:
+    args->cache = true;
+    break;
+  case 'O':
+    args->output = optarg;
+    break;
+  case OPT_remap:
+    if (args->remaps == NULL) {
+      fprintf(stderr, "ERROR: --remap only applies to merge.\n");
+      return false;
+    }
+    return parse_remap(optarg, args->remaps + args->n_remaps++);
+  case 'F':
+    args->filters = optarg;
+    break;
+  case 'n':
+    if (sscanf(optarg, "%d", &args->n_results) != 1) {
+      fprintf(stderr, "ERROR: Invalid argument for -n (--n-results): %s\n",
+              optarg);
+      return false;
+    }
+    if (args->n_results < 0) {
+      fprintf(stderr,
+              "ERROR: The number of results -n has to be non-negative.\n");
+      return false;
+    }
+    break;
+  case 'm':
+    if (sscanf(optarg, "%d", &args->max_entries) != 1 ||
+        args->max_entries < 0) {
+      fprintf(stderr, "ERROR: Invalid argument for -m (--max-entries): %s\n",
+              optarg);
+      return false;
+    }
+    break;
+  case 'b':
+    if (sscanf(optarg, "%lf", &args->beta) != 1) {
+      fprintf(stderr, "ERROR: Invalid argument for -b (--beta): %s\n", optarg);
+      return false;
+    }
+    break;
+  case 'w':
+    if (sscanf(optarg, "%lf", &args->weight) != 1) {
+      fprintf(stderr, "ERROR: Invalid argument for -w (--weight): %s\n",
+              optarg);
+      return false;
+    }
+    if (args->weight < 0) {
+      fprintf(stderr,
+              "ERROR: The weight of a visit (-w option) can't be negative.\n");
+      return false;
+    }
+    break;
+  case 'B':
+    args->no_bind = true;
+    break;
+  case 'D':
+    args->dry_run = true;
+    break;
+  case 'C':
+    args->canonicalize = true;
+    break;
+  case 'i':
+    args->clean_budget = default_clean_budget;
+    if (optarg != NULL && (sscanf(optarg, "%d", &args->clean_budget) != 1 ||
+                           args->clean_budget <= 0)) {
+      fprintf(stderr, "ERROR: Invalid argument for -i (--incremental): %s\n",
+              optarg);
+      return false;
+    }
+    break;
   }
-  args_init(args);
+  return true;
+}
+
+// Add a database to merge, to which the remaps that are not assigned yet
+// apply.
+static void add_merge_source(Arguments *args, const char *path) {
+  const int first_remap = assigned_remaps(args);
+  MergeSource *source = args->sources + args->n_sources++;
+  source->path = path;
+  source->first_remap = first_remap;
+  source->n_remaps = args->n_remaps - first_remap;
+}
 
+Arguments *parse_arguments(int argc, char **argv) {
   if (argc == 1) {
     help(argv[0]);
-    exit(EXIT_SUCCESS);
+    jumper_exit(EXIT_SUCCESS);
   }
   if (strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0 ||
       strcmp(argv[1], "-h") == 0) {
     help(argv[0]);
-    exit(EXIT_SUCCESS);
+    jumper_exit(EXIT_SUCCESS);
   }
   if (strcmp(argv[1], "version") == 0 || strcmp(argv[1], "--version") == 0 ||
       strcmp(argv[1], "-v") == 0) {
     print_version();
-    exit(EXIT_SUCCESS);
+    jumper_exit(EXIT_SUCCESS);
   }
-  args->mode = parse_mode(argv[1]);
+  const MODE mode = parse_mode(argv[1]);
+
+  Arguments *args = (Arguments *)malloc(sizeof(Arguments));
+  if (!args) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for arguments.\n");
+    jumper_exit(EXIT_FAILURE);
+  }
+  args_init(args);
+  args->mode = mode;
   if (args->mode == MODE_status) {
     args->n_results = 3;
+  } else if (args->mode == MODE_pick) {
+    args->n_results = default_pick_results;
+  } else if (args->mode == MODE_merge) {
+    // Each word is at most one database or remap
+    args->sources = (MergeSource *)malloc(argc * sizeof(MergeSource));
+    args->remaps = (Remap *)malloc(argc * sizeof(Remap));
+    if (!args->sources || !args->remaps) {
+      fprintf(stderr, "ERROR: Failed to allocate memory for arguments.\n");
+      invalid_arguments(args);
+    }
   }
-  args->filters = get_default_filters_path();
-  optind++;
-  int c = 0;
-  while (optind < argc && c != -1) {
-    c = getopt_long(argc, argv, "csoeHISt:f:n:w:b:x:r::F::BD", longopts, NULL);
-    if (c != -1) {
-      switch (c) {
-      case 'f':
-        args->file_path = optarg;
-        break;
-      case 'I':
-        args->case_mode = CASE_MODE_insensitive;
-        break;
-      case 'S':
-        args->case_mode = CASE_MODE_sensitive;
-        break;
-      case 'e':
-        args->existing = true;
-        break;
-      case 'c':
-        args->highlight = true;
-        break;
-      case 'H':
-        args->home_tilde = true;
-        break;
-      case 't':
-        args->type = parse_type(optarg);
-        break;
-      case 'x':
-        args->syntax = parse_syntax(optarg);
-        break;
-      case 'o':
-        args->orderless = true;
-        break;
-      case 's':
-        args->print_scores = true;
-        break;
-      case 'r':
-        if (optarg == NULL) {
-          args->relative_to = getcwd(NULL, 0);
-        } else {
-          args->relative_to = optarg;
-        }
-        break;
-      case 'F':
-        free((void *)args->filters);
-        args->filters = optarg;
-        break;
-      case 'n':
-        if (sscanf(optarg, "%d", &args->n_results) != 1) {
-          fprintf(stderr, "ERROR: Invalid argument for -n (--n-results): %s\n",
-                  optarg);
-          help(argv[0]);
-          exit(EXIT_FAILURE);
-        }
-        if (args->n_results < 0) {
-          fprintf(stderr,
-                  "ERROR: The number of results -n has to be non-negative.\n");
-          exit(EXIT_FAILURE);
-        }
-        break;
-      case 'b':
-        if (sscanf(optarg, "%lf", &args->beta) != 1) {
-          fprintf(stderr, "ERROR: Invalid argument for -b (--beta): %s\n",
-                  optarg);
-          help(argv[0]);
-          exit(EXIT_FAILURE);
-        }
-        break;
-      case 'w':
-        if (sscanf(optarg, "%lf", &args->weight) != 1) {
-          fprintf(stderr, "ERROR: Invalid argument for -w (--weight): %s\n",
-                  optarg);
-          help(argv[0]);
-          exit(EXIT_FAILURE);
-        }
-        if (args->weight < 0) {
-          fprintf(
-              stderr,
-              "ERROR: The weight of a visit (-w option) can't be negative.\n");
-          exit(EXIT_FAILURE);
-        }
-        break;
-      case 'B':
-        args->no_bind = true;
-        break;
-      case 'D':
-        args->dry_run = true;
-        break;
-      default:
-        help(argv[0]);
-        exit(EXIT_SUCCESS);
-      }
-    } else if (optind == argc - 1) {
-      args->key = argv[argc - 1];
-    } else {
-      fprintf(stderr, "ERROR: unknown argument %s\n", argv[optind]);
-      exit(EXIT_FAILURE);
+  args->default_filters = get_default_filters_path();
+  args->filters = args->default_filters;
+  // Several command lines may be parsed by the same process (see jumper.h):
+  // the working directory may have changed since a previous one stopped, and
+  // getopt is reset. It reads the words after the mode.
+  free(cwd);
+  cwd = NULL;
+  const int n_words = argc - 1;
+  char **words = argv + 1;
+  optind = 0;
+  const char *options =
+      (args->mode == MODE_merge) ? merge_short_options : short_options;
+  int c;
+  while ((c = getopt_long(n_words, words, options, longopts, NULL)) != -1) {
+    if (c == '?') {
+      help(argv[0]);
+      free_arguments(args);
+      jumper_exit(EXIT_SUCCESS);
     }
+    if (c == 1) {
+      add_merge_source(args, optarg);
+    } else if (!apply_option(args, c)) {
+      invalid_arguments(args);
+    }
+  }
+  // The words after "--"
+  while (args->mode == MODE_merge && optind < n_words) {
+    add_merge_source(args, words[optind++]);
+  }
+  // getopt moved ARG after the options
+  if (optind < n_words - 1) {
+    fprintf(stderr, "ERROR: unknown argument %s\n", words[optind]);
+    invalid_arguments(args);
+  }
+  if (optind == n_words - 1) {
+    args->key = words[optind];
   }
   validate_arguments(args);
   return args;
 }
+
+void free_arguments(Arguments *args) {
+  free(cwd);
+  cwd = NULL;
+  free(args->default_file_path);
+  free(args->default_filters);
+  free(args->sources);
+  free(args->remaps);
+  free(args);
+}
+
+// Split a request in words, in place: words are separated by blanks, and a
+// backslash escapes the next character. Returns the number of words, -1 if
+// there are more than max_words. The word "--" ends the options: the rest of
+// the line is then the query, verbatim, in *query.
+static int split_request(char *line, char **words, int max_words,
+                         char **query) {
+  int n = 0;
+  char *p = line;
+  *query = NULL;
+  while (true) {
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (*p == '\0' || *p == '\n') {
+      return n;
+    }
+    if (p[0] == '-' && p[1] == '-' &&
+        (p[2] == '\0' || p[2] == '\n' || p[2] == ' ' || p[2] == '\t')) {
+      *query = p + 2 + (p[2] == ' ' || p[2] == '\t');
+      (*query)[strcspn(*query, "\n")] = '\0';
+      return n;
+    }
+    if (n == max_words) {
+      return -1;
+    }
+    words[n++] = p;
+    char *out = p;
+    while (*p != '\0' && *p != '\n' && *p != ' ' && *p != '\t') {
+      if (*p == '\\' && p[1] != '\0' && p[1] != '\n') {
+        p++;
+      }
+      *out++ = *p++;
+    }
+    const bool end = (*p == '\0' || *p == '\n');
+    *out = '\0';
+    if (end) {
+      return n;
+    }
+    p++;
+  }
+}
+
+bool parse_request(const Arguments *defaults, char *line, Arguments *args) {
+  enum { MAX_WORDS = 64 };
+  char *argv[MAX_WORDS + 1];
+  char *query;
+  // getopt takes non-const words
+  char mode[] = "find";
+  argv[0] = mode;
+  const int n_words = split_request(line, argv + 1, MAX_WORDS, &query);
+  if (n_words < 0) {
+    fprintf(stderr, "ERROR: too many words in the request.\n");
+    return false;
+  }
+  const int argc = n_words + 1;
+  *args = *defaults;
+  args->key = query;
+  args->serve_stdin = false;
+  // The parsing of the command line arguments is over: reset getopt
+  optind = 0;
+  int c;
+  while ((c = getopt_long(argc, argv, short_options, longopts, NULL)) != -1) {
+    if (c == '?' || !apply_option(args, c)) {
+      return false;
+    }
+  }
+  // getopt moved the words that are not options at the end
+  if (optind < argc && (query != NULL || optind < argc - 1)) {
+    fprintf(stderr, "ERROR: unknown argument %s\n", argv[optind]);
+    return false;
+  }
+  if (optind == argc - 1) {
+    args->key = argv[optind];
+  }
+  if (args->key == NULL) {
+    args->key = "";
+  }
+  if (args->type == TYPE_undefined && args->existing) {
+    fprintf(stderr,
+            "ERROR: missing --type when using the --existing (-e) flag.\n");
+    return false;
+  }
+  if (federated(args)) {
+    fprintf(stderr, "ERROR: the server does not accept --type=all or --db.\n");
+    return false;
+  }
+  if (args->output != NULL) {
+    fprintf(stderr, "ERROR: --output (-O) only applies to merge.\n");
+    return false;
+  }
+  return true;
+}
@@ -2,6 +2,7 @@
 
 #include "matching.h"
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef enum MODE {
   MODE_search,
@@ -9,6 +10,8 @@ typedef enum MODE {
   MODE_update,
   MODE_shell,
   MODE_status,
+  MODE_pick,
+  MODE_merge,
 } MODE;
 
 typedef enum TYPE {
@@ -17,6 +20,24 @@ typedef enum TYPE {
   TYPE_undefined,
 } TYPE;
 
+// Databases that can be added to a search by --db
+#define MAX_EXTRA_DATABASES 16
+
+// Prefix of the paths of a merged database that is replaced (see --remap)
+typedef struct Remap {
+  const char *from;
+  size_t from_length;
+  const char *to;
+} Remap;
+
+// Database to merge: the remaps [first_remap, first_remap + n_remaps) of the
+// arguments apply to its paths.
+typedef struct MergeSource {
+  const char *path;
+  int first_remap;
+  int n_remaps;
+} MergeSource;
+
 typedef struct Arguments {
   const char *file_path;
   const char *key;
@@ -28,15 +49,45 @@ typedef struct Arguments {
   bool orderless;
   bool existing;
   bool no_bind;
+  bool cache; // of the shell's setup
   bool dry_run;
+  bool canonicalize;
+  bool explain_plan;
+  bool serve_stdin;
   TYPE type;
+  bool all_types; // search the databases of both types (--type=all)
+  // Databases searched together with the one of the type or file (--db)
+  const char *extra_databases[MAX_EXTRA_DATABASES];
+  int n_extra_databases;
   int n_results;
+  int clean_budget; // 0 for a full clean
+  int max_entries;  // size of the hot tier, 0 for no limit
   const char *relative_to;
+  const char *within; // only search this directory's subtree
+  long long since;    // only search entries visited since then (0 for any)
+  long long before;   // only search entries visited before then (0 for any)
   const char *filters;
+  const char *query; // for which the key of an update has been selected
+  // Databases of merge, in the order of the command line, and the remaps
+  // given before each of them (allocated by parse_arguments, NULL for the
+  // other modes)
+  MergeSource *sources;
+  int n_sources;
+  Remap *remaps;
+  int n_remaps;
+  const char *output; // database written by merge
   MODE mode;
   SYNTAX syntax;
   CASE_MODE case_mode;
+  // Default paths allocated by parse_arguments
+  char *default_file_path;
+  char *default_filters;
 } Arguments;
 
 Arguments *parse_arguments(int argc, char **argv);
+void free_arguments(Arguments *args);
+// Parse a request of the server (options and query, on one line) into args,
+// starting from the defaults. Modifies line, that args then points to.
+// Prints an error and returns false if the request is invalid.
+bool parse_request(const Arguments *defaults, char *line, Arguments *args);
 char *get_default_database_path(TYPE type);
@@ -0,0 +1,37 @@
+// Bash builtin: once loaded with `enable -f jumper.so jumper` (see the
+// makefile and `jumper shell bash`), the command jumper runs in the process of
+// the shell. Recording a visit at each prompt then takes neither a fork nor an
+// exec.
+#include <config.h>
+#include <stdlib.h>
+
+#include "loadables.h"
+
+#include "jumper.h"
+
+static int jumper_builtin(WORD_LIST *list) {
+  int argc;
+  // The words are not copied, argv[0] is the name of the command
+  char **argv = make_builtin_argv(list, &argc);
+  if (!argv) {
+    return EXECUTION_FAILURE;
+  }
+  const int status = jumper_main(argc, argv);
+  free(argv);
+  return status;
+}
+
+static char *jumper_doc[] = {
+    "Jump to the files and directories that you visit the most.",
+    "",
+    "Runs jumper in the process of the shell: see `jumper --help'.",
+    NULL};
+
+struct builtin jumper_struct = {
+    "jumper",                      // name
+    jumper_builtin,                // function
+    BUILTIN_ENABLED,               // flags
+    jumper_doc,                    // long documentation
+    "jumper MODE [OPTIONS] [ARG]", // usage
+    0,                             // handle of the shared object
+};
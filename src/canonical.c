@@ -0,0 +1,310 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "canonical.h"
+
+static const int max_threads = 16;
+// Number of paths that a worker takes at once
+static const int chunk_size = 64;
+
+typedef struct Entry {
+  char *key;      // prefix of a path, as found in the database
+  char *resolved; // its canonical form, NULL if it does not exist
+  mode_t mode;
+  struct Entry *next;
+} Entry;
+
+struct PathCache {
+  Entry **buckets;
+  size_t n_buckets;
+  size_t n_entries;
+  pthread_mutex_t lock;
+};
+
+PathCache *path_cache_create(void) {
+  PathCache *cache = (PathCache *)malloc(sizeof(PathCache));
+  if (!cache) {
+    return NULL;
+  }
+  cache->n_buckets = 1024;
+  cache->n_entries = 0;
+  cache->buckets = (Entry **)calloc(cache->n_buckets, sizeof(Entry *));
+  if (!cache->buckets) {
+    free(cache);
+    return NULL;
+  }
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+void path_cache_free(PathCache *cache) {
+  for (size_t i = 0; i < cache->n_buckets; i++) {
+    Entry *e = cache->buckets[i];
+    while (e) {
+      Entry *next = e->next;
+      free(e->key);
+      free(e->resolved);
+      free(e);
+      e = next;
+    }
+  }
+  free(cache->buckets);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+static size_t hash(const char *key, size_t len) {
+  size_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+// Must be called with the lock held
+static Entry *cache_find(PathCache *cache, const char *key, size_t len) {
+  Entry *e = cache->buckets[hash(key, len) & (cache->n_buckets - 1)];
+  while (e) {
+    if (strncmp(e->key, key, len) == 0 && e->key[len] == '\0') {
+      return e;
+    }
+    e = e->next;
+  }
+  return NULL;
+}
+
+// Must be called with the lock held
+static void cache_grow(PathCache *cache) {
+  const size_t n = 2 * cache->n_buckets;
+  Entry **buckets = (Entry **)calloc(n, sizeof(Entry *));
+  if (!buckets) {
+    return;
+  }
+  for (size_t i = 0; i < cache->n_buckets; i++) {
+    Entry *e = cache->buckets[i];
+    while (e) {
+      Entry *next = e->next;
+      const size_t b = hash(e->key, strlen(e->key)) & (n - 1);
+      e->next = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->n_buckets = n;
+}
+
+// Looks for the prefix path[0..len) in the cache. On success, *resolved
+// receives a copy of its canonical form (NULL if it does not exist).
+static bool cache_get(PathCache *cache, const char *path, size_t len,
+                      char **resolved, mode_t *mode) {
+  pthread_mutex_lock(&cache->lock);
+  Entry *e = cache_find(cache, path, len);
+  if (e) {
+    *resolved = e->resolved ? strdup(e->resolved) : NULL;
+    *mode = e->mode;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return e != NULL;
+}
+
+static void cache_put(PathCache *cache, const char *path, size_t len,
+                      const char *resolved, mode_t mode) {
+  pthread_mutex_lock(&cache->lock);
+  if (!cache_find(cache, path, len)) {
+    Entry *e = (Entry *)malloc(sizeof(Entry));
+    if (e) {
+      e->key = strndup(path, len);
+      e->resolved = resolved ? strdup(resolved) : NULL;
+      e->mode = mode;
+      const size_t b = hash(path, len) & (cache->n_buckets - 1);
+      e->next = cache->buckets[b];
+      cache->buckets[b] = e;
+      if (++cache->n_entries > cache->n_buckets) {
+        cache_grow(cache);
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static char *canonicalize_uncached(const char *path, mode_t *mode) {
+  char *resolved = realpath(path, NULL);
+  struct stat st;
+  if (resolved && stat(resolved, &st) == 0) {
+    *mode = st.st_mode;
+    return resolved;
+  }
+  free(resolved);
+  return NULL;
+}
+
+char *canonicalize(PathCache *cache, const char *path, mode_t *mode) {
+  mode_t m = 0;
+  if (!mode) {
+    mode = &m;
+  }
+  if (*path != '/') {
+    return canonicalize_uncached(path, mode);
+  }
+  // Split path into its components, skipping empty ones and '.'
+  const size_t len = strlen(path);
+  size_t *starts = (size_t *)malloc((len + 1) * sizeof(size_t));
+  size_t *ends = (size_t *)malloc((len + 1) * sizeof(size_t));
+  char *resolved = (char *)malloc(PATH_MAX + len + 2);
+  if (!starts || !ends || !resolved) {
+    free(starts);
+    free(ends);
+    free(resolved);
+    return canonicalize_uncached(path, mode);
+  }
+  int n_components = 0;
+  size_t i = 0;
+  while (i < len) {
+    while (i < len && path[i] == '/') {
+      i++;
+    }
+    const size_t start = i;
+    while (i < len && path[i] != '/') {
+      i++;
+    }
+    if (i > start && !(i - start == 1 && path[start] == '.')) {
+      starts[n_components] = start;
+      ends[n_components] = i;
+      n_components++;
+    }
+  }
+
+  // Longest prefix already resolved
+  int first = 0;
+  resolved[0] = '\0';
+  *mode = S_IFDIR;
+  for (int k = n_components - 1; k >= 0; k--) {
+    char *cached;
+    if (cache_get(cache, path, ends[k], &cached, mode)) {
+      if (!cached) {
+        goto not_found;
+      }
+      strcpy(resolved, cached);
+      free(cached);
+      first = k + 1;
+      break;
+    }
+  }
+
+  for (int k = first; k < n_components; k++) {
+    const size_t clen = ends[k] - starts[k];
+    if (clen == 2 && path[starts[k]] == '.' && path[starts[k] + 1] == '.') {
+      // resolved is canonical: its parent directory is obtained textually
+      char *slash = strrchr(resolved, '/');
+      if (slash) {
+        *slash = '\0';
+      }
+      *mode = S_IFDIR;
+    } else {
+      const size_t rlen = strlen(resolved);
+      if (rlen + clen + 2 > PATH_MAX + len + 2) {
+        goto not_found;
+      }
+      resolved[rlen] = '/';
+      memcpy(resolved + rlen + 1, path + starts[k], clen);
+      resolved[rlen + clen + 1] = '\0';
+      struct stat st;
+      if (lstat(resolved, &st) != 0) {
+        cache_put(cache, path, ends[k], NULL, 0);
+        goto not_found;
+      }
+      *mode = st.st_mode;
+      if (S_ISLNK(st.st_mode)) {
+        char *target = canonicalize_uncached(resolved, mode);
+        if (!target || strlen(target) > PATH_MAX + len) {
+          free(target);
+          cache_put(cache, path, ends[k], NULL, 0);
+          goto not_found;
+        }
+        strcpy(resolved, target);
+        free(target);
+      }
+    }
+    cache_put(cache, path, ends[k], resolved, *mode);
+  }
+  free(starts);
+  free(ends);
+  if (resolved[0] == '\0') {
+    strcpy(resolved, "/");
+  }
+  return resolved;
+
+not_found:
+  free(starts);
+  free(ends);
+  free(resolved);
+  return NULL;
+}
+
+typedef struct Job {
+  PathCache *cache;
+  const char **paths;
+  char **canonical;
+  mode_t *modes;
+  int n;
+  int next; // next path to process, protected by lock
+  pthread_mutex_t lock;
+} Job;
+
+static void *worker(void *arg) {
+  Job *job = (Job *)arg;
+  while (true) {
+    pthread_mutex_lock(&job->lock);
+    const int start = job->next;
+    job->next += chunk_size;
+    pthread_mutex_unlock(&job->lock);
+    if (start >= job->n) {
+      return NULL;
+    }
+    const int end = (start + chunk_size < job->n) ? start + chunk_size : job->n;
+    for (int i = start; i < end; i++) {
+      job->canonical[i] =
+          canonicalize(job->cache, job->paths[i], job->modes + i);
+    }
+  }
+}
+
+void canonicalize_all(PathCache *cache, const char **paths, char **canonical,
+                      mode_t *modes, int n) {
+  Job job = {.cache = cache,
+             .paths = paths,
+             .canonical = canonical,
+             .modes = modes,
+             .n = n,
+             .next = 0};
+  pthread_mutex_init(&job.lock, NULL);
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads > max_threads) {
+    n_threads = max_threads;
+  }
+  if (n_threads > n / chunk_size) {
+    n_threads = n / chunk_size;
+  }
+  pthread_t *threads = (pthread_t *)malloc(max_threads * sizeof(pthread_t));
+  int started = 0;
+  for (int t = 1; t < n_threads && threads; t++) {
+    if (pthread_create(threads + started, NULL, worker, &job) == 0) {
+      started++;
+    }
+  }
+  // The calling thread works too
+  worker(&job);
+  for (int t = 0; t < started; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&job.lock);
+}
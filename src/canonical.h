@@ -0,0 +1,22 @@
+#pragma once
+
+#include <sys/types.h>
+
+// Canonicalization of paths (symbolic links, '.' and '..' are resolved).
+// The canonical forms of the prefixes already visited are cached, so that
+// paths sharing a prefix only pay for their last components.
+typedef struct PathCache PathCache;
+
+PathCache *path_cache_create(void);
+
+void path_cache_free(PathCache *cache);
+
+// Returns the canonical form of path (to be freed by the caller), or NULL if
+// path does not exist. If mode is not NULL, it receives the file's mode.
+// Safe to call from several threads sharing the same cache.
+char *canonicalize(PathCache *cache, const char *path, mode_t *mode);
+
+// Canonicalize paths[0..n) on a pool of threads sharing cache.
+// canonical[i] and modes[i] receive the results of canonicalize(paths[i]).
+void canonicalize_all(PathCache *cache, const char **paths, char **canonical,
+                      mode_t *modes, int n);
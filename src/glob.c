@@ -122,11 +122,11 @@ char **read_filters(const char *path) {
     // Validate filter before adding it
     const char *error_msg = NULL;
     if (!is_valid_filter(f->line, &error_msg)) {
-      fprintf(stderr, "WARNING: Invalid filter at line %d in %s\n",
-              line_num, path);
-      fprintf(stderr, "         Pattern: '%s'\n", f->line);
-      fprintf(stderr, "         Reason: %s\n", error_msg);
-      fprintf(stderr, "         This filter will be ignored.\n\n");
+      report_warning("Invalid filter at line %d in %s\n"
+                     "         Pattern: '%s'\n"
+                     "         Reason: %s\n"
+                     "         This filter will be ignored.\n",
+                     line_num, path, f->line, error_msg);
       continue;
     }
 
@@ -297,3 +297,38 @@ bool glob_match_list(char **patterns, const char *path) {
   }
   return false;
 }
+
+unsigned int filters_generation(const char *path) {
+  return path ? file_generation(path) : 0;
+}
+
+void filters_init(Filters *filters, const char *path) {
+  filters->path = path;
+  filters->generation = filters_generation(path);
+  filters->loaded = false;
+  filters->patterns = NULL;
+  filters->n_stale = 0;
+}
+
+bool filters_match(Filters *filters, Record *rec) {
+  if (filters->generation == 0) {
+    return false;
+  }
+  if (rec->filter_generation == filters->generation) {
+    return rec->filtered;
+  }
+  if (!filters->loaded) {
+    filters->patterns = read_filters(filters->path);
+    filters->loaded = true;
+  }
+  rec->filtered = glob_match_list(filters->patterns, rec->path);
+  rec->filter_generation = filters->generation;
+  filters->n_stale++;
+  return rec->filtered;
+}
+
+void filters_free(Filters *filters) {
+  free_filters(filters->patterns);
+  filters->patterns = NULL;
+  filters->loaded = false;
+}
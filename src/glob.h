@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "record.h"
+
 // Match a path against a single glob pattern
 // Supports: * (any characters), ? (single character), [...] (character class)
 bool glob_match(const char *pattern, const char *path);
@@ -13,3 +15,26 @@ bool glob_match_list(char **patterns, const char *path);
 
 char **read_filters(const char *path);
 void free_filters(char ** filters);
+
+// Generation of the filters' file, computed from its metadata only (the file
+// is not read). Returns 0 if filtering is disabled or if the file does not
+// exist.
+unsigned int filters_generation(const char *path);
+
+// Filters of a query/update. The patterns are only read from the filters' file
+// when a record does not carry a verdict for the current generation.
+typedef struct Filters {
+  const char *path;
+  unsigned int generation;
+  bool loaded;
+  char **patterns;
+  int n_stale; // number of records whose verdict had to be recomputed
+} Filters;
+
+void filters_init(Filters *filters, const char *path);
+
+// Returns true if rec has to be filtered out. Stamps rec with the verdict
+// for the current generation.
+bool filters_match(Filters *filters, Record *rec);
+
+void filters_free(Filters *filters);
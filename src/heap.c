@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +24,7 @@ typedef struct Heap {
   int n_items;    // number of items currently stored
   int size;       // maximum number of items
   int alloc_size; // current allocated size
+  bool sorted;    // items are sorted by decreasing value
   Item *items;
 } Heap;
 
@@ -34,6 +36,7 @@ Heap *heap_create(int size) {
   heap->n_items = 0;
   heap->size = size;
   heap->alloc_size = 512;
+  heap->sorted = false;
   heap->items = (Item *)malloc(heap->alloc_size * sizeof(Item));
   if (!heap->items) {
     return NULL;
@@ -43,6 +46,9 @@ Heap *heap_create(int size) {
 }
 
 void heap_free(Heap *heap) {
+  for (int i = 0; i < heap->n_items; i++) {
+    free(heap->items[i].path);
+  }
   free(heap->items);
   free(heap);
 }
@@ -90,6 +96,10 @@ bool heap_accept(Heap *heap, double value) {
   return (heap->n_items < heap->size) || (value > heap->items->value);
 }
 
+double heap_threshold(Heap *heap) {
+  return (heap->n_items < heap->size) ? -INFINITY : heap->items->value;
+}
+
 int heap_insert(Heap *heap, double value, char *path) {
   if (heap->n_items == heap->alloc_size && heap->size > heap->alloc_size &&
       heap_grow(heap) != 0) {
@@ -111,9 +121,11 @@ int heap_insert(Heap *heap, double value, char *path) {
   return 0;
 }
 
-void heap_print(Heap *heap, bool print_scores, const char *relative_to,
-                bool tilde, const char *prefix) {
+int heap_sort(Heap *heap) {
   const int n = heap->n_items;
+  if (heap->sorted) {
+    return n;
+  }
   if (n != heap->size) {
     heapify(heap);
   }
@@ -122,34 +134,49 @@ void heap_print(Heap *heap, bool print_scores, const char *relative_to,
     swap(heap->items, heap->items + heap->n_items);
     bubble_down(heap, 0);
   }
-  const char *home_folder = NULL;
-  int home_len = 0;
-  if (tilde) {
-    home_folder = getenv("HOME");
-    if (home_folder) {
-      home_len = strlen(home_folder);
-    }
-  }
+  heap->n_items = n;
+  heap->sorted = true;
+  return n;
+}
+
+int heap_count(Heap *heap) { return heap->n_items; }
+
+char *heap_path(Heap *heap, int i) { return heap->items[i].path; }
+
+double heap_value(Heap *heap, int i) { return heap->items[i].value; }
+
+void heap_set_path(Heap *heap, int i, char *path) {
+  free(heap->items[i].path);
+  heap->items[i].path = path;
+}
+
+void heap_print_item(Heap *heap, int i, bool print_scores,
+                     const char *relative_to, bool tilde, const char *prefix) {
+  const char *home_folder = tilde ? getenv("HOME") : NULL;
+  const int home_len = home_folder ? strlen(home_folder) : 0;
   const int relative_len = (relative_to == NULL) ? 0 : strlen(relative_to);
-  const char *path;
+  if (prefix)
+    printf("%s", prefix);
+  if (print_scores) {
+    printf("%.3f  ", heap->items[i].value);
+  }
+  const char *path = heap->items[i].path;
+  if (relative_len > 0 && strncmp(path, relative_to, relative_len) == 0 &&
+      path[relative_len] == '/') {
+    printf("%s\n", path + relative_len + 1);
+  } else if (home_folder && strncmp(path, home_folder, home_len) == 0 &&
+             path[home_len] == '/') {
+    printf("~%s\n", path + home_len);
+  } else {
+    printf("%s\n", path);
+  }
+}
+
+void heap_print(Heap *heap, bool print_scores, const char *relative_to,
+                bool tilde, const char *prefix) {
+  const int n = heap_sort(heap);
   for (int i = 0; i < n; i++) {
-    if (prefix)
-      printf("%s", prefix);
-    if (print_scores) {
-      printf("%.3f  ", heap->items[i].value);
-    }
-    path = heap->items[i].path;
-    if (relative_len > 0 && strncmp(path, relative_to, relative_len) == 0 &&
-        path[relative_len] == '/') {
-      printf("%s\n", path + relative_len + 1);
-    } else if (tilde && home_folder &&
-               strncmp(path, home_folder, home_len) == 0 &&
-               path[home_len] == '/') {
-      printf("~%s\n", path + home_len);
-    } else {
-      printf("%s\n", path);
-    }
-    free(heap->items[i].path);
+    heap_print_item(heap, i, print_scores, relative_to, tilde, prefix);
   }
   heap_free(heap);
 }
@@ -7,9 +7,34 @@ Heap *heap_create(int size);
 
 bool heap_accept(Heap *heap, double value);
 
+// Values have to be above it to be accepted (-INFINITY until the heap is full)
+double heap_threshold(Heap *heap);
+
 int heap_insert(Heap *heap, double priority, char *path);
 
+// Frees the heap and the paths of its items
 void heap_free(Heap *heap);
 
+// Sort the items by decreasing value, and return their number. Nothing can be
+// inserted afterwards.
+int heap_sort(Heap *heap);
+
+// Number of items. Before heap_sort, heap_path and heap_value give them in no
+// particular order.
+int heap_count(Heap *heap);
+
+// Path of the i-th item, once sorted
+char *heap_path(Heap *heap, int i);
+
+// Value of the i-th item, once sorted
+double heap_value(Heap *heap, int i);
+
+// Replace (and free) the path of the i-th item, once sorted
+void heap_set_path(Heap *heap, int i, char *path);
+
 void heap_print(Heap *heap, bool print_scores, const char *relative_to,
                 bool tilde, const char *prefix);
+
+// Print the i-th item, once sorted, as heap_print does
+void heap_print_item(Heap *heap, int i, bool print_scores,
+                     const char *relative_to, bool tilde, const char *prefix);
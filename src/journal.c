@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "meta.h"
+#include "textfile.h"
+#include "visit.h"
+
+static const char journal_suffix[] = ".time";
+// The clock may go backward: lines are only assumed to be sorted up to this
+// many seconds.
+static const long long slack = 24 * 3600;
+// Each visit appends a line: the journal is compacted to the latest line of
+// each path once it is larger than this many times the database and its
+// archive, which it also covers, and than min_compact_size bytes.
+static const long compact_ratio = 2;
+static const long min_compact_size = 64 * 1024;
+
+static long long line_time(const char *line) {
+  const char *sep = strchr(line, '|');
+  if (sep) {
+    sep = strchr(sep + 1, '|');
+  }
+  return sep ? atoll(sep + 1) : 0;
+}
+
+static int compare_time(const char *line, const void *key) {
+  const long long t = line_time(line);
+  const long long k = *(const long long *)key;
+  return (t > k) - (t < k);
+}
+
+static void set_start(const char *db_path, long long start) {
+  Meta *meta = meta_load(db_path);
+  if (meta) {
+    meta_set(meta, "journal_start", (double)start);
+    meta_save(meta);
+    meta_free(meta);
+  }
+}
+
+typedef struct Entry {
+  char *line;
+  int order;
+} Entry;
+
+static int compare_records(const void *a, const void *b) {
+  const Record *x = *(const Record **)a;
+  const Record *y = *(const Record **)b;
+  if (x->last_visit != y->last_visit) {
+    return (x->last_visit < y->last_visit) ? -1 : 1;
+  }
+  return (x < y) ? -1 : (x > y);
+}
+
+static bool same_path(const char *x, const char *y) {
+  const size_t lx = strcspn(x, "|");
+  return lx == strcspn(y, "|") && memcmp(x, y, lx) == 0;
+}
+
+// Entries of the same path are grouped, latest first
+static int compare_entries(const void *a, const void *b) {
+  const Entry *x = (const Entry *)a;
+  const Entry *y = (const Entry *)b;
+  const size_t lx = strcspn(x->line, "|");
+  const size_t ly = strcspn(y->line, "|");
+  const int c = memcmp(x->line, y->line, lx < ly ? lx : ly);
+  if (c != 0) {
+    return c;
+  }
+  if (lx != ly) {
+    return (lx < ly) ? -1 : 1;
+  }
+  return y->order - x->order;
+}
+
+void journal_build(const char *db_path, Record **records, int n) {
+  char *path = sidecar_path(db_path, journal_suffix);
+  char *temp = path ? (char *)malloc(strlen(path) + 32) : NULL;
+  Record **sorted = (Record **)malloc((n + 1) * sizeof(Record *));
+  if (!path || !temp || !sorted) {
+    free(path);
+    free(temp);
+    free(sorted);
+    return;
+  }
+  memcpy(sorted, records, n * sizeof(Record *));
+  qsort(sorted, n, sizeof(Record *), compare_records);
+
+  sprintf(temp, "%s.%ld", path, (long)getpid());
+  FILE *fp = fopen(temp, "w");
+  bool ok = (fp != NULL);
+  for (int i = 0; i < n && ok; i++) {
+    char *rec_string = record_to_string(sorted[i]);
+    ok = rec_string && fprintf(fp, "%s\n", rec_string) > 0;
+    free(rec_string);
+  }
+  ok = ok && (fclose(fp) == 0);
+  if (ok && rename(temp, path) == 0) {
+    // The journal now covers all the visits
+    set_start(db_path, 0);
+  } else {
+    unlink(temp);
+  }
+  free(sorted);
+  free(temp);
+  free(path);
+}
+
+// Read the lines of f, from its position, whose time is not before since.
+// Only the latest line of each path is kept: *entries receives them, grouped
+// by path. Returns their number, -1 if it fails.
+static int read_latest(Textfile *f, long long since, Entry **entries) {
+  int n = 0;
+  int alloc_size = 256;
+  Entry *all = (Entry *)malloc(alloc_size * sizeof(Entry));
+  bool failed = (all == NULL);
+  while (!failed && next_line(f)) {
+    if (line_time(f->line) < since) {
+      continue;
+    }
+    if (n == alloc_size) {
+      alloc_size *= 2;
+      Entry *grown = (Entry *)realloc(all, alloc_size * sizeof(Entry));
+      failed = (grown == NULL);
+      if (failed) {
+        break;
+      }
+      all = grown;
+    }
+    all[n].line = strdup(f->line);
+    failed = (all[n].line == NULL);
+    if (failed) {
+      break;
+    }
+    all[n].order = n;
+    n++;
+  }
+  if (failed) {
+    for (int i = 0; all && i < n; i++) {
+      free(all[i].line);
+    }
+    free(all);
+    return -1;
+  }
+  qsort(all, n, sizeof(Entry), compare_entries);
+  int n_latest = 0;
+  for (int i = 0; i < n; i++) {
+    if (n_latest > 0 && same_path(all[n_latest - 1].line, all[i].line)) {
+      free(all[i].line);
+    } else {
+      all[n_latest++] = all[i];
+    }
+  }
+  *entries = all;
+  return n_latest;
+}
+
+static int compare_order(const void *a, const void *b) {
+  return ((const Entry *)a)->order - ((const Entry *)b)->order;
+}
+
+// Rewrite the journal at path with the latest line of each path that is still
+// in the database, in their order.
+static void compact(const char *path) {
+  Textfile *f = file_open(path);
+  if (!f) {
+    return;
+  }
+  Entry *entries;
+  const int n = read_latest(f, 0, &entries);
+  file_close(f);
+  if (n < 0) {
+    return;
+  }
+  qsort(entries, n, sizeof(Entry), compare_order);
+  char *temp = (char *)malloc(strlen(path) + 32);
+  FILE *fp = NULL;
+  if (temp) {
+    sprintf(temp, "%s.%ld", path, (long)getpid());
+    fp = fopen(temp, "w");
+  }
+  bool ok = (fp != NULL);
+  for (int i = 0; i < n; i++) {
+    Record rec;
+    // Removed records, and lines cut short by a crash, are dropped
+    if (ok && parse_record(entries[i].line, &rec) && rec.n_visits >= 0) {
+      char *rec_string = record_to_string(&rec);
+      ok = rec_string && fprintf(fp, "%s\n", rec_string) > 0;
+      free(rec_string);
+    }
+    free(entries[i].line);
+  }
+  free(entries);
+  if (fp) {
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(temp, path) != 0) {
+      unlink(temp);
+    }
+  }
+  free(temp);
+}
+
+// Size in bytes of the file at path, 0 if it does not exist.
+static long file_bytes(const char *path) {
+  struct stat st;
+  return (path && stat(path, &st) == 0) ? (long)st.st_size : 0;
+}
+
+static void append_record(const char *db_path, const Record *rec,
+                          long long now, bool create) {
+  char *path = sidecar_path(db_path, journal_suffix);
+  char *cold_path = sidecar_path(db_path, COLD_SUFFIX);
+  char *rec_string = record_to_string((Record *)rec);
+  if (!path || !cold_path || !rec_string) {
+    free(path);
+    free(cold_path);
+    free(rec_string);
+    return;
+  }
+  if (access(path, F_OK) != 0) {
+    if (!create) {
+      free(path);
+      free(cold_path);
+      free(rec_string);
+      return;
+    }
+    set_start(db_path, now);
+  }
+  FILE *fp = fopen(path, "a");
+  long size = -1;
+  if (fp) {
+    fprintf(fp, "%s\n", rec_string);
+    size = ftell(fp);
+    fclose(fp);
+  }
+  if (size > min_compact_size &&
+      size > compact_ratio * (file_bytes(db_path) + file_bytes(cold_path))) {
+    compact(path);
+  }
+  free(rec_string);
+  free(cold_path);
+  free(path);
+}
+
+void journal_append(const char *db_path, const Record *rec, long long now) {
+  append_record(db_path, rec, now, true);
+}
+
+void journal_drop(const char *db_path) {
+  char *path = sidecar_path(db_path, journal_suffix);
+  if (path) {
+    unlink(path);
+    free(path);
+  }
+}
+
+void journal_remove(const char *db_path, const char *path, long long now) {
+  // Removals are recorded as records with a negative number of visits
+  Record rec = {.path = path, .n_visits = -1, .last_visit = now};
+  append_record(db_path, &rec, now, false);
+}
+
+// First time covered by the journal, -1 if there is no journal.
+static double get_start(const char *db_path) {
+  Meta *meta = meta_load(db_path);
+  const double start = meta ? meta_get(meta, "journal_start", -1) : -1;
+  if (meta) {
+    meta_free(meta);
+  }
+  char *path = sidecar_path(db_path, journal_suffix);
+  const bool exists = path && access(path, F_OK) == 0;
+  free(path);
+  return exists ? start : -1;
+}
+
+// Open the journal at the first line that may have been visited since then,
+// NULL if it does not cover all the visits since then.
+static Textfile *open_since(const char *db_path, long long since) {
+  const double start = get_start(db_path);
+  if (start < 0 || start > since) {
+    return NULL;
+  }
+  char *path = sidecar_path(db_path, journal_suffix);
+  Textfile *f = path ? file_open(path) : NULL;
+  free(path);
+  if (!f) {
+    return NULL;
+  }
+  const long long first = since - slack;
+  file_seek(f, lower_bound(f, file_size(f), compare_time, &first));
+  return f;
+}
+
+long journal_bytes_since(const char *db_path, long long since) {
+  Textfile *f = open_since(db_path, since);
+  if (!f) {
+    return -1;
+  }
+  const long bytes = file_size(f) - file_tell(f);
+  file_close(f);
+  return bytes;
+}
+
+bool journal_since(const char *db_path, long long since, Recent *recent) {
+  recent->records = NULL;
+  recent->lines = NULL;
+  recent->n = 0;
+  Textfile *f = open_since(db_path, since);
+  if (!f) {
+    return false;
+  }
+
+  Entry *entries;
+  const int n = read_latest(f, since, &entries);
+  file_close(f);
+  if (n < 0) {
+    // The visits are then searched in the database
+    return false;
+  }
+  recent->records = (Record *)malloc((n + 1) * sizeof(Record));
+  recent->lines = (char **)malloc((n + 1) * sizeof(char *));
+  if (!recent->records || !recent->lines) {
+    for (int i = 0; i < n; i++) {
+      free(entries[i].line);
+    }
+    free(entries);
+    recent_free(recent);
+    recent->records = NULL;
+    recent->lines = NULL;
+    return false;
+  }
+  for (int i = 0; i < n; i++) {
+    Record *rec = recent->records + recent->n;
+    // Malformed lines, such as a line cut short by a crash, are skipped
+    if (!parse_record(entries[i].line, rec) || rec->n_visits < 0) {
+      free(entries[i].line);
+      continue;
+    }
+    recent->lines[recent->n++] = entries[i].line;
+  }
+  free(entries);
+  return true;
+}
+
+void recent_free(Recent *recent) {
+  for (int i = 0; i < recent->n; i++) {
+    free(recent->lines[i]);
+  }
+  free(recent->lines);
+  free(recent->records);
+}
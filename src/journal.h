@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "record.h"
+
+// Journal of the visits of a database, stored in <database>.time. Its lines
+// are records, in the order of their last visits: it is rebuilt from the
+// database by clean, and then each update appends the record it has visited.
+// Once it outgrows the database and its archive (see visit.h), it is
+// compacted to the latest line of each path.
+// Queries restricted to recent visits only read the end of the journal.
+typedef struct Recent {
+  Record *records; // latest version of each recently visited record
+  char **lines;    // the records' paths point into lines
+  int n;
+} Recent;
+
+// Replace the journal by the records[0..n) of the database.
+void journal_build(const char *db_path, Record **records, int n);
+
+// Append rec after a visit. The journal is created if it does not exist, and
+// then only covers the visits from now on.
+void journal_append(const char *db_path, const Record *rec, long long now);
+
+// Remove the journal of a database that has been rewritten without it. The
+// next visit starts a new one, until clean rebuilds it.
+void journal_drop(const char *db_path);
+
+// Record that path has been removed from the database.
+void journal_remove(const char *db_path, const char *path, long long now);
+
+// Records whose last visit is not before since. Returns false if the journal
+// does not cover all the visits since then.
+bool journal_since(const char *db_path, long long since, Recent *recent);
+
+// Size in bytes of the part of the journal that journal_since reads, -1 if it
+// does not cover all the visits since then.
+long journal_bytes_since(const char *db_path, long long since);
+
+void recent_free(Recent *recent);
@@ -1,7 +1,11 @@
 #include <ctype.h>
 #include <errno.h>
 #include <libgen.h>
+#include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,255 +14,2929 @@
 #include <unistd.h>
 
 #include "arguments.h"
+#include "canonical.h"
 #include "glob.h"
 #include "heap.h"
+#include "journal.h"
+#include "jumper.h"
 #include "matching.h"
+#include "memo.h"
+#include "meta.h"
+#include "pick.h"
 #include "progress_bar.h"
 #include "query.h"
 #include "record.h"
 #include "shell.h"
 #include "textfile.h"
+#include "top.h"
+#include "visit.h"
 
+// Whether path exists, as a file or directory of the given type (of any type
+// if it is undefined).
 static inline bool exist(const char *path, TYPE type) {
   struct stat stats;
   if (stat(path, &stats) == 0) {
-    return (((type == TYPE_directories) && (S_ISDIR(stats.st_mode) != 0)) ||
-            ((type == TYPE_files) && (S_ISREG(stats.st_mode) != 0)));
+    return (type == TYPE_undefined) ||
+           ((type == TYPE_directories) && (S_ISDIR(stats.st_mode) != 0)) ||
+           ((type == TYPE_files) && (S_ISREG(stats.st_mode) != 0));
   }
   return false;
 }
 
-static void clean_database(Arguments *args) {
-  Textfile *f = file_open(args->file_path);
-  if (!f) {
+// Resources of the running command that an error exit (see jumper_exit) would
+// leave behind: open files, temporary files and the larger allocations. As
+// jumper may run in the process of a shell (see builtin.c), jumper_main
+// releases them, the latest first, when jumper_exit jumps back to it. Their
+// owners let go of them when they release them. Only the objects allocated on
+// the heap can be held: the frames of the stack are gone by then.
+typedef struct Resource {
+  void *data;
+  void (*release)(void *data);
+} Resource;
+
+static Resource *resources = NULL;
+static int n_resources = 0;
+static int resources_size = 0;
+// The searches of federated_lookup open files in several threads
+static pthread_mutex_t resources_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void hold(void *data, void (*release)(void *data)) {
+  if (!data) {
     return;
   }
-  char *path_copy = strdup(args->file_path);
+  pthread_mutex_lock(&resources_lock);
+  if (n_resources == resources_size) {
+    const int size = resources_size ? 2 * resources_size : 32;
+    Resource *grown = (Resource *)realloc(resources, size * sizeof(Resource));
+    if (grown) {
+      resources = grown;
+      resources_size = size;
+    }
+  }
+  // Without memory, the resource is left as before
+  if (n_resources < resources_size) {
+    resources[n_resources].data = data;
+    resources[n_resources].release = release;
+    n_resources++;
+  }
+  pthread_mutex_unlock(&resources_lock);
+}
+
+static void let_go(const void *data) {
+  pthread_mutex_lock(&resources_lock);
+  for (int i = n_resources - 1; i >= 0; i--) {
+    if (resources[i].data == data) {
+      memmove(resources + i, resources + i + 1,
+              (n_resources - i - 1) * sizeof(Resource));
+      n_resources--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&resources_lock);
+}
+
+// Release the resources that are still held if release, and forget them.
+static void release_resources(bool release) {
+  while (release && n_resources > 0) {
+    const Resource resource = resources[--n_resources];
+    resource.release(resource.data);
+  }
+  free(resources);
+  resources = NULL;
+  n_resources = 0;
+  resources_size = 0;
+}
+
+static void release_textfile(void *f) { file_close((Textfile *)f); }
+
+static void release_stream(void *fp) { fclose((FILE *)fp); }
+
+static void release_temp_file(void *tempname) {
+  unlink((char *)tempname);
+  free(tempname);
+}
+
+// file_open, file_open_rw and file_close, for the files that the command holds
+static Textfile *open_file(const char *path) {
+  Textfile *f = file_open(path);
+  hold(f, release_textfile);
+  return f;
+}
+
+static Textfile *open_file_rw(const char *path) {
+  Textfile *f = file_open_rw(path);
+  hold(f, release_textfile);
+  return f;
+}
+
+static void close_file(Textfile *f) {
+  let_go(f);
+  file_close(f);
+}
+
+static int close_stream(FILE *fp) {
+  let_go(fp);
+  return fclose(fp);
+}
+
+// Remove a temporary file of open_temp_file, and free its name.
+static void remove_temp_file(char *tempname) {
+  let_go(tempname);
+  release_temp_file(tempname);
+}
+
+// Create a temporary file in the directory of path, with the same
+// permissions. The database is then rewritten atomically by renaming the
+// temporary file.
+static FILE *open_temp_file(const char *path, char **tempname) {
+  char *path_copy = strdup(path);
   char *dir = dirname(path_copy);
-  char *tempname = (char *)malloc((strlen(dir) + 20) * sizeof(char));
-  if (!tempname) {
+  *tempname = (char *)malloc((strlen(dir) + 20) * sizeof(char));
+  if (!*tempname) {
     fprintf(stderr, "ERROR: failed to allocate %lu bytes.\n", strlen(dir) + 20);
     free(path_copy);
-    exit(EXIT_FAILURE);
+    jumper_exit(EXIT_FAILURE);
+  }
+  strcpy(*tempname, dir);
+  strcat(*tempname, "/.jumper_XXXXXX");
+  free(path_copy);
+  const int temp_fd = mkstemp(*tempname);
+  if (temp_fd == -1) {
+    fprintf(stderr, "ERROR: Could not create the temporary file %s\n",
+            *tempname);
+    free(*tempname);
+    jumper_exit(EXIT_FAILURE);
+  }
+  // The temporary file is removed if the command stops before it is used
+  hold(*tempname, release_temp_file);
+  FILE *temp = fdopen(temp_fd, "r+");
+  if (!temp) {
+    fprintf(stderr,
+            "ERROR: Could not open the file descriptor %d of the temporary "
+            "file %s\n",
+            temp_fd, *tempname);
+    close(temp_fd);
+    jumper_exit(EXIT_FAILURE);
+  }
+  hold(temp, release_stream);
+
+  // Preserve permissions from original file
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    fchmod(temp_fd, st.st_mode);
+  }
+  return temp;
+}
+
+// Replace the database by the temporary file (or only report it for dry runs)
+static void replace_database(Arguments *args, char *tempname, bool changed) {
+  // Only rename if something was changed
+  if (!changed) {
+    remove_temp_file(tempname);
+    return;
+  }
+  let_go(tempname);
+
+  if (args->dry_run) {
+    fprintf(stdout, "Dry run: filtered data saved to %s\n", tempname);
+    fprintf(stdout, "Original database unchanged: %s\n", args->file_path);
+    free(tempname);
+    return;
+  }
+
+  if (rename(tempname, args->file_path) != 0) {
+    fprintf(stderr, "ERROR: Failed to replace database file: %s\n",
+            strerror(errno));
+    fprintf(stderr, "Cleaned data is in: %s\n", tempname);
+    free(tempname);
+    jumper_exit(EXIT_FAILURE);
+  }
+  free(tempname);
+}
+
+static bool write_record(FILE *fp, Record *rec) {
+  char *rec_string = record_to_string(rec);
+  const bool ok = rec_string && fputs(rec_string, fp) != EOF &&
+                  fputs("\n", fp) != EOF;
+  free(rec_string);
+  return ok;
+}
+
+// Free the lines of load_records, which end with NULL.
+static void release_lines(void *data) {
+  char **lines = (char **)data;
+  for (char **line = lines; *line; line++) {
+    free(*line);
+  }
+  free(lines);
+}
+
+// Read all the records of a database. The records' paths point into lines,
+// which have to be freed by the caller. Returns the number of records, or -1
+// if the file does not exist.
+static int load_records(const char *path, Record **records, char ***lines) {
+  Textfile *f = file_open(path);
+  if (!f) {
+    return -1;
+  }
+  int n = 0;
+  int size = 1024;
+  *records = (Record *)malloc(size * sizeof(Record));
+  // The lines end with NULL, for release_lines
+  *lines = (char **)malloc((size + 1) * sizeof(char *));
+  bool ok = *records && *lines;
+  while (ok && next_line(f)) {
+    if (n == size) {
+      size *= 2;
+      Record *grown = (Record *)realloc(*records, size * sizeof(Record));
+      *records = grown ? grown : *records;
+      char **lines_grown =
+          (char **)realloc(*lines, (size + 1) * sizeof(char *));
+      *lines = lines_grown ? lines_grown : *lines;
+      ok = grown && lines_grown;
+      if (!ok) {
+        break;
+      }
+    }
+    (*lines)[n] = strdup(f->line);
+    if (!(*lines)[n]) {
+      ok = false;
+      break;
+    }
+    if (!parse_record((*lines)[n], *records + n)) {
+      report_invalid_record(f);
+      free((*lines)[n]);
+      continue;
+    }
+    n++;
+  }
+  file_close(f);
+  if (*lines) {
+    (*lines)[n] = NULL;
+  }
+  if (!ok) {
+    fprintf(stderr, "ERROR: Could not allocate memory for %d entries.\n", n);
+    for (int i = 0; *lines && i < n; i++) {
+      free((*lines)[i]);
+    }
+    free(*lines);
+    free(*records);
+    jumper_exit(EXIT_FAILURE);
+  }
+  hold(*records, free);
+  hold(*lines, release_lines);
+  return n;
+}
+
+static void free_records(Record *records, char **lines, int n) {
+  let_go(lines);
+  let_go(records);
+  for (int i = 0; i < n; i++) {
+    free(lines[i]);
+  }
+  free(lines);
+  free(records);
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp((*(const Record **)a)->path, (*(const Record **)b)->path);
+}
+
+// Write the records in path order: the paths of a directory are contiguous, so
+// that lookups share the matching of their common prefix.
+static bool write_sorted_records(FILE *fp, Record **kept, int n) {
+  qsort(kept, n, sizeof(Record *), compare_paths);
+  bool ok = true;
+  for (int i = 0; i < n && ok; i++) {
+    ok = write_record(fp, kept[i]);
+  }
+  return ok;
+}
+
+// The databases start with a region of sorted_bytes bytes (saved in the
+// metadata) whose records are sorted by path, followed by the records added
+// since the database was last rewritten.
+static long get_sorted_bytes(const Meta *meta, FILE *fp) {
+  const long sorted = (long)meta_get(meta, "sorted_bytes", 0);
+  const long position = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  const long size = ftell(fp);
+  bool valid = sorted > 0 && sorted <= size;
+  if (valid) {
+    // A database rewritten by something else can not be trusted
+    fseek(fp, sorted - 1, SEEK_SET);
+    valid = (fgetc(fp) == '\n');
+  }
+  fseek(fp, position, SEEK_SET);
+  return valid ? sorted : 0;
+}
+
+static void set_sorted_bytes(const char *path, long sorted) {
+  Meta *meta = meta_load(path);
+  if (meta) {
+    meta_set(meta, "sorted_bytes", (double)sorted);
+    meta_save(meta);
+    meta_free(meta);
+  }
+}
+
+// Statistics used to plan searches: average lengths of the lines and of the
+// paths, and fraction of the paths that contain each character (see
+// char_mask). They are accumulated path by path.
+typedef struct PathStatistics {
+  long n;
+  double path_bytes;
+  long counts[CHAR_BITS];
+} PathStatistics;
+
+static void add_path_statistics(PathStatistics *stats, const char *path) {
+  const size_t len = strlen(path);
+  const unsigned long long mask = char_mask(path, len);
+  stats->n++;
+  stats->path_bytes += len;
+  for (int b = 0; b < CHAR_BITS; b++) {
+    stats->counts[b] += (mask >> b) & 1;
+  }
+}
+
+static void save_path_statistics(const char *path,
+                                 const PathStatistics *stats) {
+  struct stat st;
+  Meta *meta = meta_load(path);
+  const long n = stats->n;
+  if (!meta || n == 0 || stat(path, &st) != 0) {
+    if (meta) {
+      meta_free(meta);
+    }
+    return;
+  }
+  meta_set(meta, "line_length", (double)st.st_size / n);
+  meta_set(meta, "path_length", stats->path_bytes / n);
+  char key[32];
+  for (int b = 0; b < CHAR_BITS; b++) {
+    snprintf(key, sizeof(key), "char_frequency_%d", b);
+    meta_set(meta, key, (double)stats->counts[b] / n);
+  }
+  meta_save(meta);
+  meta_free(meta);
+}
+
+static void save_statistics(const char *path, const Record *records, int n) {
+  PathStatistics stats = {0};
+  for (int i = 0; i < n; i++) {
+    add_path_statistics(&stats, records[i].path);
+  }
+  save_path_statistics(path, &stats);
+}
+
+// Rebuild the view of the most frecent records of the database, the journal
+// of the visits of both tiers and the statistics of the database.
+static void rebuild_indexes(const char *path) {
+  Record *records;
+  char **lines;
+  const int n = load_records(path, &records, &lines);
+  if (n < 0) {
+    return;
+  }
+  Record *cold_records = NULL;
+  char **cold_lines = NULL;
+  char *cold = sidecar_path(path, COLD_SUFFIX);
+  int n_cold = cold ? load_records(cold, &cold_records, &cold_lines) : -1;
+  free(cold);
+  Record **all = (Record **)malloc((n + (n_cold > 0 ? n_cold : 0) + 1) *
+                                   sizeof(Record *));
+  if (all) {
+    for (int i = 0; i < n; i++) {
+      all[i] = records + i;
+    }
+    for (int i = 0; i < n_cold; i++) {
+      all[n + i] = cold_records + i;
+    }
+    top_build(path, all, n, (long long)time(NULL));
+    journal_build(path, all, n + (n_cold > 0 ? n_cold : 0));
+  }
+  save_statistics(path, records, n);
+  free(all);
+  if (n_cold >= 0) {
+    free_records(cold_records, cold_lines, n_cold);
+  }
+  free_records(records, lines, n);
+}
+
+typedef struct Ranked {
+  double frecency;
+  int index;
+} Ranked;
+
+static int compare_ranked(const void *a, const void *b) {
+  const Ranked *x = (const Ranked *)a;
+  const Ranked *y = (const Ranked *)b;
+  if (x->frecency != y->frecency) {
+    return (x->frecency < y->frecency) ? 1 : -1;
+  }
+  return x->index - y->index;
+}
+
+// Keep the max_entries most frecent records in the database, and move the
+// others to the cold tier, which is rewritten sorted by path so that visits
+// find their archived records by bisection (see visit.c). The new archive is
+// only installed once the database has been replaced: a record is never in
+// both tiers. The metadata keeps a "virtual" record (cold_visits,
+// cold_last_visit) whose frecency bounds the frecency of every archived record
+// at any later time: lookups use it to skip the cold tier.
+static void evict_records(const char *path, int max_entries) {
+  Record *records;
+  char **lines;
+  const int n = load_records(path, &records, &lines);
+  if (n <= max_entries) {
+    if (n >= 0) {
+      free_records(records, lines, n);
+    }
+    return;
+  }
+  const long long now = (long long)time(NULL);
+  char *cold_path = sidecar_path(path, COLD_SUFFIX);
+  Record *cold_records = NULL;
+  char **cold_lines = NULL;
+  const int n_cold =
+      cold_path ? load_records(cold_path, &cold_records, &cold_lines) : -1;
+  if (n_cold < 0 && (!cold_path || access(cold_path, F_OK) == 0)) {
+    fprintf(stderr, "ERROR: Could not open the archive %s\n",
+            cold_path ? cold_path : path);
+    free(cold_path);
+    jumper_exit(EXIT_FAILURE);
+  }
+  hold(cold_path, free);
+  const int n_archived = n_cold > 0 ? n_cold : 0;
+  char *tempname;
+  FILE *temp = open_temp_file(path, &tempname);
+  char *cold_tempname;
+  FILE *cold_temp = open_temp_file(cold_path, &cold_tempname);
+  struct stat st;
+  if (n_cold < 0 && stat(path, &st) == 0) {
+    // A new archive gets the permissions of the database
+    fchmod(fileno(cold_temp), st.st_mode);
+  }
+  Ranked *ranked = (Ranked *)malloc(n * sizeof(Ranked));
+  bool *evicted = (bool *)calloc(n, sizeof(bool));
+  Record **kept = (Record **)malloc(n * sizeof(Record *));
+  Record **archived =
+      (Record **)malloc((n_archived + n) * sizeof(Record *));
+  Meta *meta = meta_load(path);
+  if (!ranked || !evicted || !kept || !archived || !meta) {
+    fprintf(stderr, "ERROR: Could not allocate memory for %d entries.\n",
+            n + n_archived);
+    jumper_exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < n; i++) {
+    ranked[i].frecency = frecency(records[i].n_visits, now - records[i].last_visit);
+    ranked[i].index = i;
+  }
+  qsort(ranked, n, sizeof(Ranked), compare_ranked);
+  for (int k = max_entries; k < n; k++) {
+    evicted[ranked[k].index] = true;
+  }
+
+  Record bound = {.n_visits = meta_get(meta, "cold_visits", 0),
+                  .last_visit = (long long)meta_get(meta, "cold_last_visit", 0)};
+  int n_kept = 0;
+  int n_total = 0;
+  for (int i = 0; i < n_archived; i++) {
+    archived[n_total++] = cold_records + i;
+  }
+  for (int i = 0; i < n; i++) {
+    if (evicted[i]) {
+      bound_record(&bound, records + i);
+      archived[n_total++] = records + i;
+    } else {
+      kept[n_kept++] = records + i;
+    }
+  }
+  bool ok = write_sorted_records(temp, kept, n_kept) &&
+            write_sorted_records(cold_temp, archived, n_total);
+  const long sorted = ftell(temp);
+  const long cold_sorted = ftell(cold_temp);
+  ok = (close_stream(cold_temp) == 0) && ok;
+  close_stream(temp);
+  if (ok && rename(tempname, path) == 0) {
+    let_go(tempname);
+    free(tempname);
+    let_go(cold_tempname);
+    if (rename(cold_tempname, cold_path) == 0) {
+      meta_set(meta, "cold_sorted_bytes", (double)cold_sorted);
+    } else {
+      fprintf(stderr, "ERROR: Could not replace the archive %s: %s\n",
+              cold_path, strerror(errno));
+      fprintf(stderr, "The evicted entries are in: %s\n", cold_tempname);
+    }
+    free(cold_tempname);
+    meta_set(meta, "cold_visits", bound.n_visits);
+    meta_set(meta, "cold_last_visit", (double)bound.last_visit);
+    meta_set(meta, "sorted_bytes", (double)sorted);
+    meta_save(meta);
+    top_build(path, kept, n_kept, now);
+  } else {
+    fprintf(stderr, "ERROR: Could not move entries to the archive %s\n",
+            cold_path);
+    remove_temp_file(cold_tempname);
+    remove_temp_file(tempname);
+  }
+  meta_free(meta);
+  let_go(cold_path);
+  free(cold_path);
+  free(archived);
+  free(kept);
+  free(evicted);
+  free(ranked);
+  if (n_cold >= 0) {
+    free_records(cold_records, cold_lines, n_cold);
+  }
+  free_records(records, lines, n);
+}
+
+typedef struct Canonical {
+  char *path; // NULL if the entry does not exist
+  mode_t mode;
+  int index;
+} Canonical;
+
+static int compare_canonical(const void *a, const void *b) {
+  const Canonical *x = (const Canonical *)a;
+  const Canonical *y = (const Canonical *)b;
+  if (!x->path || !y->path) {
+    return (x->path != NULL) - (y->path != NULL);
+  }
+  const int c = strcmp(x->path, y->path);
+  return c != 0 ? c : x->index - y->index;
+}
+
+// Decay the visits of rec and other to the latest of their last visits, and
+// sum them in rec.
+static void add_visits(Record *rec, const Record *other) {
+  if (other->last_visit > rec->last_visit) {
+    rec->n_visits = visits(rec->n_visits, other->last_visit - rec->last_visit);
+    rec->last_visit = other->last_visit;
+    rec->n_visits += other->n_visits;
+  } else {
+    rec->n_visits +=
+        visits(other->n_visits, rec->last_visit - other->last_visit);
+  }
+}
+
+// An entry kept by canonicalize_database, under the spelling it is written
+typedef struct Spelling {
+  const char *path;
+  const char *target; // canonical path
+  char *respelled;    // path, if it had to be allocated
+  int index;          // of the record holding the merged visits
+  bool merged;
+} Spelling;
+
+static int compare_spelling(const void *a, const void *b) {
+  const Spelling *x = (const Spelling *)a;
+  const Spelling *y = (const Spelling *)b;
+  const int c = strcmp(x->path, y->path);
+  return c != 0 ? c : x->index - y->index;
+}
+
+// Canonical path of a directory that the user reached through a link, with
+// the spelling under which it is kept.
+typedef struct Alias {
+  const char *target;
+  const char *path;
+} Alias;
+
+// Returns the alias whose target is the prefix path[0..length), if any.
+// aliases are sorted by target.
+static const Alias *find_alias(const Alias *aliases, int n, const char *path,
+                               size_t length) {
+  int lo = 0;
+  int hi = n;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    int c = strncmp(aliases[mid].target, path, length);
+    if (c == 0 && aliases[mid].target[length] != '\0') {
+      c = 1;
+    }
+    if (c == 0) {
+      return aliases + mid;
+    }
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
+// Resolve all the paths of the database, and merge the entries that point to
+// the same file/directory: their visits are decayed to the latest visit and
+// summed. As the former shell helpers did, the spellings that the user typed
+// are kept: a merged entry keeps the spelling through a symbolic link (the
+// most recently visited one), and the entries under the target of such a
+// link are spelled through it.
+static void canonicalize_database(Arguments *args) {
+  Record *records;
+  char **lines;
+  const int n = load_records(args->file_path, &records, &lines);
+  if (n < 0) {
+    return;
+  }
+  char *tempname;
+  FILE *temp = open_temp_file(args->file_path, &tempname);
+  const char **paths = (const char **)malloc((n + 1) * sizeof(char *));
+  char **resolved = (char **)malloc((n + 1) * sizeof(char *));
+  mode_t *modes = (mode_t *)malloc((n + 1) * sizeof(mode_t));
+  Canonical *canonical = (Canonical *)malloc((n + 1) * sizeof(Canonical));
+  Spelling *kept = (Spelling *)malloc((n + 1) * sizeof(Spelling));
+  Alias *aliases = (Alias *)malloc((n + 1) * sizeof(Alias));
+  PathCache *cache = path_cache_create();
+  if (!paths || !resolved || !modes || !canonical || !kept || !aliases ||
+      !cache) {
+    fprintf(stderr, "ERROR: Could not allocate memory for %d entries.\n", n);
+    jumper_exit(EXIT_FAILURE);
+  }
+
+  const char *type_name = args->type == TYPE_files ? "files" : "directories";
+  fprintf(stdout, "Canonicalizing %s' database...\n", type_name);
+  for (int i = 0; i < n; i++) {
+    paths[i] = records[i].path;
+  }
+  canonicalize_all(cache, paths, resolved, modes, n);
+  for (int i = 0; i < n; i++) {
+    canonical[i].path = resolved[i];
+    canonical[i].mode = modes[i];
+    canonical[i].index = i;
+  }
+  qsort(canonical, n, sizeof(Canonical), compare_canonical);
+
+  // Merge the entries with the same canonical path
+  int removed_count = 0;
+  int merged_count = 0;
+  int n_kept = 0;
+  int n_aliases = 0;
+  int i = 0;
+  while (i < n) {
+    int j = i + 1;
+    while (j < n && canonical[i].path && canonical[j].path &&
+           strcmp(canonical[i].path, canonical[j].path) == 0) {
+      j++;
+    }
+    const mode_t mode = canonical[i].mode;
+    const bool valid_type =
+        ((args->type == TYPE_directories) && S_ISDIR(mode)) ||
+        ((args->type == TYPE_files) && S_ISREG(mode));
+    if (!canonical[i].path || !valid_type) {
+      removed_count += j - i;
+      i = j;
+      continue;
+    }
+    Record *rec = records + canonical[i].index;
+    const char *spelling = NULL;
+    long long spelling_visit = 0;
+    for (int k = i; k < j; k++) {
+      const Record *other = records + canonical[k].index;
+      if (k > i) {
+        add_visits(rec, other);
+      }
+      if (strcmp(other->path, canonical[i].path) != 0 &&
+          (!spelling || other->last_visit > spelling_visit)) {
+        spelling = other->path;
+        spelling_visit = other->last_visit;
+      }
+    }
+    Spelling *s = kept + n_kept++;
+    s->path = spelling ? spelling : canonical[i].path;
+    s->target = canonical[i].path;
+    s->respelled = NULL;
+    s->index = canonical[i].index;
+    s->merged = j - i > 1;
+    if (spelling && S_ISDIR(mode)) {
+      aliases[n_aliases].target = canonical[i].path;
+      aliases[n_aliases].path = spelling;
+      n_aliases++;
+    }
+    merged_count += j - i - 1;
+    i = j;
+  }
+
+  // Spell the other entries through the deepest alias of their directories
+  for (int k = 0; k < n_kept; k++) {
+    Spelling *s = kept + k;
+    if (s->path != s->target) {
+      continue;
+    }
+    for (size_t end = strlen(s->target) - 1; end > 0; end--) {
+      if (s->target[end] != '/') {
+        continue;
+      }
+      const Alias *alias = find_alias(aliases, n_aliases, s->target, end);
+      if (!alias) {
+        continue;
+      }
+      const size_t size = strlen(alias->path) + strlen(s->target + end) + 1;
+      s->respelled = (char *)malloc(size);
+      if (!s->respelled) {
+        fprintf(stderr, "ERROR: Could not allocate memory.\n");
+        jumper_exit(EXIT_FAILURE);
+      }
+      snprintf(s->respelled, size, "%s%s", alias->path, s->target + end);
+      s->path = s->respelled;
+      break;
+    }
+  }
+  qsort(kept, n_kept, sizeof(Spelling), compare_spelling);
+
+  Filters filters;
+  filters_init(&filters, args->filters);
+  int kept_count = 0;
+  int renamed_count = 0;
+  int last_index = -1;
+  bool reordered = false;
+  bool ok = true;
+  for (int k = 0; k < n_kept && ok; k++) {
+    Record rec = records[kept[k].index];
+    const bool renamed = strcmp(rec.path, kept[k].path) != 0;
+    if (kept[k].merged || renamed) {
+      rec.path = kept[k].path;
+      rec.filter_generation = 0;
+      renamed_count += !kept[k].merged;
+    }
+    if (filters_match(&filters, &rec)) {
+      removed_count++;
+      continue;
+    }
+    ok = write_record(temp, &rec);
+    reordered = reordered || kept[k].index < last_index;
+    last_index = kept[k].index;
+    kept_count++;
+  }
+  const long sorted = ftell(temp);
+  close_stream(temp);
+  filters_free(&filters);
+  if (!ok) {
+    fprintf(stderr, "\nERROR: Failed to write to temporary file\n");
+    remove_temp_file(tempname);
+  } else {
+    fprintf(stdout, "Merged %d %s, renamed %d, removed %d (kept %d)\n",
+            merged_count, type_name, renamed_count, removed_count,
+            kept_count);
+    replace_database(args, tempname,
+                     merged_count + renamed_count + removed_count > 0 ||
+                         reordered);
+  }
+  if (ok && !args->dry_run) {
+    // The records are written in the order of their paths
+    set_sorted_bytes(args->file_path, sorted);
+    rebuild_indexes(args->file_path);
+    // Merged, renamed and removed records would invalidate the memoized
+    // results
+    if (merged_count + renamed_count + removed_count > 0) {
+      memo_clear(args->file_path);
+    }
+  }
+
+  for (int k = 0; k < n_kept; k++) {
+    free(kept[k].respelled);
+  }
+  for (int k = 0; k < n; k++) {
+    free(resolved[k]);
+  }
+  path_cache_free(cache);
+  free(aliases);
+  free(kept);
+  free(canonical);
+  free(modes);
+  free(resolved);
+  free(paths);
+  free_records(records, lines, n);
+  if (!ok) {
+    jumper_exit(EXIT_FAILURE);
+  }
+}
+
+// Verify at most args->clean_budget entries, starting from the cursor saved by
+// the previous call. The entries are thus verified in a round-robin fashion:
+// each call handles the entries that have not been verified for the longest
+// time, and every entry gets verified once per pass over the database.
+static void clean_incremental(Arguments *args) {
+  Textfile *f = file_open(args->file_path);
+  if (!f) {
+    return;
+  }
+  file_close(f);
+  f = open_file_rw(args->file_path);
+  if (!f) {
+    fprintf(stderr, "ERROR: Couldn't open file %s.\n", args->file_path);
+    jumper_exit(EXIT_FAILURE);
+  }
+  Meta *meta = meta_load(args->file_path);
+  if (!meta) {
+    close_file(f);
+    return;
+  }
+  fseek(f->fp, 0, SEEK_END);
+  const long size = ftell(f->fp);
+  long start = (long)meta_get(meta, "clean_cursor", 0);
+  if (start < 0 || start >= size) {
+    start = 0;
+  }
+  fseek(f->fp, start > 0 ? start - 1 : 0, SEEK_SET);
+  if (start > 0 && fgetc(f->fp) != '\n') {
+    // The database changed since the last call: resume at the next line
+    if (!next_line(f)) {
+      fseek(f->fp, 0, SEEK_SET);
+    }
+    start = ftell(f->fp);
+  }
+
+  long sorted = get_sorted_bytes(meta, f->fp);
+
+  // The removed lines are deleted at once, after the pass, and so are their
+  // paths from the view
+  Span *removed = (Span *)malloc(args->clean_budget * sizeof(Span));
+  char **removed_paths = (char **)malloc(args->clean_budget * sizeof(char *));
+  if (!removed || !removed_paths) {
+    fprintf(stderr, "ERROR: Could not allocate memory for %d entries.\n",
+            args->clean_budget);
+    free(removed);
+    free(removed_paths);
+    meta_free(meta);
+    jumper_exit(EXIT_FAILURE);
+  }
+  Filters filters;
+  filters_init(&filters, args->filters);
+  Record rec;
+  const char *type_name = args->type == TYPE_files ? "files" : "directories";
+  int verified_count = 0;
+  int removed_count = 0;
+  bool wrapped = false;
+  while (verified_count < args->clean_budget) {
+    const long position = ftell(f->fp);
+    if (wrapped && position >= start) {
+      break;
+    }
+    if (!next_line(f)) {
+      if (wrapped || start == 0) {
+        break;
+      }
+      fseek(f->fp, 0, SEEK_SET);
+      wrapped = true;
+      continue;
+    }
+    char *buffer = strdup(f->line);
+    if (!parse_record(buffer, &rec)) {
+      report_invalid_record(f);
+      free(buffer);
+      verified_count++;
+      continue;
+    }
+    if (filters_match(&filters, &rec) || !exist(rec.path, args->type)) {
+      if (args->dry_run) {
+        fprintf(stdout, "Would remove: %s\n", rec.path);
+      } else {
+        removed[removed_count].offset = position;
+        removed[removed_count].length = (long)strlen(f->line);
+        journal_remove(args->file_path, rec.path, (long long)time(NULL));
+        // rec.path is the start of buffer
+        removed_paths[removed_count] = buffer;
+        buffer = NULL;
+      }
+      removed_count++;
+    }
+    free(buffer);
+    verified_count++;
+  }
+  bool ok = true;
+  if (!args->dry_run) {
+    // The cursor and the end of the sorted region move up by the lines
+    // removed before them
+    long cursor = ftell(f->fp);
+    const long end = cursor;
+    const long sorted_end = sorted;
+    for (int i = 0; i < removed_count; i++) {
+      cursor -= (removed[i].offset < end) ? removed[i].length : 0;
+      sorted -= (removed[i].offset < sorted_end) ? removed[i].length : 0;
+    }
+    ok = delete_spans(f, removed, removed_count);
+    if (ok) {
+      meta_set(meta, "clean_cursor", (double)cursor);
+      meta_set(meta, "sorted_bytes", (double)sorted);
+      meta_save(meta);
+      top_remove(args->file_path, (const char **)removed_paths,
+                 removed_count);
+      if (removed_count > 0) {
+        memo_clear(args->file_path);
+      }
+    }
+    for (int i = 0; i < removed_count; i++) {
+      free(removed_paths[i]);
+    }
+  }
+  free(removed_paths);
+  free(removed);
+  meta_free(meta);
+  close_file(f);
+  filters_free(&filters);
+  if (!ok) {
+    fprintf(stderr, "ERROR: Could not read file %s.\n", args->file_path);
+    jumper_exit(EXIT_FAILURE);
+  }
+  fprintf(stdout, "Verified %d %s, removed %d\n", verified_count, type_name,
+          removed_count);
+}
+
+// Returns whether records were removed.
+static bool clean_records(Arguments *args) {
+  Record *records;
+  char **lines;
+  const int total_lines = load_records(args->file_path, &records, &lines);
+  if (total_lines < 0) {
+    return false;
+  }
+  char *tempname;
+  FILE *temp = open_temp_file(args->file_path, &tempname);
+  Record **kept = (Record **)malloc((total_lines + 1) * sizeof(Record *));
+  if (!kept) {
+    fprintf(stderr, "ERROR: Could not allocate memory for %d entries.\n",
+            total_lines);
+    jumper_exit(EXIT_FAILURE);
+  }
+
+  Filters filters;
+  filters_init(&filters, args->filters);
+  int removed_count = 0;
+  int kept_count = 0;
+
+  const char *type_name = args->type == TYPE_files ? "files" : "directories";
+  fprintf(stdout, "Cleaning %s' database...\n", type_name);
+  for (int i = 0; i < total_lines; i++) {
+    Record *rec = records + i;
+    if (!filters_match(&filters, rec) && exist(rec->path, args->type)) {
+      kept[kept_count++] = rec;
+    } else {
+      removed_count++;
+    }
+    progress_bar(i + 1, total_lines);
+  }
+  const bool ok = write_sorted_records(temp, kept, kept_count);
+  // The database only changes if entries were removed or reordered
+  bool changed = removed_count > 0;
+  for (int i = 1; i < kept_count && !changed; i++) {
+    changed = kept[i] < kept[i - 1];
+  }
+  close_stream(temp);
+  filters_free(&filters);
+  free(kept);
+  free_records(records, lines, total_lines);
+  if (!ok) {
+    fprintf(stderr, "\nERROR: Failed to write to temporary file\n");
+    remove_temp_file(tempname);
+    jumper_exit(EXIT_FAILURE);
+  }
+
+  fprintf(stdout, "Cleaned %d %s (kept %d)\n", removed_count, type_name,
+          kept_count);
+
+  replace_database(args, tempname, changed);
+  return removed_count > 0;
+}
+
+static void clean_database(Arguments *args) {
+  if (args->canonicalize) {
+    canonicalize_database(args);
+    return;
+  }
+  if (args->clean_budget > 0) {
+    clean_incremental(args);
+    return;
+  }
+  bool removed = clean_records(args);
+  const char *path = args->file_path;
+  struct stat st;
+  if (!args->dry_run && stat(path, &st) == 0) {
+    // The whole database is now sorted
+    set_sorted_bytes(path, (long)st.st_size);
+  }
+  char *cold = sidecar_path(path, COLD_SUFFIX);
+  if (cold && access(cold, F_OK) == 0) {
+    args->file_path = cold;
+    removed = clean_records(args) || removed;
+    args->file_path = path;
+    if (!args->dry_run && stat(cold, &st) == 0) {
+      // and so is the archive
+      Meta *meta = meta_load(path);
+      if (meta) {
+        meta_set(meta, "cold_sorted_bytes", (double)st.st_size);
+        meta_save(meta);
+        meta_free(meta);
+      }
+    }
+  }
+  free(cold);
+  if (args->dry_run) {
+    return;
+  }
+  // Removed records would invalidate the memoized results
+  if (removed) {
+    memo_clear(path);
+  }
+  if (args->max_entries > 0) {
+    evict_records(path, args->max_entries);
+  }
+  rebuild_indexes(path);
+}
+
+static void clean_both_databases(Arguments *args) {
+  // Clean files database
+  char *path = get_default_database_path(TYPE_files);
+  args->type = TYPE_files;
+  args->file_path = path;
+  clean_database(args);
+  free(path);
+
+  printf("\n");
+
+  // Clean directories database
+  path = get_default_database_path(TYPE_directories);
+  args->type = TYPE_directories;
+  args->file_path = path;
+  clean_database(args);
+  free(path);
+}
+
+// The records of a merge are sorted by chunks of at most MERGE_CHUNK_BYTES of
+// paths and MERGE_CHUNK_RECORDS records, that are written to temporary files
+// (the runs). The runs are then merged, at most MERGE_FAN_IN at a time.
+#define MERGE_CHUNK_BYTES (1 << 25)
+#define MERGE_CHUNK_RECORDS (1 << 19)
+#define MERGE_FAN_IN 64
+
+// Records sorted by path, read from a file up to end (-1 for its end)
+typedef struct Run {
+  Textfile *f;
+  long end;
+  Record rec; // the current one, whose path points into f->line
+} Run;
+
+typedef struct Merge {
+  const char *output;
+  // Chunk being read: its records' paths are copied in paths
+  char *paths;
+  size_t paths_size;
+  Record *records;
+  Record **sorted;
+  int n;
+  Run runs[MERGE_FAN_IN];
+  int n_runs;
+  long n_written; // records written by the last merge of runs or chunk
+  // Indexes of the output, built while it is written (NULL before)
+  TopBuilder *top;
+  PathStatistics *stats;
+} Merge;
+
+// Write a record of a run or chunk, and index it if it is one of the output.
+static bool emit_record(Merge *merge, FILE *fp, Record *rec) {
+  merge->n_written++;
+  if (merge->stats) {
+    add_path_statistics(merge->stats, rec->path);
+  }
+  return (!merge->top || top_builder_add(merge->top, rec)) &&
+         write_record(fp, rec);
+}
+
+// Read the next record of the run, false at its end.
+static bool run_next(Run *run) {
+  while ((run->end < 0 || file_tell(run->f) < run->end) && next_line(run->f)) {
+    if (parse_record(run->f->line, &run->rec)) {
+      return true;
+    }
+    report_invalid_record(run->f);
+  }
+  return false;
+}
+
+static void close_runs(Merge *merge) {
+  for (int i = 0; i < merge->n_runs; i++) {
+    close_file(merge->runs[i].f);
+  }
+  merge->n_runs = 0;
+}
+
+// Restore the heap of runs (by their current paths) below its index i.
+static void sift_runs(const Run *runs, int *heap, int n, int i) {
+  while (true) {
+    int least = i;
+    for (int child = 2 * i + 1; child <= 2 * i + 2 && child < n; child++) {
+      if (strcmp(runs[heap[child]].rec.path, runs[heap[least]].rec.path) < 0) {
+        least = child;
+      }
+    }
+    if (least == i) {
+      return;
+    }
+    const int swap = heap[i];
+    heap[i] = heap[least];
+    heap[least] = swap;
+    i = least;
+  }
+}
+
+// Move the run at the top of the heap to its next record.
+static void advance_runs(Merge *merge, int *heap, int *n) {
+  if (!run_next(merge->runs + heap[0])) {
+    heap[0] = heap[--*n];
+  }
+  sift_runs(merge->runs, heap, *n, 0);
+}
+
+// Merge the runs into fp, combining the records of the same path, and close
+// them.
+static bool merge_runs(Merge *merge, FILE *fp) {
+  int heap[MERGE_FAN_IN];
+  int n = 0;
+  for (int i = 0; i < merge->n_runs; i++) {
+    if (run_next(merge->runs + i)) {
+      heap[n++] = i;
+    }
+  }
+  for (int i = n / 2 - 1; i >= 0; i--) {
+    sift_runs(merge->runs, heap, n, i);
+  }
+  merge->n_written = 0;
+  // The path of the record being combined, that outlives the runs' lines
+  char *path = NULL;
+  size_t capacity = 0;
+  bool ok = true;
+  while (n > 0 && ok) {
+    Record rec = merge->runs[heap[0]].rec;
+    const size_t size = strlen(rec.path) + 1;
+    if (size > capacity) {
+      free(path);
+      capacity = 2 * size;
+      path = (char *)malloc(capacity);
+      if (!path) {
+        ok = false;
+        break;
+      }
+    }
+    rec.path = memcpy(path, rec.path, size);
+    advance_runs(merge, heap, &n);
+    while (n > 0 && strcmp(merge->runs[heap[0]].rec.path, path) == 0) {
+      add_visits(&rec, &merge->runs[heap[0]].rec);
+      rec.filter_generation = 0;
+      advance_runs(merge, heap, &n);
+    }
+    ok = emit_record(merge, fp, &rec);
+  }
+  free(path);
+  close_runs(merge);
+  return ok;
+}
+
+static bool add_run(Merge *merge, const char *path, long end);
+
+// Replace the runs by the one of their merge.
+static bool collapse_runs(Merge *merge) {
+  char *tempname;
+  FILE *temp = open_temp_file(merge->output, &tempname);
+  bool ok = merge_runs(merge, temp);
+  ok = (close_stream(temp) == 0) && ok;
+  ok = ok && add_run(merge, tempname, -1);
+  // The run stays readable until it is closed
+  remove_temp_file(tempname);
+  return ok;
+}
+
+// Add the records of path up to end (-1 for its end), that are sorted, to the
+// runs.
+static bool add_run(Merge *merge, const char *path, long end) {
+  if (merge->n_runs == MERGE_FAN_IN && !collapse_runs(merge)) {
+    return false;
+  }
+  Textfile *f = open_file(path);
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not open %s\n", path);
+    return false;
+  }
+  merge->runs[merge->n_runs].f = f;
+  merge->runs[merge->n_runs].end = end;
+  merge->n_runs++;
+  return true;
+}
+
+// Write the records of the chunk to fp in path order, combining the records
+// of the same path, and empty it.
+static bool flush_chunk(Merge *merge, FILE *fp) {
+  qsort(merge->sorted, merge->n, sizeof(Record *), compare_paths);
+  merge->n_written = 0;
+  bool ok = true;
+  for (int i = 0; i < merge->n && ok;) {
+    Record rec = *merge->sorted[i];
+    for (i++; i < merge->n && strcmp(merge->sorted[i]->path, rec.path) == 0;
+         i++) {
+      add_visits(&rec, merge->sorted[i]);
+      rec.filter_generation = 0;
+    }
+    ok = emit_record(merge, fp, &rec);
+  }
+  merge->n = 0;
+  merge->paths_size = 0;
+  return ok;
+}
+
+// Sort the chunk into a new run.
+static bool spill_chunk(Merge *merge) {
+  char *tempname;
+  FILE *temp = open_temp_file(merge->output, &tempname);
+  bool ok = flush_chunk(merge, temp);
+  ok = (close_stream(temp) == 0) && ok;
+  ok = ok && add_run(merge, tempname, -1);
+  remove_temp_file(tempname);
+  return ok;
+}
+
+// First of the remaps whose prefix is a parent of path (or path itself), NULL
+// if there is none.
+static const Remap *find_remap(const char *path, const Remap *remaps, int n) {
+  for (int i = 0; i < n; i++) {
+    const Remap *remap = remaps + i;
+    const size_t length = remap->from_length;
+    if (strncmp(path, remap->from, length) == 0 &&
+        (path[length] == '\0' || path[length] == '/' ||
+         remap->from[length - 1] == '/')) {
+      return remap;
+    }
+  }
+  return NULL;
+}
+
+// Add the remaining records of f, remapped, to the chunks.
+static bool chunk_records(Merge *merge, Textfile *f, const Remap *remaps,
+                          int n_remaps) {
+  Record rec;
+  while (next_line(f)) {
+    if (!parse_record(f->line, &rec)) {
+      report_invalid_record(f);
+      continue;
+    }
+    const Remap *remap = find_remap(rec.path, remaps, n_remaps);
+    const char *prefix = remap ? remap->to : "";
+    const char *rest = rec.path + (remap ? remap->from_length : 0);
+    const size_t prefix_length = strlen(prefix);
+    const size_t size = prefix_length + strlen(rest) + 1;
+    if (size > MERGE_CHUNK_BYTES) {
+      report_invalid_record(f);
+      continue;
+    }
+    if ((merge->n == MERGE_CHUNK_RECORDS ||
+         merge->paths_size + size > MERGE_CHUNK_BYTES) &&
+        !spill_chunk(merge)) {
+      return false;
+    }
+    char *path = merge->paths + merge->paths_size;
+    memcpy(path, prefix, prefix_length);
+    memcpy(path + prefix_length, rest, size - prefix_length);
+    merge->paths_size += size;
+    rec.path = path;
+    if (remap) {
+      rec.filter_generation = 0;
+    }
+    merge->records[merge->n] = rec;
+    merge->sorted[merge->n] = merge->records + merge->n;
+    merge->n++;
+  }
+  return true;
+}
+
+// Add the records of a database to merge, and of its archive, to the runs and
+// chunks.
+static bool merge_source(Merge *merge, const Arguments *args,
+                         const MergeSource *source) {
+  const Remap *remaps = args->remaps + source->first_remap;
+  Textfile *f = open_file(source->path);
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not open the database %s\n", source->path);
+    return false;
+  }
+  // The sorted region of the database is already a run, unless its paths are
+  // remapped: this may reorder them.
+  bool ok = true;
+  if (source->n_remaps == 0) {
+    Meta *meta = meta_load(source->path);
+    const long sorted = meta ? get_sorted_bytes(meta, f->fp) : 0;
+    if (meta) {
+      meta_free(meta);
+    }
+    if (sorted > 0) {
+      ok = add_run(merge, source->path, sorted);
+      file_seek(f, sorted);
+    }
+  }
+  ok = ok && chunk_records(merge, f, remaps, source->n_remaps);
+  close_file(f);
+  char *cold_path = sidecar_path(source->path, COLD_SUFFIX);
+  Textfile *cold = cold_path ? open_file(cold_path) : NULL;
+  if (cold) {
+    ok = ok && chunk_records(merge, cold, remaps, source->n_remaps);
+    close_file(cold);
+  }
+  free(cold_path);
+  return ok;
+}
+
+// The merged database replaces the output, whose sidecars are reset: its
+// archive has been merged (if it is one of the sources) or is outdated. Its
+// indexes are the ones built along the merge, but the journal, which would
+// need another sort, is only rebuilt by clean.
+static void install_merge(Merge *merge, long sorted) {
+  const char *path = merge->output;
+  char *cold_path = sidecar_path(path, COLD_SUFFIX);
+  if (cold_path) {
+    unlink(cold_path);
+    free(cold_path);
+  }
+  journal_drop(path);
+  memo_clear(path);
+  Meta *meta = meta_load(path);
+  if (meta) {
+    meta_set(meta, "sorted_bytes", (double)sorted);
+    meta_set(meta, "cold_visits", 0);
+    meta_set(meta, "cold_last_visit", 0);
+    meta_set(meta, "cold_sorted_bytes", 0);
+    meta_save(meta);
+    meta_free(meta);
+  }
+  let_go(merge->top);
+  top_builder_finish(merge->top, path);
+  merge->top = NULL;
+  save_path_statistics(path, merge->stats);
+}
+
+static void release_top_builder(void *top) {
+  top_builder_free((TopBuilder *)top);
+}
+
+// Merge the databases of args (with their archives) into args->output, by an
+// external sort: the records are sorted by chunks into runs, which are then
+// merged. Returns the exit code.
+static int merge_databases(Arguments *args) {
+  Merge merge = {.output = args->output, .n = 0, .n_runs = 0};
+  PathStatistics stats = {0};
+  merge.paths = (char *)malloc(MERGE_CHUNK_BYTES);
+  merge.records = (Record *)malloc(MERGE_CHUNK_RECORDS * sizeof(Record));
+  merge.sorted = (Record **)malloc(MERGE_CHUNK_RECORDS * sizeof(Record *));
+  hold(merge.paths, free);
+  hold(merge.records, free);
+  hold(merge.sorted, free);
+  bool ok = merge.paths && merge.records && merge.sorted;
+  if (!ok) {
+    fprintf(stderr, "ERROR: Could not allocate memory for the merge.\n");
+  }
+  for (int i = 0; i < args->n_sources && ok; i++) {
+    ok = merge_source(&merge, args, args->sources + i);
+  }
+  if (ok) {
+    // A chunk that holds all the records is written as is
+    if (merge.n_runs > 0 && merge.n > 0) {
+      ok = spill_chunk(&merge);
+    }
+    char *tempname;
+    FILE *temp = open_temp_file(args->output, &tempname);
+    merge.top = top_builder_create((long long)time(NULL));
+    hold(merge.top, release_top_builder);
+    merge.stats = &stats;
+    ok = ok && merge.top &&
+         (merge.n_runs > 0 ? merge_runs(&merge, temp)
+                           : flush_chunk(&merge, temp));
+    const long sorted = ftell(temp);
+    ok = (close_stream(temp) == 0) && ok;
+    if (!ok) {
+      fprintf(stderr, "ERROR: Failed to write the merged database\n");
+    } else if (rename(tempname, args->output) != 0) {
+      fprintf(stderr, "ERROR: Failed to replace database file: %s\n",
+              strerror(errno));
+      ok = false;
+    }
+    if (ok) {
+      let_go(tempname);
+      free(tempname);
+      install_merge(&merge, sorted);
+      fprintf(stdout, "Merged %d databases into %s (%ld entries)\n",
+              args->n_sources, args->output, merge.n_written);
+    } else {
+      remove_temp_file(tempname);
+    }
+  }
+  close_runs(&merge);
+  if (merge.top) {
+    let_go(merge.top);
+    top_builder_free(merge.top);
+  }
+  let_go(merge.sorted);
+  let_go(merge.records);
+  let_go(merge.paths);
+  free(merge.sorted);
+  free(merge.records);
+  free(merge.paths);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Recompute the filters' verdicts of all the records, after the filters' file
+// has changed.
+static void restamp_database(const char *path, Filters *filters) {
+  Textfile *f = open_file(path);
+  if (!f) {
+    return;
+  }
+  Meta *meta = meta_load(path);
+  const long sorted = meta ? get_sorted_bytes(meta, f->fp) : 0;
+  long new_sorted = 0;
+  char *tempname;
+  FILE *temp = open_temp_file(path, &tempname);
+  Record rec;
+  while (true) {
+    // The records keep their order, but their lengths change
+    if (file_tell(f) == sorted) {
+      new_sorted = ftell(temp);
+    }
+    if (!next_line(f)) {
+      break;
+    }
+    if (!parse_record(f->line, &rec)) {
+      report_invalid_record(f);
+      continue;
+    }
+    filters_match(filters, &rec);
+    char *rec_string = record_to_string(&rec);
+    if (!rec_string || fputs(rec_string, temp) == EOF ||
+        fputs("\n", temp) == EOF) {
+      fprintf(stderr, "ERROR: Failed to write to temporary file\n");
+      free(rec_string);
+      close_stream(temp);
+      remove_temp_file(tempname);
+      close_file(f);
+      if (meta) {
+        meta_free(meta);
+      }
+      return;
+    }
+    free(rec_string);
+  }
+  close_file(f);
+  close_stream(temp);
+  if (rename(tempname, path) != 0) {
+    remove_temp_file(tempname);
+  } else {
+    let_go(tempname);
+    free(tempname);
+    if (meta && sorted > 0) {
+      meta_set(meta, "sorted_bytes", (double)new_sorted);
+      meta_save(meta);
+    }
+  }
+  if (meta) {
+    meta_free(meta);
+  }
+}
+
+static void update_entry(Arguments *args) {
+  Filters filters;
+  filters_init(&filters, args->filters);
+  const Visit visit = record_visit(args->file_path, args->key, args->weight,
+                                   (long long)time(NULL), &filters);
+  if (visit.outcome == VISIT_failed) {
+    fprintf(stderr, "ERROR: Couldn't update the database %s.\n",
+            args->file_path);
+    jumper_exit(EXIT_FAILURE);
+  }
+  if (visit.outcome == VISIT_filtered) {
+    filters_free(&filters);
+    return;
+  }
+  // Some slack avoids rewriting the database at each new entry
+  const int slack = args->max_entries / 10 + 1;
+  if (visit.added && args->max_entries > 0 &&
+      visit.n_lines + 1 > args->max_entries + slack) {
+    evict_records(args->file_path, args->max_entries);
+  }
+  // An outdated verdict means that the filters' file has changed since the
+  // last update: the verdicts of all records are recomputed at once.
+  if (visit.stale && filters.generation != 0) {
+    restamp_database(args->file_path, &filters);
+  }
+  filters_free(&filters);
+}
+
+// State of a query, shared by the scans of the different tiers.
+typedef struct Search {
+  Arguments *args;
+  Filters filters;
+  Heap *heap;
+  Query standard_query;
+  Queries queries;
+  Matcher *matcher;
+  CompiledQuery compiled;
+  double max_accuracy; // of the queries
+  bool owns_queries;   // and their compiled form (see search_init_shared)
+  bool prefilter; // skip the lines that the compiled query rejects
+  char *within;   // only the paths of this subtree are searched
+  size_t within_len;
+  long long now;
+  long n_read;   // records read
+  long n_scored; // records parsed and matched
+  // Best record inserted in the heap (its path is not kept), for the memo
+  Record best;
+  double best_score;
+  // Called along refined searches, which are abandoned when it returns true
+  // (NULL for never)
+  bool (*interrupted)(struct Search *search);
+  bool abandoned;
+} Search;
+
+// Everything but the queries: the state of the search of one database.
+static void release_heap(void *heap) { heap_free((Heap *)heap); }
+
+static void release_matcher(void *matcher) { matcher_free((Matcher *)matcher); }
+
+// heap_free, for the heaps of the searches
+static void free_heap(Heap *heap) {
+  let_go(heap);
+  heap_free(heap);
+}
+
+static void search_init_database(Search *search, Arguments *args) {
+  search->args = args;
+  filters_init(&search->filters, args->filters);
+  search->heap = heap_create(args->n_results);
+  if (!search->heap) {
+    fprintf(stderr, "ERROR: Could not allocate heap memory.\n");
+    jumper_exit(EXIT_FAILURE);
+  }
+  hold(search->heap, release_heap);
+  // Each search has its own matcher, whose rows are reused between paths
+  search->matcher = matcher_create(search->queries, args->case_mode);
+  hold(search->matcher, release_matcher);
+  search->prefilter = false;
+  search->within = NULL;
+  search->within_len = 0;
+  if (args->within) {
+    search->within = realpath(args->within, NULL);
+    if (!search->within) {
+      search->within = strdup(args->within);
+    }
+    hold(search->within, free);
+    search->within_len = strlen(search->within);
+    while (search->within_len > 0 &&
+           search->within[search->within_len - 1] == '/') {
+      search->within[--search->within_len] = '\0';
+    }
+  }
+  search->now = (long long)time(NULL);
+  search->n_read = 0;
+  search->n_scored = 0;
+  search->best_score = -INFINITY;
+  search->interrupted = NULL;
+  search->abandoned = false;
+}
+
+static void search_init(Search *search, Arguments *args) {
+  if (args->syntax == SYNTAX_extended) {
+    search->queries = make_extended_queries(args->key, args->orderless);
+    if (search->queries.n == 0) {
+      fprintf(stderr, "Error: jumper does not accept more than %d tokens.\n",
+              MAX_TOKENS);
+      jumper_exit(EXIT_FAILURE);
+    }
+  } else {
+    search->standard_query =
+        make_standard_query(args->key, args->syntax == SYNTAX_fuzzy);
+    search->queries.queries = &search->standard_query;
+    search->queries.n = 1;
+  }
+  search->compiled = compile_queries(search->queries, args->case_mode);
+  search->max_accuracy = max_accuracy(search->queries);
+  search->owns_queries = true;
+  search_init_database(search, args);
+}
+
+// Same as search_init, for another database: the queries of model, whose
+// search has the same key and options, are shared. It has to outlive search.
+static void search_init_shared(Search *search, Arguments *args,
+                               const Search *model) {
+  search->queries = model->queries;
+  search->compiled = model->compiled;
+  search->max_accuracy = model->max_accuracy;
+  search->owns_queries = false;
+  search_init_database(search, args);
+}
+
+// Whether rec is outside of the subtree or of the period of the search, or is
+// filtered out.
+static bool search_excludes(Search *search, Record *rec) {
+  Arguments *args = search->args;
+  if (search->within &&
+      (strncmp(rec->path, search->within, search->within_len) != 0 ||
+       (rec->path[search->within_len] != '\0' &&
+        rec->path[search->within_len] != '/'))) {
+    return true;
+  }
+  if ((args->since > 0 && rec->last_visit < args->since) ||
+      (args->before > 0 && rec->last_visit >= args->before)) {
+    return true;
+  }
+  return filters_match(&search->filters, rec);
+}
+
+// Insert rec, of frecency fr and whose best match has the given accuracy, if
+// it makes it to the results.
+static void search_insert(Search *search, Record *rec, double fr,
+                          double match_score) {
+  Arguments *args = search->args;
+  const double score = args->beta * 0.25 * match_score + fr;
+  if (heap_accept(search->heap, score) &&
+      (!args->existing || exist(rec->path, args->type))) {
+    char *path = strdup(rec->path);
+    if (!path || heap_insert(search->heap, score, path) != 0) {
+      fprintf(stderr, "ERROR: Could not allocate heap memory.");
+      jumper_exit(EXIT_FAILURE);
+    }
+    if (score > search->best_score) {
+      search->best = *rec;
+      search->best_score = score;
+    }
+  }
+}
+
+// approximate points to the frecency of rec up to FRECENCY_ERROR, if it has
+// been computed (see search_records).
+static void search_record(Search *search, Record *rec,
+                          const double *approximate) {
+  Arguments *args = search->args;
+  search->n_scored++;
+  if (search_excludes(search, rec)) {
+    return;
+  }
+  // Once the heap is full, the record has to beat its minimum: the accuracy
+  // that this requires is passed down to the matcher. Most records are ruled
+  // out by their approximate frecency, the others get their exact one.
+  const double beta = args->beta * 0.25;
+  const double max_match = beta > 0 ? beta * search->max_accuracy : 0;
+  if (approximate &&
+      !heap_accept(search->heap, *approximate + FRECENCY_ERROR + max_match)) {
+    return;
+  }
+  const double fr = frecency(rec->n_visits, search->now - rec->last_visit);
+  if (!heap_accept(search->heap, fr + max_match)) {
+    return;
+  }
+  double threshold = 0;
+  const double min_score = heap_threshold(search->heap);
+  if (beta > 0 && min_score > fr) {
+    // With some slack for rounding errors: records are then checked exactly
+    threshold = (min_score - fr) / beta * (1 - 1e-9);
+  }
+  const double match_score =
+      matcher_score_above(search->matcher, rec->path, threshold);
+  if (match_score > 0) {
+    search_insert(search, rec, fr, match_score);
+  }
+}
+
+// Search the lines of f, up to the offset end (-1 for the end of the file).
+static void search_lines(Search *search, Textfile *f, long end) {
+  Record rec;
+  while ((end < 0 || file_tell(f) < end) && next_line(f)) {
+    search->n_read++;
+    // The prefilter spares the parsing of most lines that can not match
+    if (search->prefilter &&
+        !compiled_query_accepts(&search->compiled, f->line,
+                                strcspn(f->line, "|"))) {
+      continue;
+    }
+    if (!parse_record(f->line, &rec)) {
+      report_invalid_record(f);
+      continue;
+    }
+    search_record(search, &rec, NULL);
+  }
+}
+
+// Search records[0..n), whose frecencies are first approximated by blocks.
+static void search_records(Search *search, Record *records, int n) {
+  enum { BLOCK = 256 };
+  double approximate[BLOCK];
+  for (int start = 0; start < n; start += BLOCK) {
+    const int size = (n - start < BLOCK) ? n - start : BLOCK;
+    approximate_frecencies(records + start, size, search->now, approximate);
+    for (int i = 0; i < size; i++) {
+      search_record(search, records + start + i, approximate + i);
+    }
+  }
+}
+
+static void search_file(Search *search, const char *path) {
+  Textfile *f = open_file(path);
+  if (!f) {
+    return;
+  }
+  search_lines(search, f, -1);
+  close_file(f);
+}
+
+// The cold tier is only scanned if one of its records could make it to the
+// results.
+static void search_cold_tier(Search *search) {
+  Arguments *args = search->args;
+  char *cold = sidecar_path(args->file_path, COLD_SUFFIX);
+  Meta *meta = meta_load(args->file_path);
+  // No archived record has been visited after cold_last_visit
+  if (cold && meta &&
+      (args->since <= 0 ||
+       (long long)meta_get(meta, "cold_last_visit", 0) >= args->since)) {
+    const double cold_frecency = frecency(
+        meta_get(meta, "cold_visits", 0),
+        search->now - (long long)meta_get(meta, "cold_last_visit", 0));
+    const double max_score =
+        (args->beta > 0 ? args->beta : 0) * 0.25 *
+            max_accuracy(search->queries) +
+        cold_frecency;
+    if (heap_accept(search->heap, max_score)) {
+      search_file(search, cold);
+    }
+  }
+  free(cold);
+  if (meta) {
+    meta_free(meta);
+  }
+}
+
+// Empty and one-character queries are first answered from the view of the
+// most frecent records. This is enough if no record outside of the view can
+// beat the last result; otherwise the heap is reset for another plan.
+static bool search_top_view(Search *search) {
+  Arguments *args = search->args;
+  TopView view;
+  if (!top_load(args->file_path, &view)) {
+    return false;
+  }
+  search_records(search, view.records, view.n);
+  search->n_read += view.n;
+  const double max_score =
+      (args->beta > 0 ? args->beta : 0) * 0.25 *
+          max_accuracy(search->queries) +
+      top_bound(&view, search->now);
+  top_free(&view);
+  if (!heap_accept(search->heap, max_score)) {
+    return true;
+  }
+  free_heap(search->heap);
+  search->heap = heap_create(args->n_results);
+  if (!search->heap) {
+    fprintf(stderr, "ERROR: Could not allocate heap memory.\n");
+    jumper_exit(EXIT_FAILURE);
+  }
+  hold(search->heap, release_heap);
+  return false;
+}
+
+// Recency-bounded queries only read the end of the journal, which holds the
+// latest version of the records of both tiers visited since then.
+static bool search_journal(Search *search) {
+  Arguments *args = search->args;
+  Recent recent;
+  if (!journal_since(args->file_path, args->since, &recent)) {
+    return false;
+  }
+  search_records(search, recent.records, recent.n);
+  search->n_read += recent.n;
+  recent_free(&recent);
+  return true;
+}
+
+// Ways of reading the records of a database
+typedef enum ACCESS {
+  ACCESS_scan,     // all the records
+  ACCESS_range,    // ranges of the sorted region, and the records after it
+  ACCESS_top_view, // the most frecent records (see top.h)
+  ACCESS_journal,  // the records visited since --since (see journal.h)
+} ACCESS;
+
+static const char *const access_names[] = {"full scan", "range scan",
+                                           "top view", "journal"};
+
+#define MAX_RANGES 2
+
+typedef struct Plan {
+  ACCESS access;
+  bool prefilter;
+  long ranges[MAX_RANGES][2]; // byte ranges of the sorted region
+  int n_ranges;
+  long sorted; // the records after it are read by range scans
+  unsigned long long known; // characters of all the records of the ranges
+  // Estimations
+  double read;
+  double scored;
+  double cost;
+} Plan;
+
+// Statistics of the database (see save_statistics). Without them, the paths
+// are assumed to contain every character, so that the prefilter is not used.
+typedef struct Statistics {
+  double records;
+  double line_length;
+  double path_length;
+  double char_frequency[CHAR_BITS];
+} Statistics;
+
+static const double default_line_length = 80;
+
+// Costs of the steps of a search, in time to read one byte of the database
+// (measured on a database of 70k files)
+static const double parse_cost = 250; // per record parsed and filtered
+static const double mask_cost = 0.5;  // per byte of path prefiltered
+static const double match_cost = 1;   // per byte of path and query character
+static const double sort_cost = 800;  // per line of the journal (copied,
+                                      // sorted and parsed)
+
+static void load_statistics(const Meta *meta, long size, Statistics *stats) {
+  stats->line_length = meta_get(meta, "line_length", default_line_length);
+  stats->path_length = meta_get(meta, "path_length", stats->line_length - 20);
+  stats->records = size / stats->line_length;
+  char key[32];
+  for (int b = 0; b < CHAR_BITS; b++) {
+    snprintf(key, sizeof(key), "char_frequency_%d", b);
+    stats->char_frequency[b] = meta_get(meta, key, 1);
+  }
+}
+
+static void estimate_cost(const Search *search, const Statistics *stats,
+                          Plan *plan) {
+  double passing = 1;
+  if (plan->prefilter) {
+    for (int b = 0; b < CHAR_BITS; b++) {
+      if ((search->compiled.mask & ~plan->known) & (1ULL << b)) {
+        passing *= stats->char_frequency[b];
+      }
+    }
+  }
+  plan->scored = plan->read * passing;
+  const int length = search->queries.queries[0].length;
+  const double match =
+      parse_cost + search->queries.n * stats->path_length * length * match_cost;
+  plan->cost = plan->read * stats->line_length + plan->scored * match;
+  if (plan->prefilter) {
+    plan->cost += plan->read * stats->path_length * mask_cost;
+  }
+  if (plan->access == ACCESS_journal) {
+    plan->cost += plan->read * sort_cost;
+  }
+}
+
+// Byte range of the lines of the sorted region whose path is key (if exact)
+// or starts with key.
+static void key_range(Textfile *f, long sorted, const char *key, bool exact,
+                      long range[2]) {
+  const size_t n = strlen(key);
+  char *next = (char *)malloc(n + 2);
+  if (!next) {
+    fprintf(stderr, "ERROR: Could not allocate memory.\n");
+    jumper_exit(EXIT_FAILURE);
+  }
+  // Smallest string after all the paths of the range
+  strcpy(next, key);
+  size_t k = n;
+  if (exact) {
+    next[k++] = '\x01';
+    next[k] = '\0';
+  } else {
+    while (k > 0 && (unsigned char)next[k - 1] == 0xff) {
+      next[--k] = '\0';
+    }
+    if (k > 0) {
+      next[k - 1]++;
+    }
+  }
+  range[0] = lower_bound(f, sorted, compare_line_path, key);
+  range[1] = (k > 0) ? lower_bound(f, sorted, compare_line_path, next) : sorted;
+  free(next);
+}
+
+static void print_plan(const Plan *plan, const char *label) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s%s", access_names[plan->access],
+           plan->prefilter ? " + prefilter" : "");
+  fprintf(stderr, "%-12s%-24s cost %-9.3g read %-9.0f matched %.0f\n", label,
+          name, plan->cost, plan->read, plan->scored);
+}
+
+// Candidate plan, kept if it is cheaper than best. The lines read by scans
+// can be prefiltered; the top view and the journal hold few records, which
+// are parsed anyway.
+static void consider(const Search *search, const Statistics *stats, Plan *plan,
+                     Plan *best) {
+  const bool scan =
+      plan->access == ACCESS_scan || plan->access == ACCESS_range;
+  for (int prefilter = 0; prefilter < 2; prefilter++) {
+    if (prefilter && (!scan || search->compiled.mask == 0)) {
+      break;
+    }
+    plan->prefilter = prefilter;
+    estimate_cost(search, stats, plan);
+    if (search->args->explain_plan) {
+      print_plan(plan, "Candidate:");
+    }
+    if (best->cost < 0 || plan->cost < best->cost) {
+      *best = *plan;
+    }
+  }
+}
+
+// Cheapest way of reading the database f for the search, among the accesses
+// that are not excluded (bits of excluded).
+static Plan plan_search(const Search *search, Textfile *f,
+                        unsigned int excluded) {
+  Arguments *args = search->args;
+  Meta *meta = meta_load(args->file_path);
+  if (!meta) {
+    fprintf(stderr, "ERROR: Could not allocate memory.\n");
+    jumper_exit(EXIT_FAILURE);
   }
-  strcpy(tempname, dir);
-  strcat(tempname, "/.jumper_XXXXXX");
-  free(path_copy);
-  const int temp_fd = mkstemp(tempname);
-  if (temp_fd == -1) {
-    fprintf(stderr, "ERROR: Could not create the temporary file %s\n",
-            tempname);
-    exit(EXIT_FAILURE);
+  const long size = file_size(f);
+  const long sorted = get_sorted_bytes(meta, f->fp);
+  Statistics stats;
+  load_statistics(meta, size, &stats);
+  meta_free(meta);
+
+  Plan best = {.cost = -1};
+  Plan plan = {.access = ACCESS_scan, .read = stats.records};
+  consider(search, &stats, &plan, &best);
+
+  if (!(excluded & (1u << ACCESS_range)) && sorted > 0) {
+    plan.access = ACCESS_range;
+    plan.sorted = sorted;
+    // The records of a subtree form contiguous ranges of the sorted region
+    if (search->within && search->within_len > 0) {
+      char *key = (char *)malloc(search->within_len + 2);
+      if (!key) {
+        fprintf(stderr, "ERROR: Could not allocate memory.\n");
+        jumper_exit(EXIT_FAILURE);
+      }
+      strcpy(key, search->within);
+      key_range(f, sorted, key, true, plan.ranges[0]);
+      strcat(key, "/");
+      key_range(f, sorted, key, false, plan.ranges[1]);
+      free(key);
+      plan.n_ranges = 2;
+      plan.known = char_mask(search->within, search->within_len);
+      plan.read = (plan.ranges[0][1] - plan.ranges[0][0] + plan.ranges[1][1] -
+                   plan.ranges[1][0] + size - sorted) /
+                  stats.line_length;
+      consider(search, &stats, &plan, &best);
+    }
+    // and so do the matches of an anchored query
+    if (search->compiled.anchor) {
+      const char *anchor = search->compiled.anchor;
+      key_range(f, sorted, anchor, false, plan.ranges[0]);
+      plan.n_ranges = 1;
+      plan.known = char_mask(anchor, strlen(anchor));
+      plan.read =
+          (plan.ranges[0][1] - plan.ranges[0][0] + size - sorted) /
+          stats.line_length;
+      consider(search, &stats, &plan, &best);
+    }
   }
-  FILE *temp = fdopen(temp_fd, "r+");
-  if (!temp) {
-    fprintf(stderr,
-            "ERROR: Could not open the file descriptor %d of the temporary "
-            "file %s\n",
-            temp_fd, tempname);
-    exit(EXIT_FAILURE);
+
+  plan.known = 0;
+  bool short_queries = !search->within;
+  for (int i = 0; i < search->queries.n; i++) {
+    short_queries = short_queries && search->queries.queries[i].length <= 1;
+  }
+  if (!(excluded & (1u << ACCESS_top_view)) && short_queries) {
+    plan.access = ACCESS_top_view;
+    plan.read = (stats.records < TOP_SIZE) ? stats.records : TOP_SIZE;
+    consider(search, &stats, &plan, &best);
   }
 
-  // Preserve permissions from original file
-  struct stat st;
-  if (stat(args->file_path, &st) == 0) {
-    fchmod(temp_fd, st.st_mode);
+  if (!(excluded & (1u << ACCESS_journal)) && args->since > 0) {
+    const long bytes = journal_bytes_since(args->file_path, args->since);
+    if (bytes >= 0) {
+      plan.access = ACCESS_journal;
+      plan.read = bytes / stats.line_length;
+      consider(search, &stats, &plan, &best);
+    }
   }
+  return best;
+}
 
-  // Count total lines for progress tracking
-  int total_lines = 0;
-  while (next_line(f)) {
-    total_lines++;
+// Returns false if the plan could not be carried out: the indexes it relies
+// on are missing, or the top view can not answer the query.
+static bool execute_plan(Search *search, Textfile *f, const Plan *plan) {
+  search->prefilter = plan->prefilter;
+  switch (plan->access) {
+  case ACCESS_top_view:
+    return search_top_view(search);
+  case ACCESS_journal:
+    return search_journal(search);
+  case ACCESS_range:
+    for (int i = 0; i < plan->n_ranges; i++) {
+      file_seek(f, plan->ranges[i][0]);
+      search_lines(search, f, plan->ranges[i][1]);
+    }
+    file_seek(f, plan->sorted);
+    search_lines(search, f, -1);
+    return true;
+  default:
+    file_seek(f, 0);
+    search_lines(search, f, -1);
+    return true;
   }
-  file_close(f);
+}
 
-  // Reopen file for processing
-  f = file_open(args->file_path);
+static void search_database(Search *search) {
+  Arguments *args = search->args;
+  Textfile *f = open_file(args->file_path);
   if (!f) {
-    fclose(temp);
-    unlink(tempname);
-    free(tempname);
     return;
   }
+  unsigned int excluded = 0;
+  Plan plan;
+  while (true) {
+    plan = plan_search(search, f, excluded);
+    if (args->explain_plan) {
+      print_plan(&plan, "Plan:");
+    }
+    if (execute_plan(search, f, &plan)) {
+      break;
+    }
+    excluded |= 1u << plan.access;
+    if (args->explain_plan) {
+      fprintf(stderr, "The %s could not answer the query.\n",
+              access_names[plan.access]);
+    }
+  }
+  close_file(f);
+  const long n_read = search->n_read;
+  const long n_scored = search->n_scored;
+  // The journal also covers the archive
+  if (plan.access != ACCESS_journal) {
+    search_cold_tier(search);
+  }
+  if (args->explain_plan) {
+    fprintf(stderr, "Estimated:  read %.0f, matched %.0f\n", plan.read,
+            plan.scored);
+    fprintf(stderr, "Actual:     read %ld, matched %ld\n", n_read, n_scored);
+    fprintf(stderr, "Archive:    read %ld, matched %ld\n",
+            search->n_read - n_read, search->n_scored - n_scored);
+  }
+}
 
-  char **filters = read_filters(args->filters);
-  Record rec;
-  int removed_count = 0;
-  int kept_count = 0;
-  int current_line = 0;
+static void search_free(Search *search) {
+  let_go(search->matcher);
+  matcher_free(search->matcher);
+  if (search->owns_queries) {
+    compiled_query_free(&search->compiled);
+    free_queries(search->queries);
+    if (search->args->syntax == SYNTAX_extended) {
+      free(search->queries.queries);
+    }
+  }
+  let_go(search->within);
+  free(search->within);
+  filters_free(&search->filters);
+}
 
-  char *type_name = args->type == TYPE_files ? "files" : "directories";
-  fprintf(stdout, "Cleaning %s' database...\n", type_name);
-  while (next_line(f)) {
-    parse_record(f->line, &rec);
-    if (!glob_match_list(filters, rec.path) && exist(rec.path, args->type)) {
-      char *rec_string = record_to_string(&rec);
-      if (fputs(rec_string, temp) == EOF || fputs("\n", temp) == EOF) {
-        fprintf(stderr, "\nERROR: Failed to write to temporary file\n");
-        free(rec_string);
-        fclose(temp);
-        unlink(tempname);
-        file_close(f);
-        free(tempname);
-        exit(EXIT_FAILURE);
-      }
-      free(rec_string);
-      kept_count++;
-    } else {
-      removed_count++;
+// Sort the results of the search, highlighted if asked. Returns their number.
+static int search_results(Search *search) {
+  const int n = heap_sort(search->heap);
+  if (search->args->highlight) {
+    // Only the results are highlighted
+    for (int i = 0; i < n; i++) {
+      heap_set_path(search->heap, i,
+                    matcher_highlight(search->matcher,
+                                      heap_path(search->heap, i)));
     }
-    current_line++;
-    progress_bar(current_line, total_lines);
   }
-  file_close(f);
-  fclose(temp);
-  free_filters(filters);
+  return n;
+}
 
-  fprintf(stdout, "Cleaned %d %s (kept %d)\n", removed_count, type_name,
-          kept_count);
+// Print the results of the search, and free it (heap_print frees the heap).
+static void search_print(Search *search, const char *prefix) {
+  Arguments *args = search->args;
+  search_results(search);
+  let_go(search->heap);
+  heap_print(search->heap, args->print_scores, args->relative_to,
+             args->home_tilde, prefix);
+  search_free(search);
+}
 
-  // Only rename if something was removed
-  if (removed_count == 0) {
-    unlink(tempname);
-    free(tempname);
-    return;
+// Options of a search that change the scores of the records
+static void memo_options(const Arguments *args, char *options, size_t size) {
+  snprintf(options, size, "%d,%d,%d,%.17g", (int)args->syntax,
+           (int)args->case_mode, args->orderless, args->beta);
+}
+
+// Queries of a single result on all the records are answered by the memo.
+static bool memoizable(const Arguments *args) {
+  return args->n_results == 1 && *args->key != '\0' && !args->within &&
+         args->since <= 0 && args->before <= 0;
+}
+
+// Whether the memoized result of the query is still its best result, whose
+// score is then set. The scores of the other records have only decreased since
+// the result was memoized, except for the ones visited since then.
+static bool memo_holds(Search *search, const MemoEntry *entry, double *score) {
+  Arguments *args = search->args;
+  Recent recent;
+  // New filters may let other records through
+  if (entry->filters_generation != search->filters.generation ||
+      !journal_since(args->file_path, entry->time, &recent)) {
+    return false;
+  }
+  const double beta = args->beta * 0.25;
+  Record rec = {.n_visits = entry->n_visits, .last_visit = entry->last_visit};
+  double bound = entry->bound;
+  for (int i = 0; i < recent.n; i++) {
+    Record *r = recent.records + i;
+    if (strcmp(r->path, entry->path) == 0) {
+      rec.n_visits = r->n_visits;
+      rec.last_visit = r->last_visit;
+      continue;
+    }
+    if (search_excludes(search, r)) {
+      continue;
+    }
+    const double match_score = matcher_score(search->matcher, r->path);
+    const double fr = frecency(r->n_visits, search->now - r->last_visit);
+    if (match_score > 0 && beta * match_score + fr > bound) {
+      bound = beta * match_score + fr;
+    }
   }
+  const int n_visited = recent.n;
+  recent_free(&recent);
+  const double match_score = matcher_score(search->matcher, entry->path);
+  *score = beta * match_score +
+           frecency(rec.n_visits, search->now - rec.last_visit);
+  const bool exists = !args->existing || exist(entry->path, args->type);
+  const bool holds = match_score > 0 && *score > bound && exists;
+  if (args->explain_plan) {
+    fprintf(stderr,
+            "Memo:       %s, margin %.3f (%d records visited since it was "
+            "memoized)\n",
+            !exists ? "the result does not exist anymore"
+            : holds ? "the result holds"
+                    : "the result is outdated",
+            *score - bound, n_visited);
+  }
+  return holds;
+}
 
-  if (args->dry_run) {
-    fprintf(stdout, "Dry run: filtered data saved to %s\n", tempname);
-    fprintf(stdout, "Original database unchanged: %s\n", args->file_path);
-    free(tempname);
+// Search the best result of a query of a single result, and memoize it with
+// the best score of the other records. The existence of the records is not
+// checked, so that this score bounds the scores of all of them. If selected is
+// not NULL, the result is only memoized if it is this path. Returns the result
+// (to be freed), NULL if there is none.
+static char *memo_search(Arguments *args, Memo *memo, const char *selected,
+                         double *score) {
+  Arguments all = *args;
+  all.n_results = 2;
+  all.existing = false;
+  Search search;
+  search_init(&search, &all);
+  search_database(&search);
+  const int n = heap_sort(search.heap);
+  char *path = (n > 0) ? strdup(heap_path(search.heap, 0)) : NULL;
+  *score = (n > 0) ? heap_value(search.heap, 0) : 0;
+  // A tie would make the result depend on the order of the records
+  if (path && (n == 1 || *score > heap_value(search.heap, 1)) &&
+      (!selected || strcmp(path, selected) == 0)) {
+    char options[64];
+    memo_options(args, options, sizeof(options));
+    const MemoEntry entry = {
+        .query = (char *)args->key,
+        .options = options,
+        .path = path,
+        .n_visits = search.best.n_visits,
+        .last_visit = search.best.last_visit,
+        .bound = (n > 1) ? heap_value(search.heap, 1) : -INFINITY,
+        .time = search.now,
+        .filters_generation = search.filters.generation};
+    memo_set(memo, &entry);
+    memo_save(memo);
+  }
+  free_heap(search.heap);
+  search_free(&search);
+  return path;
+}
+
+// Answer a query of a single result from the memo, or search and memoize it.
+static void search_memo(Search *search) {
+  Arguments *args = search->args;
+  Memo *memo = memo_load(args->file_path);
+  if (!memo) {
+    search_database(search);
     return;
   }
+  char options[64];
+  memo_options(args, options, sizeof(options));
+  const MemoEntry *entry = memo_find(memo, args->key, options);
+  if (!entry && args->explain_plan) {
+    fprintf(stderr, "Memo:       the query has not been memoized\n");
+  }
+  double score;
+  char *path;
+  if (entry && memo_holds(search, entry, &score)) {
+    path = strdup(entry->path);
+  } else {
+    path = memo_search(args, memo, NULL, &score);
+    if (path && args->existing && !exist(path, args->type)) {
+      // The other records have to be searched
+      free(path);
+      path = NULL;
+      search_database(search);
+    }
+  }
+  if (path && heap_insert(search->heap, score, path) != 0) {
+    fprintf(stderr, "ERROR: Could not allocate heap memory.");
+    jumper_exit(EXIT_FAILURE);
+  }
+  memo_free(memo);
+}
 
-  if (rename(tempname, args->file_path) != 0) {
-    fprintf(stderr, "ERROR: Failed to replace database file: %s\n",
-            strerror(errno));
-    fprintf(stderr, "Cleaned data is in: %s\n", tempname);
-    exit(EXIT_FAILURE);
+static void lookup(Arguments *args, const char *prefix) {
+  if (args->n_results <= 0) {
+    return;
   }
-  free(tempname);
+  if (access(args->file_path, F_OK) != 0) {
+    return;
+  }
+  Search search;
+  search_init(&search, args);
+  if (memoizable(args)) {
+    search_memo(&search);
+  } else {
+    search_database(&search);
+  }
+  search_print(&search, prefix);
 }
 
-static void clean_both_databases(Arguments *args) {
-  // Clean files database
-  args->type = TYPE_files;
-  args->file_path = get_default_database_path(TYPE_files);
-  clean_database(args);
+// One of the databases of a federated search
+typedef struct Source {
+  Arguments args; // of its search: its file and type
+  Search search;
+  char tag[64]; // printed before its results
+  char *path;   // default path of a type, to be freed
+  pthread_t thread;
+  bool started;
+} Source;
 
-  printf("\n");
+static void *search_source(void *arg) {
+  Source *source = (Source *)arg;
+  if (access(source->args.file_path, F_OK) == 0) {
+    search_database(&source->search);
+  }
+  return NULL;
+}
 
-  // Clean directories database
-  args->type = TYPE_directories;
-  args->file_path = get_default_database_path(TYPE_directories);
-  clean_database(args);
+// Add the database at path, tagged with the name of its file, or with the
+// initial of its type.
+static void add_source(Source *sources, int *n, const Arguments *args,
+                       const char *path, TYPE type, bool tag_type) {
+  Source *source = sources + (*n)++;
+  source->args = *args;
+  source->args.file_path = path;
+  source->args.type = type;
+  source->path = NULL;
+  source->started = false;
+  if (tag_type) {
+    snprintf(source->tag, sizeof(source->tag), "%c\t",
+             type == TYPE_directories ? 'd' : 'f');
+  } else {
+    const char *name = strrchr(path, '/');
+    snprintf(source->tag, sizeof(source->tag), "%s\t", name ? name + 1 : path);
+  }
 }
 
-static void update_database(Arguments *args) {
-  char **filters = read_filters(args->filters);
-  if (glob_match_list(filters, args->key)) {
-    free_filters(filters);
+// Search several databases at once (--type=all, --db): the query is compiled
+// once, each database is searched by its own thread, and their results are
+// merged by decreasing score.
+static void federated_lookup(Arguments *args) {
+  if (args->n_results <= 0) {
     return;
   }
-  free_filters(filters);
-
-  long long now = (long long)time(NULL);
-  Textfile *f = file_open_rw(args->file_path);
-  Record rec;
-  const size_t n = strlen(args->key) + 2;
-  char *prefix = (char *)malloc(n * sizeof(char));
-  strcpy(prefix, args->key);
-  prefix[n - 2] = '|';
-  prefix[n - 1] = '\0';
-  while (next_line(f)) {
-    if (strncmp(f->line, prefix, n - 1) == 0) {
-      // parse_record below will modify f->line
-      // we have to make a copy of it
-      char *buffer = strdup(f->line);
-      parse_record(buffer, &rec);
-      update_record(&rec, now, args->weight);
-      char *rec_string = record_to_string(&rec);
-      if (!rec_string) {
-        file_close(f);
-        fprintf(stderr, "ERROR: failed at formatting a record to string.\n");
-        exit(EXIT_FAILURE);
+  Source sources[MAX_EXTRA_DATABASES + 3];
+  int n = 0;
+  if (args->all_types) {
+    const TYPE types[2] = {TYPE_directories, TYPE_files};
+    for (int t = 0; t < 2; t++) {
+      char *path = get_default_database_path(types[t]);
+      add_source(sources, &n, args, path, types[t], true);
+      sources[n - 1].path = path;
+    }
+  }
+  if (args->file_path) {
+    add_source(sources, &n, args, args->file_path, args->type,
+               args->default_file_path != NULL);
+  }
+  for (int i = 0; i < args->n_extra_databases; i++) {
+    add_source(sources, &n, args, args->extra_databases[i], args->type,
+               false);
+  }
+  search_init(&sources[0].search, &sources[0].args);
+  for (int i = 1; i < n; i++) {
+    search_init_shared(&sources[i].search, &sources[i].args,
+                       &sources[0].search);
+  }
+  // The plans are printed in the order of the databases
+  for (int i = 1; i < n && !args->explain_plan; i++) {
+    sources[i].started = pthread_create(&sources[i].thread, NULL,
+                                        search_source, sources + i) == 0;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!sources[i].started) {
+      if (args->explain_plan) {
+        fprintf(stderr, "Database %s:\n", sources[i].args.file_path);
       }
-      overwrite_line(f, rec_string);
-      free(rec_string);
-      free(buffer);
-      break;
+      search_source(sources + i);
     }
   }
-  free(prefix);
-  if (feof(f->fp)) {
-    rec.n_visits = args->weight;
-    rec.path = args->key;
-    rec.last_visit = now;
-    char *rec_string = record_to_string(&rec);
-    if (!rec_string) {
-      file_close(f);
-      fprintf(stderr, "ERROR: failed at formatting a record to string.\n");
-      exit(EXIT_FAILURE);
+  // A search that stopped in another thread stops the command (see
+  // jumper_exit)
+  int status = -1;
+  for (int i = 0; i < n; i++) {
+    void *stopped = NULL;
+    if (sources[i].started && pthread_join(sources[i].thread, &stopped) == 0 &&
+        stopped) {
+      status = (int)(intptr_t)stopped - 1;
     }
-    write_line(f, rec_string);
-    free(rec_string);
   }
-  file_close(f);
+  if (status >= 0) {
+    jumper_exit(status);
+  }
+  // k-way merge of the sorted results
+  int counts[MAX_EXTRA_DATABASES + 3];
+  int heads[MAX_EXTRA_DATABASES + 3];
+  for (int i = 0; i < n; i++) {
+    counts[i] = search_results(&sources[i].search);
+    heads[i] = 0;
+  }
+  for (int printed = 0; printed < args->n_results; printed++) {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+      if (heads[i] < counts[i] &&
+          (best < 0 || heap_value(sources[i].search.heap, heads[i]) >
+                           heap_value(sources[best].search.heap, heads[best]))) {
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    heap_print_item(sources[best].search.heap, heads[best]++,
+                    args->print_scores, args->relative_to, args->home_tilde,
+                    sources[best].tag);
+  }
+  // The shared queries are freed last
+  for (int i = n - 1; i >= 0; i--) {
+    free_heap(sources[i].search.heap);
+    search_free(&sources[i].search);
+    free(sources[i].path);
+  }
 }
 
-static void lookup(Arguments *args, const char *prefix) {
-  if (args->n_results <= 0) {
+// Memoize the key of an update as the result of the query for which it has
+// been selected, as the query is likely to be repeated. A memoized result has
+// to be the best one: nothing is memoized if the key does not win the query,
+// even after its visit.
+static void memoize_selection(Arguments *args) {
+  Arguments query = *args;
+  query.key = args->query;
+  query.n_results = 1;
+  if (!memoizable(&query)) {
     return;
   }
-  Textfile *f = file_open(args->file_path);
-  if (!f) {
+  Memo *memo = memo_load(args->file_path);
+  if (!memo) {
     return;
   }
-  char **filters = read_filters(args->filters);
-  Heap *heap = heap_create(args->n_results);
-  if (!heap) {
-    fprintf(stderr, "ERROR: Could not allocate heap memory.\n");
-    exit(EXIT_FAILURE);
+  double score;
+  free(memo_search(&query, memo, args->key, &score));
+  memo_free(memo);
+}
+
+static void update_database(Arguments *args) {
+  char *canonical_key = NULL;
+  if (args->canonicalize) {
+    PathCache *cache = path_cache_create();
+    if (cache) {
+      canonical_key = canonicalize(cache, args->key, NULL);
+      path_cache_free(cache);
+    }
+    if (canonical_key) {
+      args->key = canonical_key;
+    }
   }
-  Queries queries;
-  if (args->syntax == SYNTAX_extended) {
-    queries = make_extended_queries(args->key, args->orderless);
+  update_entry(args);
+  if (args->query) {
+    memoize_selection(args);
+  }
+  free(canonical_key);
+}
+
+// Candidates for the matches of a query: the records of a database that
+// match it, with the accuracies of their matches, or a superset of them. A
+// query that refines it (see query_refines) only has to match these records.
+typedef struct Refinement {
+  char *query;
+  // Options of the search that select the records
+  SYNTAX syntax;
+  CASE_MODE case_mode;
+  bool orderless;
+  char *within;
+  long long since;
+  long long before;
+  unsigned int filters_generation;
+  int *indices; // of the records, in the order of the database
+  double *accuracies; // if exact
+  int n;
+  bool exact; // the candidates are the matches, not a superset of them
+  unsigned long last_use;
+} Refinement;
+
+#define MAX_REFINEMENTS 16
+
+// Database kept in memory by the server, until its file changes.
+typedef struct Database {
+  char *path;
+  unsigned int generation;
+  Record *records;
+  char **lines;
+  Signature *signatures; // of the records' paths
+  int n;
+  Refinement refinements[MAX_REFINEMENTS];
+  int n_refinements;
+} Database;
+
+#define MAX_DATABASES 4
+
+static void free_refinement(Refinement *refinement) {
+  free(refinement->query);
+  free(refinement->within);
+  free(refinement->indices);
+  free(refinement->accuracies);
+}
+
+static void close_database(Database *db) {
+  if (db->n >= 0) {
+    free_records(db->records, db->lines, db->n);
+    free(db->signatures);
+  }
+  for (int i = 0; i < db->n_refinements; i++) {
+    free_refinement(db->refinements + i);
+  }
+  db->n_refinements = 0;
+}
+
+// The database of path, (re)loaded if its file has changed since it was last
+// read. NULL if it does not exist.
+static Database *get_database(Database *databases, int *n_databases,
+                              const char *path) {
+  const unsigned int generation = file_generation(path);
+  Database *db = NULL;
+  for (int i = 0; i < *n_databases && !db; i++) {
+    if (strcmp(databases[i].path, path) == 0) {
+      db = databases + i;
+    }
+  }
+  if (db && db->generation == generation) {
+    return db->n >= 0 ? db : NULL;
+  }
+  if (!db) {
+    if (*n_databases == MAX_DATABASES) {
+      // Replace the least recently added one
+      free(databases[0].path);
+      close_database(databases);
+      memmove(databases, databases + 1,
+              (MAX_DATABASES - 1) * sizeof(Database));
+      (*n_databases)--;
+    }
+    db = databases + (*n_databases)++;
+    db->path = strdup(path);
+    db->n_refinements = 0;
   } else {
-    Query query = make_standard_query(args->key, args->syntax == SYNTAX_fuzzy);
-    queries.queries = &query;
-    queries.n = 1;
+    close_database(db);
+  }
+  db->generation = generation;
+  db->n = load_records(path, &db->records, &db->lines);
+  if (db->n < 0) {
+    return NULL;
+  }
+  db->signatures = (Signature *)malloc((db->n + 1) * sizeof(Signature));
+  if (!db->signatures) {
+    fprintf(stderr, "ERROR: Could not allocate memory for %d entries.\n",
+            db->n);
+    jumper_exit(EXIT_FAILURE);
   }
+  for (int i = 0; i < db->n; i++) {
+    db->signatures[i] = signature_of(db->records[i].path);
+  }
+  return db;
+}
 
-  long long now = (long long)time(NULL);
-  double match_score;
-  double score;
-  char *matched_str;
-  Record rec;
-  while (next_line(f)) {
-    parse_record(f->line, &rec);
-    if (glob_match_list(filters, rec.path)) {
+static bool same_selection(const Refinement *refinement,
+                           const Search *search) {
+  const Arguments *args = search->args;
+  return refinement->syntax == args->syntax &&
+         refinement->case_mode == args->case_mode &&
+         refinement->orderless == args->orderless &&
+         refinement->since == args->since &&
+         refinement->before == args->before &&
+         refinement->filters_generation == search->filters.generation &&
+         (refinement->within && search->within
+              ? strcmp(refinement->within, search->within) == 0
+              : refinement->within == search->within);
+}
+
+// The smallest set of candidates for the query of the search: the records
+// matching a query that it refines (the longest one, on ties). NULL if there
+// is none.
+static Refinement *find_refinement(Database *db, const Search *search) {
+  Refinement *best = NULL;
+  for (int i = 0; i < db->n_refinements; i++) {
+    Refinement *refinement = db->refinements + i;
+    if (same_selection(refinement, search) &&
+        query_refines(refinement->query, search->args->key,
+                      search->args->syntax) &&
+        (!best || refinement->n < best->n ||
+         (refinement->n == best->n &&
+          strlen(refinement->query) > strlen(best->query)))) {
+      best = refinement;
+    }
+  }
+  return best;
+}
+
+// Slot for a new refinement: the least recently used one is replaced.
+static Refinement *new_refinement(Database *db, const Search *search) {
+  Refinement *refinement;
+  if (db->n_refinements < MAX_REFINEMENTS) {
+    refinement = db->refinements + db->n_refinements++;
+  } else {
+    refinement = db->refinements;
+    for (int i = 1; i < MAX_REFINEMENTS; i++) {
+      if (db->refinements[i].last_use < refinement->last_use) {
+        refinement = db->refinements + i;
+      }
+    }
+    free_refinement(refinement);
+  }
+  const Arguments *args = search->args;
+  refinement->query = strdup(args->key);
+  refinement->syntax = args->syntax;
+  refinement->case_mode = args->case_mode;
+  refinement->orderless = args->orderless;
+  refinement->within = search->within ? strdup(search->within) : NULL;
+  refinement->since = args->since;
+  refinement->before = args->before;
+  refinement->filters_generation = search->filters.generation;
+  refinement->indices = NULL;
+  refinement->accuracies = NULL;
+  refinement->n = 0;
+  refinement->exact = false;
+  return refinement;
+}
+
+// The candidates of a refined query are all matched, so that its candidates
+// are then its matches. Large databases are first searched as by
+// search_records instead, where most records are ruled out by their frecency:
+// one-character queries match most records, but are then answered quickly.
+// Their candidates are only narrowed down by the compiled query.
+#define EXACT_CANDIDATES 16384
+
+// Search the candidates records[0..n) by frecency screening (see
+// search_records). approximate has room for n frecencies.
+static void search_block(Search *search, Record *records, int n,
+                         double *approximate) {
+  approximate_frecencies(records, n, search->now, approximate);
+  for (int i = 0; i < n; i++) {
+    search_record(search, records + i, approximate + i);
+  }
+}
+
+// Search the records of db, matching only the candidates of the query that the
+// query refines. As the user types, each query is then matched against the
+// candidates of the previous one, which are kept for the next ones.
+static void search_refinement(Search *search, Database *db,
+                              unsigned long use) {
+  Refinement *base = find_refinement(db, search);
+  const bool same = base && strcmp(base->query, search->args->key) == 0;
+  const int n = base ? base->n : db->n;
+  if (search->args->explain_plan) {
+    if (base) {
+      fprintf(stderr, "Refinement of \"%s\": %d candidates%s.\n", base->query,
+              n, base->exact ? " (matched)" : "");
+    } else {
+      fprintf(stderr, "Full scan: %d candidates.\n", n);
+    }
+  }
+  search->n_read += n;
+  if (same && base->exact) {
+    base->last_use = use;
+    for (int i = 0; i < n; i++) {
+      Record *rec = db->records + base->indices[i];
+      search_insert(search, rec,
+                    frecency(rec->n_visits, search->now - rec->last_visit),
+                    base->accuracies[i]);
+    }
+    return;
+  }
+  const bool exact = n <= EXACT_CANDIDATES || (base && !same);
+  const int capacity = n > 0 ? n : 1;
+  int *indices = (int *)malloc(capacity * sizeof(int));
+  double *accuracies = exact ? (double *)malloc(capacity * sizeof(double))
+                             : NULL;
+  if (!indices || (exact && !accuracies)) {
+    fprintf(stderr, "ERROR: Could not allocate memory for %d entries.\n", n);
+    jumper_exit(EXIT_FAILURE);
+  }
+  enum { BLOCK = 256 };
+  Record block[BLOCK];
+  double approximate[BLOCK];
+  int m = 0;
+  int n_candidates = 0;
+  for (int i = 0; i < n; i++) {
+    // The candidates found so far can not be kept
+    if (search->interrupted && i % 1024 == 1023 &&
+        search->interrupted(search)) {
+      free(indices);
+      free(accuracies);
+      search->abandoned = true;
+      return;
+    }
+    const int index = base ? base->indices[i] : i;
+    Record *rec = db->records + index;
+    if ((!base && search_excludes(search, rec)) ||
+        !compiled_query_accepts_signature(&search->compiled,
+                                          db->signatures[index])) {
+      continue;
+    }
+    if (!exact) {
+      indices[n_candidates++] = index;
+      block[m++] = *rec;
+      if (m == BLOCK) {
+        search_block(search, block, m, approximate);
+        m = 0;
+      }
       continue;
     }
-    match_score = match_accuracy(rec.path, queries, args->highlight,
-                                 &matched_str, args->case_mode);
-    if (match_score > 0) {
-      score = args->beta * 0.25 * match_score +
-              frecency(rec.n_visits, now - rec.last_visit);
-      if (heap_accept(heap, score) &&
-          (!args->existing || exist(rec.path, args->type))) {
-        if (heap_insert(heap, score, matched_str) != 0) {
-          fprintf(stderr, "ERROR: Could not allocate heap memory.");
-          exit(EXIT_FAILURE);
+    search->n_scored++;
+    const double accuracy = matcher_score(search->matcher, rec->path);
+    if (accuracy > 0) {
+      indices[n_candidates] = index;
+      accuracies[n_candidates++] = accuracy;
+      search_insert(search, rec,
+                    frecency(rec->n_visits, search->now - rec->last_visit),
+                    accuracy);
+    }
+  }
+  if (m > 0) {
+    search_block(search, block, m, approximate);
+  }
+  // The candidates of a query replace the previous ones
+  Refinement *refinement = same ? base : new_refinement(db, search);
+  if (same) {
+    free(refinement->indices);
+    free(refinement->accuracies);
+  }
+  const int size = n_candidates > 0 ? n_candidates : 1;
+  refinement->indices = (int *)realloc(indices, size * sizeof(int));
+  refinement->accuracies =
+      exact ? (double *)realloc(accuracies, size * sizeof(double)) : NULL;
+  refinement->exact = exact;
+  refinement->n = n_candidates;
+  refinement->last_use = use;
+}
+
+// Answer the queries read on stdin, one per line, keeping the databases in
+// memory. A request is made of options and of the query (see parse_request),
+// optionally preceded by an identifier #<id> that is printed before the
+// results. The results are followed by an empty line.
+static void serve(Arguments *defaults) {
+  Database databases[MAX_DATABASES];
+  int n_databases = 0;
+  char *default_paths[2] = {NULL, NULL};
+  unsigned long n_requests = 0;
+  char *line = NULL;
+  size_t size = 0;
+  while (getline(&line, &size, stdin) != -1) {
+    char *request = line;
+    if (*request == '#') {
+      const size_t length = strcspn(request, " \t\n");
+      printf("%.*s\n", (int)length, request);
+      request += length;
+    }
+    Arguments args;
+    if (parse_request(defaults, request, &args) && args.n_results > 0) {
+      if (!args.file_path && args.type != TYPE_undefined) {
+        if (!default_paths[args.type]) {
+          default_paths[args.type] = get_default_database_path(args.type);
         }
+        args.file_path = default_paths[args.type];
+      }
+      Database *db = NULL;
+      if (!args.file_path) {
+        fprintf(stderr, "ERROR: no database's file or type specified.\n");
       } else {
-        free(matched_str);
+        db = get_database(databases, &n_databases, args.file_path);
+      }
+      if (db) {
+        Search search;
+        search_init(&search, &args);
+        if (*args.key == '\0') {
+          search_records(&search, db->records, db->n);
+          search.n_read += db->n;
+        } else {
+          search_refinement(&search, db, ++n_requests);
+        }
+        search_cold_tier(&search);
+        search_print(&search, NULL);
       }
     }
+    printf("\n");
+    fflush(stdout);
+  }
+  free(line);
+  for (int i = 0; i < n_databases; i++) {
+    free(databases[i].path);
+    close_database(databases + i);
+  }
+  free(default_paths[0]);
+  free(default_paths[1]);
+}
+
+// State of `jumper pick`: its databases are kept in memory, and searched as
+// by the server.
+typedef struct Picking {
+  Arguments *args;
+  Database databases[MAX_DATABASES];
+  int n_databases;
+  // Paths of the databases: the two types, or the file given by -f
+  const char *paths[2];
+  unsigned long n_requests;
+  PickResults results;
+  int n_records; // of the database being searched
+} Picking;
+
+// The running picker (for pick_progress)
+static Picking *picking_now = NULL;
+
+// Show the best results found so far by a search of the picker, once per
+// frame, and abandon it if keys are waiting.
+static bool pick_progress(Search *search) {
+  if (pick_interrupted()) {
+    return true;
+  }
+  if (!pick_frame_due()) {
+    return false;
+  }
+  const int n = heap_count(search->heap);
+  Ranked *ranked = (Ranked *)malloc((n + 1) * sizeof(Ranked));
+  char **paths = (char **)malloc((n + 1) * sizeof(char *));
+  char **highlighted = (char **)malloc((n + 1) * sizeof(char *));
+  if (ranked && paths && highlighted) {
+    for (int i = 0; i < n; i++) {
+      ranked[i].frecency = heap_value(search->heap, i);
+      ranked[i].index = i;
+    }
+    qsort(ranked, n, sizeof(Ranked), compare_ranked);
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+      paths[m] = heap_path(search->heap, ranked[i].index);
+      highlighted[m] = matcher_highlight(search->matcher, paths[m]);
+      m += (highlighted[m] != NULL);
+    }
+    const PickResults partial = {paths, highlighted, m,
+                                 picking_now->n_records};
+    pick_show(&partial);
+    for (int i = 0; i < m; i++) {
+      free(highlighted[i]);
+    }
   }
-  heap_print(heap, args->print_scores, args->relative_to, args->home_tilde,
-             prefix);
-  file_close(f);
-  free_filters(filters);
+  free(ranked);
+  free(paths);
+  free(highlighted);
+  return false;
+}
+
+static void free_pick_results(PickResults *results) {
+  for (int i = 0; i < results->n; i++) {
+    free(results->paths[i]);
+    free(results->highlighted[i]);
+  }
+  free(results->paths);
+  free(results->highlighted);
+  results->paths = NULL;
+  results->highlighted = NULL;
+  results->n = 0;
+}
+
+static bool pick_search(void *data, const char *query, int database,
+                        PickResults *results) {
+  Picking *picking = (Picking *)data;
+  Arguments args = *picking->args;
+  args.key = query;
+  args.file_path = picking->paths[database];
+  if (picking->paths[1]) {
+    args.type = (TYPE)database;
+  }
+  Database *db =
+      get_database(picking->databases, &picking->n_databases, args.file_path);
+  picking->n_records = db ? db->n : 0;
+  Search search;
+  search_init(&search, &args);
+  search.interrupted = pick_progress;
+  if (db && *query == '\0') {
+    search_records(&search, db->records, db->n);
+  } else if (db) {
+    search_refinement(&search, db, ++picking->n_requests);
+  }
+  if (search.abandoned) {
+    free_heap(search.heap);
+    search_free(&search);
+    return false;
+  }
+  search_cold_tier(&search);
+  free_pick_results(&picking->results);
+  const int n = heap_sort(search.heap);
+  const int size = n > 0 ? n : 1;
+  picking->results.paths = (char **)malloc(size * sizeof(char *));
+  picking->results.highlighted = (char **)malloc(size * sizeof(char *));
+  if (!picking->results.paths || !picking->results.highlighted) {
+    fprintf(stderr, "ERROR: Could not allocate memory for %d results.\n", n);
+    jumper_exit(EXIT_FAILURE);
+  }
+  // The paths of the heap are freed with it
+  for (int i = 0; i < n; i++) {
+    const char *path = heap_path(search.heap, i);
+    picking->results.paths[i] = strdup(path);
+    picking->results.highlighted[i] = matcher_highlight(search.matcher, path);
+    if (!picking->results.paths[i]) {
+      fprintf(stderr, "ERROR: Could not allocate memory for %d results.\n", n);
+      jumper_exit(EXIT_FAILURE);
+    }
+    picking->results.n = i + 1;
+  }
+  picking->results.n_records = picking->n_records;
+  free_heap(search.heap);
+  search_free(&search);
+  *results = picking->results;
+  return true;
+}
+
+// Pick a path interactively, and print it. Returns the exit status: failure
+// if the picker was cancelled.
+static int pick_path(Arguments *args) {
+  static const char *const type_labels[] = {"directories", "files"};
+  Picking picking = {.args = args, .n_databases = 0, .n_requests = 0};
+  picking.results = (PickResults){NULL, NULL, 0, 0};
+  char *other_path = NULL;
+  Picker picker = {.search = pick_search, .data = &picking};
+  if (args->default_file_path) {
+    // The databases of both types, the one of --type first
+    other_path = get_default_database_path(args->type == TYPE_directories
+                                               ? TYPE_files
+                                               : TYPE_directories);
+    picking.paths[args->type] = args->file_path;
+    picking.paths[1 - args->type] = other_path;
+    picker.labels = type_labels;
+    picker.n_databases = 2;
+    picker.database = args->type;
+  } else {
+    picking.paths[0] = args->file_path;
+    picking.paths[1] = NULL;
+    picker.labels = &args->file_path;
+    picker.n_databases = 1;
+    picker.database = 0;
+  }
+  bool failed;
+  picking_now = &picking;
+  char *path = pick(&picker, args->key, &failed);
+  picking_now = NULL;
+  if (failed) {
+    fprintf(stderr, "ERROR: Could not open the terminal.\n");
+  } else if (path) {
+    printf("%s\n", path);
+  }
+  const int status = path ? EXIT_SUCCESS : EXIT_FAILURE;
+  free(path);
+  free_pick_results(&picking.results);
+  for (int i = 0; i < picking.n_databases; i++) {
+    free(picking.databases[i].path);
+    close_database(picking.databases + i);
+  }
+  free(other_path);
+  return status;
 }
 
 static int count_filters(const char *path) {
@@ -313,7 +2991,10 @@ static int get_stats(const char *path, int *n_entries, double *total_visits) {
   }
   Record rec;
   while (next_line(f)) {
-    parse_record(f->line, &rec);
+    if (!parse_record(f->line, &rec)) {
+      report_invalid_record(f);
+      continue;
+    }
     (*n_entries)++;
     *total_visits += visits(rec.n_visits, now - rec.last_visit);
   }
@@ -321,6 +3002,29 @@ static int get_stats(const char *path, int *n_entries, double *total_visits) {
   return 0;
 }
 
+// Number of entries visited in the last hour, day, week and month, read from
+// the end of the journal.
+static void print_activity(const char *path) {
+  static const long long periods[] = {3600, 24 * 3600, 7 * 24 * 3600,
+                                      30 * 24 * 3600};
+  const long long now = (long long)time(NULL);
+  Recent recent;
+  if (!journal_since(path, now - periods[3], &recent)) {
+    return;
+  }
+  int counts[4] = {0, 0, 0, 0};
+  for (int i = 0; i < recent.n; i++) {
+    for (int k = 0; k < 4; k++) {
+      if (recent.records[i].last_visit >= now - periods[k]) {
+        counts[k]++;
+      }
+    }
+  }
+  printf("  Visited in the last hour: %d, day: %d, week: %d, month: %d\n",
+         counts[0], counts[1], counts[2], counts[3]);
+  recent_free(&recent);
+}
+
 static void status_file(const char *label, Arguments *args, bool color) {
   const char *header = label ? label : args->file_path;
 
@@ -341,6 +3045,13 @@ static void status_file(const char *label, Arguments *args, bool color) {
   }
 
   printf("  %d entries, %.1f total visits\n", n_entries, total_visits);
+  char *cold = sidecar_path(args->file_path, COLD_SUFFIX);
+  if (cold && get_stats(cold, &n_entries, &total_visits) == 0) {
+    printf("  %d archived entries, %.1f total visits\n", n_entries,
+           total_visits);
+  }
+  free(cold);
+  print_activity(args->file_path);
 
   if (args->n_results > 0) {
     printf("  Top %d entries", args->n_results);
@@ -356,21 +3067,62 @@ static void status(Arguments *args) {
   if (!args->file_path) {
     print_config(args, color);
 
-    args->file_path = get_default_database_path(TYPE_directories);
+    char *path = get_default_database_path(TYPE_directories);
+    args->file_path = path;
     printf("\n");
     status_file("DIRECTORIES", args, color);
+    free(path);
 
-    args->file_path = get_default_database_path(TYPE_files);
+    path = get_default_database_path(TYPE_files);
+    args->file_path = path;
     printf("\n");
     status_file("FILES", args, color);
+    free(path);
   } else {
     status_file(NULL, args, color);
   }
 }
 
-int main(int argc, char **argv) {
+static jmp_buf exit_point;
+static int exit_status;
+// Arguments of the running command, freed when it stops
+static Arguments *arguments = NULL;
+
+// Thread running jumper_main, the only one that can jump back to it
+static pthread_t main_thread;
+
+void jumper_exit(int status) {
+  if (!pthread_equal(pthread_self(), main_thread)) {
+    // A search of federated_lookup, which then stops the command. The status
+    // is shifted so that the thread's result is not NULL.
+    pthread_exit((void *)(intptr_t)(status + 1));
+  }
+  exit_status = status;
+  longjmp(exit_point, 1);
+}
+
+int jumper_main(int argc, char **argv) {
+  main_thread = pthread_self();
+  if (setjmp(exit_point) != 0) {
+    pick_restore();
+    // The resources may refer to the arguments
+    release_resources(true);
+    if (arguments) {
+      free_arguments(arguments);
+      arguments = NULL;
+    }
+    fflush(stdout);
+    return exit_status;
+  }
   Arguments *args = parse_arguments(argc, argv);
-  if (args->mode == MODE_search) {
+  arguments = args;
+  int exit_code = EXIT_SUCCESS;
+  if (args->mode == MODE_search && args->serve_stdin) {
+    serve(args);
+  } else if (args->mode == MODE_search &&
+             (args->all_types || args->n_extra_databases > 0)) {
+    federated_lookup(args);
+  } else if (args->mode == MODE_search) {
     lookup(args, NULL);
   } else if (args->mode == MODE_update) {
     update_database(args);
@@ -383,8 +3135,15 @@ int main(int argc, char **argv) {
       clean_database(args);
     }
   } else if (args->mode == MODE_shell) {
-    shell_setup(args->key, args->no_bind);
+    shell_setup(args->key, args->no_bind, args->cache);
+  } else if (args->mode == MODE_pick) {
+    exit_code = pick_path(args);
+  } else if (args->mode == MODE_merge) {
+    exit_code = merge_databases(args);
   }
-  free(args);
-  return EXIT_SUCCESS;
+  release_resources(false);
+  free_arguments(args);
+  arguments = NULL;
+  fflush(stdout);
+  return exit_code;
 }
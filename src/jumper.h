@@ -0,0 +1,12 @@
+#pragma once
+
+// Run jumper with the arguments of a command line, and return its exit status.
+// It does not exit the process, so that shells can also run it in their own
+// process, as a builtin (see builtin.c).
+int jumper_main(int argc, char **argv);
+
+// Stop jumper with status, which jumper_main then returns. The files that the
+// command holds are closed, its temporary files removed and its larger
+// allocations freed (see Resource in jumper.c): jumper_main can be called
+// again in the same process.
+_Noreturn void jumper_exit(int status);
@@ -0,0 +1,367 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "glob.h"
+#include "heap.h"
+#include "libjumper.h"
+#include "matching.h"
+#include "query.h"
+#include "record.h"
+#include "textfile.h"
+#include "visit.h"
+
+// The records of the database and of its cold tier, sorted by path so that the
+// matcher reuses its rows (see matcher_create). They are read again when one
+// of the files changes.
+struct JumperDatabase {
+  char *path;
+  char *cold_path;
+  char *filters_path;
+  Filters filters;
+  Record *records; // their paths point into lines
+  char **lines;
+  Signature *signatures; // of the records' paths
+  int n;
+  int size;
+  bool loaded;
+  unsigned int generation; // of the database when it was loaded
+  unsigned int cold_generation;
+  char error[256];
+  JumperWarningHandler warning_handler;
+  void *warning_data;
+};
+
+static int set_error(JumperDatabase *db, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(db->error, sizeof(db->error), format, args);
+  va_end(args);
+  return -1;
+}
+
+void jumper_default_options(JumperOptions *options) {
+  options->n_results = 50;
+  options->beta = 1.0;
+  options->syntax = JUMPER_SYNTAX_extended;
+  options->case_mode = JUMPER_CASE_semi_sensitive;
+  options->orderless = false;
+  options->existing = JUMPER_TYPE_any;
+  options->within = NULL;
+}
+
+JumperDatabase *jumper_open(const char *path, const char *filters) {
+  JumperDatabase *db = (JumperDatabase *)calloc(1, sizeof(JumperDatabase));
+  if (!db) {
+    return NULL;
+  }
+  db->path = strdup(path);
+  db->cold_path = sidecar_path(path, COLD_SUFFIX);
+  db->filters_path = filters ? strdup(filters) : NULL;
+  if (!db->path || !db->cold_path || (filters && !db->filters_path)) {
+    jumper_close(db);
+    return NULL;
+  }
+  filters_init(&db->filters, db->filters_path);
+  return db;
+}
+
+static void unload(JumperDatabase *db) {
+  for (int i = 0; i < db->n; i++) {
+    free(db->lines[i]);
+  }
+  db->n = 0;
+  db->loaded = false;
+}
+
+void jumper_close(JumperDatabase *db) {
+  if (!db) {
+    return;
+  }
+  unload(db);
+  free(db->records);
+  free(db->lines);
+  free(db->signatures);
+  filters_free(&db->filters);
+  free(db->path);
+  free(db->cold_path);
+  free(db->filters_path);
+  free(db);
+}
+
+const char *jumper_error(const JumperDatabase *db) { return db->error; }
+
+void jumper_set_warning_handler(JumperDatabase *db,
+                                JumperWarningHandler handler, void *data) {
+  db->warning_handler = handler;
+  db->warning_data = data;
+}
+
+static void forward_warning(const char *message, void *data) {
+  const JumperDatabase *db = (const JumperDatabase *)data;
+  if (db->warning_handler) {
+    db->warning_handler(message, db->warning_data);
+  }
+}
+
+// The warnings of the calls on db go to its handler rather than to stderr:
+// the calls install forward_warning, and restore the previous handler.
+static WarningHandler capture_warnings(JumperDatabase *db) {
+  return set_warning_handler((WarningHandler){forward_warning, db});
+}
+
+// Append the records of the file at path, which may not exist.
+static bool load_file(JumperDatabase *db, const char *path) {
+  Textfile *f = file_open(path);
+  if (!f) {
+    return true;
+  }
+  bool ok = true;
+  while (next_line(f)) {
+    if (db->n == db->size) {
+      const int size = db->size ? 2 * db->size : 1024;
+      Record *records = (Record *)realloc(db->records, size * sizeof(Record));
+      if (records) {
+        db->records = records;
+      }
+      char **lines = (char **)realloc(db->lines, size * sizeof(char *));
+      if (lines) {
+        db->lines = lines;
+      }
+      if (!records || !lines) {
+        ok = false;
+        break;
+      }
+      db->size = size;
+    }
+    char *line = strdup(f->line);
+    if (!line) {
+      ok = false;
+      break;
+    }
+    if (!parse_record(line, db->records + db->n)) {
+      report_invalid_record(f);
+      free(line);
+      continue;
+    }
+    db->lines[db->n++] = line;
+  }
+  file_close(f);
+  return ok;
+}
+
+static int compare_records(const void *a, const void *b) {
+  return strcmp(((const Record *)a)->path, ((const Record *)b)->path);
+}
+
+// Read the records again if the database or its cold tier has changed.
+static int refresh(JumperDatabase *db) {
+  const unsigned int generation = file_generation(db->path);
+  const unsigned int cold_generation = file_generation(db->cold_path);
+  if (db->loaded && generation == db->generation &&
+      cold_generation == db->cold_generation) {
+    return 0;
+  }
+  unload(db);
+  if (!load_file(db, db->path) || !load_file(db, db->cold_path)) {
+    unload(db);
+    return set_error(db, "could not load the records of %s", db->path);
+  }
+  // The lines keep the order of their records: the paths point into them
+  qsort(db->records, db->n, sizeof(Record), compare_records);
+  free(db->signatures);
+  db->signatures = (Signature *)malloc((db->n + 1) * sizeof(Signature));
+  if (!db->signatures) {
+    unload(db);
+    return set_error(db, "could not load the records of %s", db->path);
+  }
+  for (int i = 0; i < db->n; i++) {
+    db->signatures[i] = signature_of(db->records[i].path);
+  }
+  db->loaded = true;
+  db->generation = generation;
+  db->cold_generation = cold_generation;
+  return 0;
+}
+
+static void refresh_filters(JumperDatabase *db) {
+  if (filters_generation(db->filters_path) != db->filters.generation) {
+    filters_free(&db->filters);
+    filters_init(&db->filters, db->filters_path);
+  }
+}
+
+static bool exists(const char *path, JUMPER_TYPE type) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return false;
+  }
+  return (type == JUMPER_TYPE_files) ? S_ISREG(st.st_mode)
+                                     : S_ISDIR(st.st_mode);
+}
+
+// Subtree of the search: without its trailing slashes (to be freed)
+static char *subtree(const char *within) {
+  char *dir = realpath(within, NULL);
+  if (!dir) {
+    dir = strdup(within);
+  }
+  size_t len = dir ? strlen(dir) : 0;
+  while (len > 0 && dir[len - 1] == '/') {
+    dir[--len] = '\0';
+  }
+  return dir;
+}
+
+static bool in_subtree(const char *path, const char *dir, size_t len) {
+  return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// As the searches of `jumper find` (see search_record in jumper.c): most
+// records are ruled out by their signatures or their approximate frecencies,
+// and the matcher is told the accuracy that the others need to make it to the
+// results.
+// Returns false if a result could not be allocated.
+static bool rank(JumperDatabase *db, Queries queries, CASE_MODE case_mode,
+                 const JumperOptions *options, Heap *heap) {
+  Matcher *matcher = matcher_create(queries, case_mode);
+  CompiledQuery compiled = compile_queries(queries, case_mode);
+  enum { BLOCK = 256 };
+  double approximate[BLOCK];
+  const long long now = (long long)time(NULL);
+  const double beta = options->beta * 0.25;
+  const double max_match = beta > 0 ? beta * max_accuracy(queries) : 0;
+  char *within = options->within ? subtree(options->within) : NULL;
+  const size_t within_len = within ? strlen(within) : 0;
+  bool ok = true;
+  for (int start = 0; ok && start < db->n; start += BLOCK) {
+    const int size = (db->n - start < BLOCK) ? db->n - start : BLOCK;
+    approximate_frecencies(db->records + start, size, now, approximate);
+    for (int i = 0; i < size; i++) {
+      Record *rec = db->records + start + i;
+      if (!compiled_query_accepts_signature(&compiled,
+                                            db->signatures[start + i]) ||
+          (within && !in_subtree(rec->path, within, within_len)) ||
+          filters_match(&db->filters, rec) ||
+          !heap_accept(heap, approximate[i] + FRECENCY_ERROR + max_match)) {
+        continue;
+      }
+      const double fr = frecency(rec->n_visits, now - rec->last_visit);
+      if (!heap_accept(heap, fr + max_match)) {
+        continue;
+      }
+      double threshold = 0;
+      const double min_score = heap_threshold(heap);
+      if (beta > 0 && min_score > fr) {
+        threshold = (min_score - fr) / beta * (1 - 1e-9);
+      }
+      const double match = matcher_score_above(matcher, rec->path, threshold);
+      const double score = beta * match + fr;
+      if (match <= 0 || !heap_accept(heap, score) ||
+          (options->existing != JUMPER_TYPE_any &&
+           !exists(rec->path, options->existing))) {
+        continue;
+      }
+      char *path = strdup(rec->path);
+      if (!path || heap_insert(heap, score, path) != 0) {
+        free(path);
+        ok = false;
+        break;
+      }
+    }
+  }
+  free(within);
+  compiled_query_free(&compiled);
+  matcher_free(matcher);
+  return ok;
+}
+
+// jumper_query, once the warnings are captured
+static int query_records(JumperDatabase *db, const char *query,
+                         const JumperOptions *options, JumperResult **results) {
+  if (refresh(db) != 0) {
+    return -1;
+  }
+  refresh_filters(db);
+  Query standard_query;
+  Queries queries;
+  if (options->syntax == JUMPER_SYNTAX_extended) {
+    queries = make_extended_queries(query, options->orderless);
+    if (queries.n == 0) {
+      return set_error(db, "queries can not have more than %d tokens",
+                       MAX_TOKENS);
+    }
+  } else {
+    standard_query =
+        make_standard_query(query, options->syntax == JUMPER_SYNTAX_fuzzy);
+    queries.queries = &standard_query;
+    queries.n = 1;
+  }
+  const CASE_MODE case_mode =
+      (options->case_mode == JUMPER_CASE_sensitive)     ? CASE_MODE_sensitive
+      : (options->case_mode == JUMPER_CASE_insensitive) ? CASE_MODE_insensitive
+                                                        : CASE_MODE_semi_sensitive;
+  Heap *heap = heap_create(options->n_results);
+  int n = -1;
+  if (heap && rank(db, queries, case_mode, options, heap)) {
+    n = heap_sort(heap);
+    *results = (JumperResult *)malloc((n > 0 ? n : 1) * sizeof(JumperResult));
+  }
+  for (int i = 0; *results && i < n; i++) {
+    (*results)[i].path = strdup(heap_path(heap, i));
+    (*results)[i].score = heap_value(heap, i);
+    if (!(*results)[i].path) {
+      jumper_free_results(*results, i);
+      *results = NULL;
+    }
+  }
+  if (!*results) {
+    n = set_error(db, "could not allocate the results");
+  }
+  if (heap) {
+    heap_free(heap);
+  }
+  free_queries(queries);
+  if (options->syntax == JUMPER_SYNTAX_extended) {
+    free(queries.queries);
+  }
+  return n;
+}
+
+int jumper_query(JumperDatabase *db, const char *query,
+                 const JumperOptions *options, JumperResult **results) {
+  *results = NULL;
+  if (options->n_results <= 0) {
+    return 0;
+  }
+  const WarningHandler previous = capture_warnings(db);
+  const int n = query_records(db, query, options, results);
+  set_warning_handler(previous);
+  return n;
+}
+
+void jumper_free_results(JumperResult *results, int n) {
+  for (int i = 0; i < n; i++) {
+    free(results[i].path);
+  }
+  free(results);
+}
+
+int jumper_record_visit(JumperDatabase *db, const char *path, double weight) {
+  if (*path == '\0' || strchr(path, '|') || strchr(path, '\n')) {
+    return set_error(db, "invalid path: %s", path);
+  }
+  refresh_filters(db);
+  const WarningHandler previous = capture_warnings(db);
+  const Visit visit = record_visit(db->path, path, weight,
+                                   (long long)time(NULL), &db->filters);
+  set_warning_handler(previous);
+  if (visit.outcome == VISIT_failed) {
+    return set_error(db, "could not update the database %s", db->path);
+  }
+  return 0;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+// libjumper: the searches and the updates of jumper's databases, for programs
+// that rank files in their own process (editors' plugins, through an FFI)
+// rather than by running `jumper find`. Built by `make libjumper.a
+// libjumper.so`.
+//
+// The functions never exit: they report failures by their return values, and
+// jumper_error then tells what went wrong. Nothing is printed: the warnings
+// about the files' contents go to the handler of jumper_set_warning_handler.
+// There is no global state: handles can be used from different threads, each
+// handle by one thread at a time. Only running out of memory in the middle of
+// a match aborts.
+
+#include <stdbool.h>
+
+#define JUMPER_API __attribute__((visibility("default")))
+
+typedef enum JUMPER_SYNTAX {
+  JUMPER_SYNTAX_extended,
+  JUMPER_SYNTAX_fuzzy,
+  JUMPER_SYNTAX_exact,
+} JUMPER_SYNTAX;
+
+typedef enum JUMPER_CASE {
+  JUMPER_CASE_semi_sensitive, // sensitive only if the query has uppercase
+  JUMPER_CASE_sensitive,
+  JUMPER_CASE_insensitive,
+} JUMPER_CASE;
+
+typedef enum JUMPER_TYPE {
+  JUMPER_TYPE_any,
+  JUMPER_TYPE_files,
+  JUMPER_TYPE_directories,
+} JUMPER_TYPE;
+
+// Options of a query, as the ones of `jumper find`
+typedef struct JumperOptions {
+  int n_results;
+  double beta; // weight of the match against the frecency
+  JUMPER_SYNTAX syntax;
+  JUMPER_CASE case_mode;
+  bool orderless;
+  // Only the paths that exist as files or directories (no check for any)
+  JUMPER_TYPE existing;
+  const char *within; // only search this directory's subtree (NULL for all)
+} JumperOptions;
+
+typedef struct JumperResult {
+  char *path;
+  double score;
+} JumperResult;
+
+typedef struct JumperDatabase JumperDatabase;
+
+// Receives the warnings about the contents of the files of a database, such as
+// its malformed lines (which are skipped) or its invalid filters (ignored).
+typedef void (*JumperWarningHandler)(const char *message, void *data);
+
+// The options of `jumper find`, with 50 results.
+JUMPER_API void jumper_default_options(JumperOptions *options);
+
+// Handle of the database at path (created at the first visit if it does not
+// exist), whose records matching the filters of the file filters are left out
+// (NULL for no filters). Returns NULL if it can not be allocated.
+JUMPER_API JumperDatabase *jumper_open(const char *path, const char *filters);
+
+JUMPER_API void jumper_close(JumperDatabase *db);
+
+// Message of the last failure on db.
+JUMPER_API const char *jumper_error(const JumperDatabase *db);
+
+// Call handler(message, data) for each warning of the following calls on db
+// (NULL to ignore them, as by default).
+JUMPER_API void jumper_set_warning_handler(JumperDatabase *db,
+                                           JumperWarningHandler handler,
+                                           void *data);
+
+// Best matches of query, by decreasing score, in *results (to be freed with
+// jumper_free_results). Returns their number, or -1 on failure. The records
+// are kept in memory between the queries, and read again when the database
+// changes.
+JUMPER_API int jumper_query(JumperDatabase *db, const char *query,
+                            const JumperOptions *options,
+                            JumperResult **results);
+
+JUMPER_API void jumper_free_results(JumperResult *results, int n);
+
+// Record a visit of path, as `jumper update -w weight path`: paths matching
+// the filters are not recorded. The database is not trimmed to
+// $__JUMPER_MAX_ENTRIES: the next `jumper update` or `jumper clean` does it.
+// Returns 0, or -1 on failure.
+JUMPER_API int jumper_record_visit(JumperDatabase *db, const char *path,
+                                   double weight);
@@ -0,0 +1,3 @@
+#include "jumper.h"
+
+int main(int argc, char **argv) { return jumper_main(argc, argv); }
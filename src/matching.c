@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // memmem
+
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -22,17 +24,68 @@ typedef struct Breaks {
   int nbreaks;
 } Breaks;
 
-typedef struct MatchingData {
-  const char *string;
-  const char *query;
-  int n;
-  int m;
+// Characters of a query that have to be matched consecutively
+typedef struct Segment {
+  int start; // in the query
+  int length;
+  bool literal; // its characters can only be matched by themselves
+  int max_score; // upper bound on the score of the segment and the next ones
+  bool first[256]; // characters that match its first one
+} Segment;
+
+// Match of a segment, that ends at row
+typedef struct Occurrence {
+  int row;
+  int score;
+} Occurrence;
+
+typedef struct QueryState QueryState;
+
+// See score_query
+typedef int (*ScoreFunction)(Matcher *matcher, QueryState *state,
+                             double threshold);
+
+// DP rows of a query, for the last string it was matched against
+struct QueryState {
+  Query query;
+  ScoreFunction score;
+  int m;           // query length + 1
+  Scores *rows;    // scores of (i, j) are rows[i * m + j]
+  int *reach;      // reach[i]: last column of row i that is not -1
+  // latest[k]: last position of the string where the query character k can be
+  // matched, the next ones being matched after it
+  int *latest;
+  int capacity;    // number of rows allocated
+  char *string;    // string whose rows are stored
+  int n_valid;     // rows [0, n_valid) are valid for string
   int imax;
-  int *bonus;
-  bool *gap_allowed;
-  Scores *matrix;
+  // Queries made of long segments (exact tokens, anchors, exact syntax) are
+  // matched segment by segment instead (see score_segments), segments being
+  // NULL for the others. occurrences[k * capacity + i] is then the i-th match
+  // of segment k, out of n_occurrences[k].
+  Segment *segments;
+  int n_segments;
+  Occurrence *occurrences;
+  int *n_occurrences;
+};
+
+struct Matcher {
+  QueryState *states;
+  int n_queries;
+  int best; // query of the best match of the last string, -1 if none
   CASE_MODE case_mode;
-} MatchingData;
+  const char *string; // string being matched
+  int n;              // its length + 1
+  int *bonus;
+  bool bonus_valid; // bonus has been computed for string
+  // Score of a query character matching a character, before its bonus (0 if
+  // no query character matches it)
+  int char_score[256];
+  // best_char[i]: largest score of a query character matched at i or after
+  int *best_char;
+  bool best_char_valid;
+  int capacity; // size of bonus and best_char
+};
 
 // Bonuses
 static const int match_bonus = 20;
@@ -48,18 +101,40 @@ static const int gap_penalty = 1;
 // For orderless queries
 static const double alignment_scaling = 80.0;
 
+// Largest bonus that a single character can get
+static inline int max_char_bonus(void) {
+  return max(camelcase_bonus, max(post_separator_bonus, post_slash_bonus)) +
+         end_of_path_bonus;
+}
+
+// jumper runs in the C locale: only ASCII letters have a case. Unlike tolower,
+// this can be inlined in the matcher's loops.
+static inline char lower(char c) {
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
 static inline bool match_char(char a, char b, CASE_MODE case_mode) {
-  if (tolower(a) != tolower(b)) {
-    return false;
+  switch (case_mode) {
+  case CASE_MODE_sensitive:
+    return a == b;
+  case CASE_MODE_insensitive:
+    return lower(a) == lower(b);
+  default:
+    // Lowercase characters match both cases
+    return a == b || (b >= 'a' && b <= 'z' && lower(a) == b);
   }
-  if (case_mode == CASE_MODE_insensitive) {
+}
+
+// Whether c can only be matched by itself
+static bool match_only_itself(char c, CASE_MODE case_mode) {
+  switch (case_mode) {
+  case CASE_MODE_sensitive:
     return true;
+  case CASE_MODE_insensitive:
+    return !isalpha(c);
+  default:
+    return !islower(c);
   }
-  if (case_mode == CASE_MODE_sensitive) {
-    return (a == b);
-  }
-  // Default, semi_sensitive mode
-  return islower(b) || (a == b);
 }
 
 static inline bool is_separator(char c) {
@@ -67,12 +142,31 @@ static inline bool is_separator(char c) {
           c == '\\' || c == ' ');
 }
 
-static int *matching_bonus(const char *string, int n) {
-  int *bonus = (int *)malloc(n * sizeof(int));
-  if (!bonus) {
-    fprintf(stderr, "ERROR: failed to allocate %d bytes.\n", n);
-    exit(EXIT_FAILURE);
+// The matcher has no way to report a failure in the middle of a match, and it
+// is also run by libjumper, which must not exit its host: it aborts when it
+// runs out of memory.
+static void *allocate(size_t size) {
+  void *p = malloc(size);
+  if (!p) {
+    fprintf(stderr, "ERROR: failed to allocate %zu bytes.\n", size);
+    abort();
+  }
+  return p;
+}
+
+static void *reallocate(void *p, size_t size) {
+  p = realloc(p, size);
+  if (!p) {
+    fprintf(stderr, "ERROR: failed to allocate %zu bytes.\n", size);
+    abort();
   }
+  return p;
+}
+
+// The bonus of a character only depends on the string up to this character,
+// except for the end_of_path_bonus that is given after the last slash: the
+// bonuses before a slash are the same for all the paths sharing this prefix.
+static void matching_bonus(const char *string, int n, int *bonus) {
   int last_slash = -1;
   bool prev_is_sep = true;
   for (int i = 0; i < n; i++) {
@@ -99,14 +193,47 @@ static int *matching_bonus(const char *string, int n) {
       bonus[i] += end_of_path_bonus;
     }
   }
-  return bonus;
 }
 
-static int match_score(MatchingData *data, int i, int j) {
-  const char a = data->query[j - 1];
-  char b = data->string[i - 1];
-  if (match_char(b, a, data->case_mode)) {
-    int bonus = data->bonus[i - 1];
+static const int *get_bonus(Matcher *matcher) {
+  if (!matcher->bonus_valid) {
+    if (matcher->n > matcher->capacity) {
+      matcher->capacity = 2 * matcher->n;
+      matcher->bonus = (int *)reallocate(matcher->bonus,
+                                         matcher->capacity * sizeof(int));
+      matcher->best_char = (int *)reallocate(
+          matcher->best_char, matcher->capacity * sizeof(int));
+    }
+    matching_bonus(matcher->string, matcher->n - 1, matcher->bonus);
+    matcher->bonus_valid = true;
+    matcher->best_char_valid = false;
+  }
+  return matcher->bonus;
+}
+
+// Upper bounds on the score of a query character (see match_score), except
+// for the bonus of the first character.
+static const int *get_best_char(Matcher *matcher) {
+  const int *bonus = get_bonus(matcher);
+  if (!matcher->best_char_valid) {
+    const int n = matcher->n;
+    int *best_char = matcher->best_char;
+    best_char[n - 1] = 0;
+    for (int i = n - 2; i >= 0; i--) {
+      const int score =
+          matcher->char_score[(unsigned char)matcher->string[i]];
+      best_char[i] = max(score > 0 ? score + bonus[i] : 0, best_char[i + 1]);
+    }
+    matcher->best_char_valid = true;
+  }
+  return matcher->best_char;
+}
+
+// Score of the query character a, of column j, matched with the string
+// character b whose bonus is given. -1 if they do not match.
+static inline int match_score(char a, int j, char b, int bonus,
+                              CASE_MODE case_mode) {
+  if (match_char(b, a, case_mode)) {
     int score = match_bonus + bonus;
     if (isupper(b) && a == b) {
       score += uppercase_bonus;
@@ -119,75 +246,96 @@ static int match_score(MatchingData *data, int i, int j) {
   return -1;
 }
 
-static MatchingData *make_data(const char *string, Query query,
-                               CASE_MODE case_mode) {
-  const int n = strlen(string) + 1;
-  const int m = query.length + 1;
-  const int h = n - m + 2;
-  Scores *matrix = (Scores *)malloc(h * m * sizeof(struct Scores));
-  if (!matrix) {
-    fprintf(stderr, "ERROR: failed to allocate %lu bytes.\n",
-            h * m * sizeof(struct Scores));
-    exit(EXIT_FAILURE);
-  }
-  for (int i = 0; i < h; i++) {
-    matrix[i * m].match = 0;
-    matrix[i * m].gap = 0;
-    for (int j = 1; j < m; j++) {
-      matrix[i * m + j].match = -1;
-      matrix[i * m + j].gap = -1;
-    }
-  }
-
-  MatchingData *data = (MatchingData *)malloc(sizeof(MatchingData));
-  data->n = n;
-  data->m = m;
-  data->string = string;
-  data->query = query.query;
-  data->gap_allowed = query.gap_allowed;
-  data->matrix = matrix;
-  data->bonus = matching_bonus(string, n - 1);
-  data->case_mode = case_mode;
-  data->imax = 0;
-  return data;
-}
-
-static inline Scores *get_scores(MatchingData *data, int i, int j) {
-  return data->matrix + (i - j + 1) * data->m + j;
-}
-
-static void free_matching_data(MatchingData *data) {
-  free(data->matrix);
-  free(data->bonus);
-  free(data);
+static inline Scores *get_scores(const QueryState *state, int i, int j) {
+  return state->rows + i * state->m + j;
 }
 
-static Scores *compute_scores(MatchingData *data, int i, int j) {
-  Scores *scores = get_scores(data, i, j);
-  Scores *top = get_scores(data, i - 1, j);
-  Scores *top_left = get_scores(data, i - 1, j - 1);
-  if (!data->gap_allowed[j]) {
-    scores->gap = -1;
-  } else {
-    int g = max(top->gap - gap_penalty, top->match - first_gap_penalty);
-    scores->gap = max(g, -1);
+// Row i of the DP. Only the columns up to one past the reach of the previous
+// row can be reached: the next column is set to -1 and the others are left
+// untouched.
+// The columns before jmin can not lead to a match anymore: they are skipped,
+// and the one before them is set to -1.
+// Returns an upper bound on the score of the matches that go through row i,
+// given that the characters after i score at most best_char each.
+// fuzzy: all the columns allow gaps.
+static inline __attribute__((always_inline)) int
+compute_row(const Matcher *matcher, QueryState *state, int i, int jmin,
+            int best_char, CASE_MODE case_mode, bool fuzzy) {
+  const int m = state->m;
+  const bool *gap_allowed = state->query.gap_allowed;
+  const char *query = state->query.query;
+  // Loaded once: the stores to the rows could alias them
+  const char c = matcher->string[i - 1];
+  const int bonus = matcher->bonus[i - 1];
+  Scores *row = get_scores(state, i, 0);
+  const Scores *prev = get_scores(state, i - 1, 0);
+  row[0].match = 0;
+  row[0].gap = 0;
+  if (jmin > 0) {
+    row[jmin - 1].match = -1;
+    row[jmin - 1].gap = -1;
+  }
+  int reach = 0;
+  // Largest score of the cells minus best_char for each column. Matches can
+  // only start from the first column if there is no anchor, and then get an
+  // extra bonus.
+  bool reachable = gap_allowed[0] && jmin == 0;
+  int bound = 2;
+  const int jmax = (state->reach[i - 1] + 1 < m - 1) ? state->reach[i - 1] + 1
+                                                     : m - 1;
+  for (int j = (jmin > 1) ? jmin : 1; j <= jmax; j++) {
+    Scores *scores = row + j;
+    const Scores *top = prev + j;
+    const Scores *top_left = prev + j - 1;
+    if (!fuzzy && !gap_allowed[j]) {
+      scores->gap = -1;
+    } else {
+      int g = max(top->gap - gap_penalty, top->match - first_gap_penalty);
+      scores->gap = max(g, -1);
 
-    if ((top->gap != -1 || top->match != -1) && scores->gap == -1) {
-      scores->gap = 0;
+      if ((top->gap != -1 || top->match != -1) && scores->gap == -1) {
+        scores->gap = 0;
+      }
+    }
+    scores->match = -1;
+    const int mscore = match_score(query[j - 1], j, c, bonus, case_mode);
+    if (mscore > 0 && (j > 1 || i == 1 || gap_allowed[0])) {
+      const int max_score = max(top_left->gap, top_left->match);
+      if (max_score >= 0) {
+        scores->match = max_score + mscore;
+      }
+    }
+    if (scores->match != -1 || scores->gap != -1) {
+      reach = j;
+      const int b = max(scores->match, scores->gap) - j * best_char;
+      bound = reachable ? max(bound, b) : b;
+      reachable = true;
     }
   }
-  const int mscore = match_score(data, i, j);
-  if (mscore > 0 && (j > 1 || i == 1 || data->gap_allowed[0])) {
-    const int max_score = max(top_left->gap, top_left->match);
-    if (max_score >= 0) {
-      scores->match = max_score + mscore;
+  if (jmax + 1 < m) {
+    row[jmax + 1].match = -1;
+    row[jmax + 1].gap = -1;
+  }
+  state->reach[i] = reach;
+  return reachable ? bound + (m - 1) * best_char : -1;
+}
+
+// Row i only depends on the characters before i and on their bonuses, so the
+// rows up to the last slash shared with the previous string can be kept.
+static int first_new_row(const QueryState *state, const char *string) {
+  int last_slash = -1;
+  for (int k = 0; k + 1 < state->n_valid && string[k] == state->string[k] &&
+                  string[k] != 0;
+       k++) {
+    if (string[k] == '/') {
+      last_slash = k;
     }
   }
-  return scores;
+  return last_slash + 2;
 }
 
-static bool parent(MatchingData *data, int i, int j, bool skip) {
-  Scores *scores = get_scores(data, i, j);
+static bool parent(const QueryState *state, int i, int j, bool skip) {
+  Scores *scores = get_scores(state, i, j);
   if (skip) {
     return (scores->match - first_gap_penalty <= scores->gap - gap_penalty);
   } else {
@@ -195,18 +343,14 @@ static bool parent(MatchingData *data, int i, int j, bool skip) {
   }
 }
 
-static Breaks extract_breaks(MatchingData *data) {
-  int i = data->imax, j = data->m - 1;
-  int *br = (int *)malloc(2 * data->m * sizeof(int));
-  if (!br) {
-    fprintf(stderr, "ERROR: failed to allocate %d bytes.\n", 2 * data->m);
-    exit(EXIT_FAILURE);
-  }
+static Breaks extract_breaks(const QueryState *state) {
+  int i = state->imax, j = state->m - 1;
+  int *br = (int *)allocate(2 * state->m * sizeof(int));
   Breaks b = {.nbreaks = 0, .breaks = br};
   bool is_matched = true, skip = false;
   b.breaks[b.nbreaks++] = i - 1;
   while (j > 0) {
-    skip = parent(data, i, j, skip);
+    skip = parent(state, i, j, skip);
     i--;
     if (skip) {
       if (is_matched) {
@@ -225,21 +369,17 @@ static Breaks extract_breaks(MatchingData *data) {
   return b;
 }
 
-static char *add_ansi_colors(MatchingData *data, Breaks b) {
-  const int new_len = data->n + (b.nbreaks / 2) * 9 + 1;
-  char *new_string = (char *)malloc(new_len * sizeof(char));
-  if (!new_string) {
-    fprintf(stderr, "ERROR: failed to allocate %d bytes.\n", new_len);
-    exit(EXIT_FAILURE);
-  }
+static char *add_ansi_colors(const char *string, int n, Breaks b) {
+  const int new_len = n + (b.nbreaks / 2) * 9 + 1;
+  char *new_string = (char *)allocate(new_len * sizeof(char));
   int k = 0;
   if (b.nbreaks > 0 && b.breaks[b.nbreaks - 1] == -1) {
     strncpy(new_string + k, COLOR_GREEN, 5);
     k += 5;
     b.nbreaks--;
   }
-  for (int sk = 0; sk < data->n; sk++) {
-    new_string[k] = data->string[sk];
+  for (int sk = 0; sk < n; sk++) {
+    new_string[k] = string[sk];
     k++;
     if (b.nbreaks > 0 && b.breaks[b.nbreaks - 1] == sk) {
       if (b.nbreaks % 2 == 0) {
@@ -257,83 +397,553 @@ static char *add_ansi_colors(MatchingData *data, Breaks b) {
   return new_string;
 }
 
-static bool quick_match(const char *string, Query query, CASE_MODE case_mode) {
-  const char *t = string;
-  const char *q = query.query;
-  while (*t != 0 && *q != 0) {
-    if (match_char(*t, *q, case_mode)) {
-      q++;
+// Match the query greedily from the end of the string, to fill
+// state->latest. Returns false if the query does not match.
+static inline bool match_latest(const Matcher *matcher, QueryState *state,
+                                CASE_MODE case_mode) {
+  int p = matcher->n - 2;
+  for (int k = state->m - 2; k >= 0; k--) {
+    const char c = state->query.query[k];
+    while (p >= 0 && !match_char(matcher->string[p], c, case_mode)) {
+      p--;
     }
-    t++;
+    if (p < 0) {
+      return false;
+    }
+    state->latest[k] = p--;
   }
-  return (*q == 0);
+  return true;
 }
 
-static int get_max_score(MatchingData *data) {
+// Best match among the rows [0, n_rows)
+static int get_max_score(const Matcher *matcher, QueryState *state,
+                         int n_rows) {
   int score = -1;
-  const int n = data->n;
-  const int m = data->m;
-  Scores *scores;
-  for (int ii = 1; ii < n - m + 2; ii++) {
-    int i = ii + m - 2;
-    scores = get_scores(data, i, m - 1);
-    if (scores->match >= score && (data->gap_allowed[m - 1] || i == n - 1)) {
-      data->imax = i;
+  const int n = matcher->n;
+  const int m = state->m;
+  for (int i = m - 1; i < n_rows; i++) {
+    if (state->reach[i] != m - 1) {
+      continue;
+    }
+    const Scores *scores = get_scores(state, i, m - 1);
+    if (scores->match >= score &&
+        (state->query.gap_allowed[m - 1] || i == n - 1)) {
+      state->imax = i;
       score = scores->match;
     }
   }
   return score;
 }
 
-double match_accuracy(const char *string, Queries queries, bool colors,
-                      char **output, CASE_MODE case_mode) {
+// Split the query where gaps are allowed. Returns NULL if the segments are
+// too short for score_segments to be faster than the DP.
+static Segment *make_segments(Query query, CASE_MODE case_mode, int *n) {
+  *n = 0;
+  for (int j = 0; j < query.length; j++) {
+    *n += (j == 0 || query.gap_allowed[j]);
+  }
+  if (*n == 0 || (*n > 1 && 2 * *n > query.length)) {
+    return NULL;
+  }
+  Segment *segments = (Segment *)allocate(*n * sizeof(Segment));
+  int k = -1;
+  for (int j = 0; j < query.length; j++) {
+    if (j == 0 || query.gap_allowed[j]) {
+      k++;
+      segments[k].start = j;
+      segments[k].length = 0;
+      segments[k].literal = true;
+      for (int c = 0; c < 256; c++) {
+        segments[k].first[c] = match_char((char)c, query.query[j], case_mode);
+      }
+    }
+    segments[k].length++;
+    segments[k].literal &= match_only_itself(query.query[j], case_mode);
+  }
+  int max_score = 0;
+  for (int j = query.length - 1; j >= 0; j--) {
+    max_score += match_bonus + max_char_bonus() +
+                 (isupper(query.query[j]) ? uppercase_bonus : 0) +
+                 (j == 0 ? 2 : 0);
+    if (j == segments[k].start) {
+      segments[k--].max_score = max_score;
+    }
+  }
+  return segments;
+}
 
-  double best_score = 0.0;
-  MatchingData *best_matching_data = NULL;
-  for (int iquery = 0; iquery < queries.n; iquery++) {
-    Query query = queries.queries[iquery];
-    if (*query.query == 0) {
-      *output = strdup(string);
-      return 1;
-    }
-    if (quick_match(string, query, case_mode)) {
-      MatchingData *data = make_data(string, query, case_mode);
-      const int n = data->n;
-      const int m = data->m;
-      Scores *scores;
-      int j, jmax = 0; // jmax: max accessible column
-      for (int ii = 1; ii < n - m + 2; ii++) {
-        for (j = 1; j < m; j++) {
-          scores = compute_scores(data, ii + j - 1, j);
-          if (scores->match == -1 && scores->gap == -1 && j >= jmax) {
-            break;
-          }
+// First position in [start, last] where segment matches the string
+static const char *find_segment(const Matcher *matcher, const QueryState *state,
+                                const Segment *segment, const char *start,
+                                const char *last) {
+  const char *query = state->query.query + segment->start;
+  if (start > last) {
+    return NULL;
+  }
+  if (segment->literal) {
+    return (const char *)memmem(start, last - start + segment->length, query,
+                                segment->length);
+  }
+  for (const char *p = start; p <= last; p++) {
+    if (!segment->first[(unsigned char)*p]) {
+      continue;
+    }
+    int t = 1;
+    while (t < segment->length &&
+           match_char(p[t], query[t], matcher->case_mode)) {
+      t++;
+    }
+    if (t == segment->length) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+// Score of the gap state at row i of the column that ends a segment, given
+// the largest score + gap_penalty * row among its matches before row i.
+static inline int gap_score(int best, int i) {
+  return max(best - first_gap_penalty - gap_penalty * (i - 1), 0);
+}
+
+// Same as score_query. The string is searched for the occurrences of each
+// segment, which are scored as in the DP: only the matches that end the
+// segments are kept, and the gaps between them are computed in closed form (a
+// gap's score is never below 0). The occurrences that can not lead to a match
+// above threshold are dropped.
+static int score_segments(Matcher *matcher, QueryState *state,
+                          double threshold) {
+  const double alignment = alignment_scaling * state->query.alignment;
+  const bool prune = threshold > 0;
+  const int n = matcher->n;
+  if (n > state->capacity) {
+    state->capacity = 2 * n;
+    state->occurrences = (Occurrence *)reallocate(
+        state->occurrences,
+        state->capacity * state->n_segments * sizeof(Occurrence));
+  }
+  const bool *gap_allowed = state->query.gap_allowed;
+  for (int k = 0; k < state->n_segments; k++) {
+    const Segment *segment = state->segments + k;
+    Occurrence *occurrences = state->occurrences + k * state->capacity;
+    const Occurrence *prev = occurrences - state->capacity;
+    const int n_prev = (k > 0) ? state->n_occurrences[k - 1] : 0;
+    int count = 0;
+    int iprev = 0;
+    int best_prev = -1;
+    // Anchored segments are only compared at the start or end of the string
+    const char *first = matcher->string;
+    const char *last = matcher->string + n - 1 - segment->length;
+    if (k == 0 && !gap_allowed[0] && last > first) {
+      last = first;
+    }
+    if (k + 1 == state->n_segments && !gap_allowed[state->m - 1]) {
+      first = last;
+    }
+    const char *p = first;
+    while ((p = find_segment(matcher, state, segment, p, last)) != NULL) {
+      const int s = p - matcher->string;
+      p++;
+      int score = 0;
+      if (k > 0) {
+        // Best cell of row s in the column that ends the previous segment
+        while (iprev < n_prev && prev[iprev].row < s) {
+          best_prev = max(best_prev,
+                          prev[iprev].score + gap_penalty * prev[iprev].row);
+          iprev++;
         }
-        jmax = j - 1;
+        score = (iprev < n_prev && prev[iprev].row == s) ? prev[iprev].score
+                                                          : -1;
+        if (best_prev >= 0) {
+          score = max(score, gap_score(best_prev, s));
+        }
+      }
+      if (score < 0 ||
+          (prune && score + segment->max_score + alignment <= threshold)) {
+        continue;
       }
-      const int score = get_max_score(data);
-      const double total_score = score + alignment_scaling * query.alignment;
-      if ((score > -1) && (total_score > best_score)) {
-        best_score = total_score;
-        if (best_matching_data != NULL) {
-          free_matching_data(best_matching_data);
+      get_bonus(matcher);
+      for (int t = 0; t < segment->length; t++) {
+        const int j = segment->start + t;
+        score += match_score(state->query.query[j], j + 1,
+                             matcher->string[s + t], matcher->bonus[s + t],
+                             matcher->case_mode);
+      }
+      const int next_score =
+          (k + 1 < state->n_segments) ? segment[1].max_score : 0;
+      if (prune && score + next_score + alignment <= threshold) {
+        continue;
+      }
+      occurrences[count].row = s + segment->length;
+      occurrences[count].score = score;
+      count++;
+    }
+    state->n_occurrences[k] = count;
+    if (count == 0) {
+      return -1;
+    }
+  }
+  int score = -1;
+  const int k = state->n_segments - 1;
+  const Occurrence *occurrences = state->occurrences + k * state->capacity;
+  for (int i = 0; i < state->n_occurrences[k]; i++) {
+    if (occurrences[i].score >= score &&
+        (gap_allowed[state->m - 1] || occurrences[i].row == n - 1)) {
+      state->imax = occurrences[i].row;
+      score = occurrences[i].score;
+    }
+  }
+  return score;
+}
+
+// Scores of the cell of row i in the column that ends segment k
+static Scores segment_scores(const QueryState *state, int k, int i) {
+  const Occurrence *occurrences = state->occurrences + k * state->capacity;
+  Scores scores = {.match = -1, .gap = -1};
+  int best = -1;
+  for (int r = 0; r < state->n_occurrences[k] && occurrences[r].row <= i;
+       r++) {
+    if (occurrences[r].row == i) {
+      scores.match = occurrences[r].score;
+    } else {
+      best = max(best, occurrences[r].score + gap_penalty * occurrences[r].row);
+    }
+  }
+  if (best >= 0) {
+    scores.gap = gap_score(best, i);
+  }
+  return scores;
+}
+
+// Same as extract_breaks, for the queries matched by score_segments
+static Breaks extract_segment_breaks(const QueryState *state) {
+  int *br = (int *)allocate(2 * state->m * sizeof(int));
+  Breaks b = {.nbreaks = 0, .breaks = br};
+  int i = state->imax;
+  b.breaks[b.nbreaks++] = i - 1;
+  for (int k = state->n_segments - 1; k > 0; k--) {
+    // Row where the segment starts, and where the previous one ends
+    const int start = i - state->segments[k].length;
+    i = start;
+    Scores scores = segment_scores(state, k - 1, i);
+    bool skip = scores.match < scores.gap;
+    while (skip) {
+      i--;
+      scores = segment_scores(state, k - 1, i);
+      skip = (scores.match - first_gap_penalty <= scores.gap - gap_penalty);
+    }
+    if (i < start) {
+      b.breaks[b.nbreaks++] = start - 1;
+      b.breaks[b.nbreaks++] = i - 1;
+    }
+  }
+  b.breaks[b.nbreaks++] = i - state->segments[0].length - 1;
+  return b;
+}
+
+// Score of the best match of a query in the current string, -1 if none.
+// Matches whose total score (with the alignment of the query) is not above
+// threshold are not needed: the DP stops, returning -1, as soon as no such
+// match is possible. It also stops once no row can improve on the best match.
+// The DP is restricted to the cells from which the rest of the query can
+// still be matched (see match_latest): this does not change the result, but
+// the rows after latest[0] then depend on the end of the string and can not be
+// reused for the next one.
+// This is the inner loop of the matcher: it is instantiated below for each
+// case mode, and for fuzzy queries (see compute_row).
+static inline __attribute__((always_inline)) int
+score_query(Matcher *matcher, QueryState *state, double threshold,
+            CASE_MODE case_mode, bool fuzzy) {
+  if (!match_latest(matcher, state, case_mode)) {
+    return -1;
+  }
+  const double alignment = alignment_scaling * state->query.alignment;
+  // Without threshold, the bounds are not worth computing
+  const bool prune = threshold > 0;
+  const int *best_char = prune ? get_best_char(matcher) : get_bonus(matcher);
+  const int n = matcher->n;
+  if (n > state->capacity) {
+    state->capacity = 2 * n;
+    state->rows = (Scores *)reallocate(
+        state->rows, state->capacity * state->m * sizeof(Scores));
+    state->reach = (int *)reallocate(state->reach,
+                                     state->capacity * sizeof(int));
+    state->string =
+        (char *)reallocate(state->string, state->capacity * sizeof(char));
+  }
+  const int first_row = first_new_row(state, matcher->string);
+  const int m = state->m;
+  int best = prune ? get_max_score(matcher, state, first_row) : -1;
+  // Rows after the last possible match of the last character are not needed
+  const int last_row = state->latest[m - 2] + 1;
+  int n_rows = last_row + 1;
+  int jmin = 0;
+  bool below = false;
+  for (int i = first_row; i <= last_row; i++) {
+    while (jmin < m - 1 && state->latest[jmin] < i) {
+      jmin++;
+    }
+    const int bound =
+        compute_row(matcher, state, i, jmin, prune ? best_char[i] : 0,
+                    case_mode, fuzzy);
+    if (!prune) {
+      continue;
+    }
+    if (state->reach[i] == m - 1 &&
+        (state->query.gap_allowed[m - 1] || i == n - 1)) {
+      best = max(best, get_scores(state, i, m - 1)->match);
+    }
+    below = bound + alignment <= threshold && best + alignment <= threshold;
+    if (below || bound < best) {
+      n_rows = i + 1;
+      break;
+    }
+  }
+  memcpy(state->string, matcher->string, n);
+  state->n_valid = (n_rows < state->latest[0] + 1) ? n_rows
+                                                   : state->latest[0] + 1;
+  return below ? -1 : get_max_score(matcher, state, n_rows);
+}
+
+#define DEFINE_SCORE_FUNCTION(name, case_mode, fuzzy)                         \
+  static int name(Matcher *matcher, QueryState *state, double threshold) {    \
+    return score_query(matcher, state, threshold, case_mode, fuzzy);          \
+  }
+
+DEFINE_SCORE_FUNCTION(score_sensitive, CASE_MODE_sensitive, false)
+DEFINE_SCORE_FUNCTION(score_sensitive_fuzzy, CASE_MODE_sensitive, true)
+DEFINE_SCORE_FUNCTION(score_insensitive, CASE_MODE_insensitive, false)
+DEFINE_SCORE_FUNCTION(score_insensitive_fuzzy, CASE_MODE_insensitive, true)
+DEFINE_SCORE_FUNCTION(score_semi_sensitive, CASE_MODE_semi_sensitive, false)
+DEFINE_SCORE_FUNCTION(score_semi_sensitive_fuzzy, CASE_MODE_semi_sensitive,
+                      true)
+#ifdef GENERIC_MATCHING
+DEFINE_SCORE_FUNCTION(score_generic, matcher->case_mode, false)
+#endif
+
+// Variant of score_query for a query, selected once and for all: the queries
+// made of exact segments use score_segments instead. Building with
+// GENERIC_MATCHING uses the same variant for all the other ones (see bench/).
+static ScoreFunction score_function(const QueryState *state,
+                                    CASE_MODE case_mode) {
+  if (state->segments) {
+    return score_segments;
+  }
+#ifdef GENERIC_MATCHING
+  return score_generic;
+#else
+  static const ScoreFunction functions[][2] = {
+      [CASE_MODE_sensitive] = {score_sensitive, score_sensitive_fuzzy},
+      [CASE_MODE_insensitive] = {score_insensitive, score_insensitive_fuzzy},
+      [CASE_MODE_semi_sensitive] = {score_semi_sensitive,
+                                    score_semi_sensitive_fuzzy},
+  };
+  bool fuzzy = true;
+  for (int j = 1; j <= state->query.length; j++) {
+    fuzzy = fuzzy && state->query.gap_allowed[j];
+  }
+  return functions[case_mode][fuzzy];
+#endif
+}
+
+Matcher *matcher_create(Queries queries, CASE_MODE case_mode) {
+  Matcher *matcher = (Matcher *)allocate(sizeof(Matcher));
+  matcher->n_queries = queries.n;
+  matcher->states = (QueryState *)allocate(queries.n * sizeof(QueryState));
+  matcher->best = -1;
+  matcher->case_mode = case_mode;
+  matcher->string = NULL;
+  matcher->n = 0;
+  matcher->bonus = NULL;
+  matcher->bonus_valid = false;
+  matcher->best_char = NULL;
+  matcher->best_char_valid = false;
+  matcher->capacity = 0;
+  for (int c = 0; c < 256; c++) {
+    matcher->char_score[c] = 0;
+    for (int iquery = 0; iquery < queries.n; iquery++) {
+      const Query query = queries.queries[iquery];
+      for (int j = 0; j < query.length; j++) {
+        if (match_char((char)c, query.query[j], case_mode)) {
+          const int score = match_bonus + (isupper(c) && c == query.query[j]
+                                               ? uppercase_bonus
+                                               : 0);
+          matcher->char_score[c] = max(matcher->char_score[c], score);
         }
-        best_matching_data = data;
-      } else {
-        free_matching_data(data);
       }
     }
   }
-  if (best_score == 0.0) {
+  for (int iquery = 0; iquery < queries.n; iquery++) {
+    QueryState *state = matcher->states + iquery;
+    state->query = queries.queries[iquery];
+    state->m = state->query.length + 1;
+    state->capacity = 1;
+    state->rows = (Scores *)allocate(state->m * sizeof(Scores));
+    state->reach = (int *)allocate(sizeof(int));
+    state->latest = (int *)allocate(state->m * sizeof(int));
+    state->string = (char *)allocate(sizeof(char));
+    state->string[0] = 0;
+    state->n_valid = 0;
+    state->imax = 0;
+    // Row 0
+    state->rows[0].match = 0;
+    state->rows[0].gap = 0;
+    if (state->m > 1) {
+      state->rows[1].match = -1;
+      state->rows[1].gap = -1;
+    }
+    state->reach[0] = 0;
+    state->segments =
+        make_segments(state->query, case_mode, &state->n_segments);
+    state->score = score_function(state, case_mode);
+    state->occurrences = NULL;
+    state->n_occurrences = NULL;
+    if (state->segments) {
+      state->capacity = 0;
+      state->n_occurrences =
+          (int *)allocate(state->n_segments * sizeof(int));
+    }
+  }
+  return matcher;
+}
+
+void matcher_free(Matcher *matcher) {
+  for (int iquery = 0; iquery < matcher->n_queries; iquery++) {
+    free(matcher->states[iquery].rows);
+    free(matcher->states[iquery].reach);
+    free(matcher->states[iquery].latest);
+    free(matcher->states[iquery].string);
+    free(matcher->states[iquery].segments);
+    free(matcher->states[iquery].occurrences);
+    free(matcher->states[iquery].n_occurrences);
+  }
+  free(matcher->states);
+  free(matcher->bonus);
+  free(matcher->best_char);
+  free(matcher);
+}
+
+static int char_bit(unsigned char c) {
+  c = tolower(c);
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a';
+  }
+  if (c >= '0' && c <= '9') {
+    return 26 + c - '0';
+  }
+  switch (c) {
+  case '/':
+    return 36;
+  case '.':
+    return 37;
+  case '-':
+    return 38;
+  case '_':
+    return 39;
+  default:
+    return 40 + c % (CHAR_BITS - 40);
+  }
+}
+
+unsigned long long char_mask(const char *string, size_t n) {
+  static unsigned long long bits[256];
+  if (bits['a'] == 0) {
+    for (int c = 0; c < 256; c++) {
+      bits[c] = 1ULL << char_bit((unsigned char)c);
+    }
+  }
+  unsigned long long mask = 0;
+  for (size_t i = 0; i < n; i++) {
+    mask |= bits[(unsigned char)string[i]];
+  }
+  return mask;
+}
+
+CompiledQuery compile_queries(Queries queries, CASE_MODE case_mode) {
+  CompiledQuery compiled = {.mask = 0, .min_length = 0, .anchor = NULL};
+  for (int iquery = 0; iquery < queries.n; iquery++) {
+    const Query query = queries.queries[iquery];
+    const unsigned long long mask = char_mask(query.query, query.length);
+    compiled.mask = (iquery == 0) ? mask : (compiled.mask & mask);
+    if (iquery == 0 || query.length < compiled.min_length) {
+      compiled.min_length = query.length;
+    }
+  }
+  // All the queries start with the same anchored token (see
+  // make_extended_queries), whose characters have to be the first ones of the
+  // string.
+  if (queries.n > 0 && queries.queries[0].length > 0 &&
+      !queries.queries[0].gap_allowed[0]) {
+    const Query query = queries.queries[0];
+    int n = 0;
+    while (n < query.length && (n == 0 || !query.gap_allowed[n]) &&
+           match_only_itself(query.query[n], case_mode)) {
+      n++;
+    }
+    if (n > 0) {
+      compiled.anchor = strndup(query.query, n);
+    }
+  }
+  return compiled;
+}
+
+void compiled_query_free(CompiledQuery *compiled) { free(compiled->anchor); }
+
+double max_accuracy(Queries queries) {
+  const int max_char_score = match_bonus + max_char_bonus() + uppercase_bonus;
+  double best_score = 1.0; // accuracy of empty queries
+  if (queries.n > 0 && *queries.queries[0].query == 0) {
+    return best_score;
+  }
+  for (int iquery = 0; iquery < queries.n; iquery++) {
+    const Query query = queries.queries[iquery];
+    const double score = query.length * max_char_score + 2 +
+                         alignment_scaling * query.alignment;
+    if (score > best_score) {
+      best_score = score;
+    }
+  }
+  return best_score;
+}
+
+double matcher_score(Matcher *matcher, const char *string) {
+  return matcher_score_above(matcher, string, 0);
+}
+
+double matcher_score_above(Matcher *matcher, const char *string,
+                           double threshold) {
+  matcher->best = -1;
+  if (matcher->n_queries == 0) {
     return 0;
   }
-  // We have a match, allocate memory
-  if (colors) {
-    *output =
-        add_ansi_colors(best_matching_data, extract_breaks(best_matching_data));
-  } else {
-    *output = strdup(string);
+  if (*matcher->states[0].query.query == 0) {
+    return 1;
+  }
+  matcher->string = string;
+  matcher->n = strlen(string) + 1;
+  matcher->bonus_valid = false;
+  double best_score = 0.0;
+  for (int iquery = 0; iquery < matcher->n_queries; iquery++) {
+    QueryState *state = matcher->states + iquery;
+    // Only matches that beat the best one so far are needed
+    const int score = state->score(
+        matcher, state, threshold > best_score ? threshold : best_score);
+    const double total_score =
+        score + alignment_scaling * state->query.alignment;
+    if ((score > -1) && (total_score > best_score)) {
+      best_score = total_score;
+      matcher->best = iquery;
+    }
   }
-  free_matching_data(best_matching_data);
   return best_score;
 }
+
+char *matcher_highlight(Matcher *matcher, const char *string) {
+  if (matcher_score(matcher, string) <= 0 || matcher->best < 0) {
+    return strdup(string);
+  }
+  const QueryState *state = matcher->states + matcher->best;
+  const Breaks b = state->segments ? extract_segment_breaks(state)
+                                   : extract_breaks(state);
+  return add_ansi_colors(string, matcher->n, b);
+}
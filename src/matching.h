@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "query.h"
 
@@ -10,5 +12,68 @@ typedef enum CASE_MODE {
   CASE_MODE_semi_sensitive,
 } CASE_MODE;
 
-double match_accuracy(const char *string, Queries queries, bool colors,
-                      char **output, CASE_MODE case_mode);
+// Upper bound on the accuracy of any match of queries.
+double max_accuracy(Queries queries);
+
+// Bits of the characters of a string: characters are case-folded and the
+// rarest ones share bits, so that any match of a character sets its bit.
+#define CHAR_BITS 64
+unsigned long long char_mask(const char *string, size_t n);
+
+// Necessary conditions for a string to match one of the queries, which are
+// much cheaper to check than running the matcher.
+typedef struct CompiledQuery {
+  unsigned long long mask; // characters that every match contains
+  int min_length;          // shorter strings can not match
+  char *anchor; // every match starts with it (exactly, whatever the case
+                // mode), NULL if none
+} CompiledQuery;
+
+CompiledQuery compile_queries(Queries queries, CASE_MODE case_mode);
+
+void compiled_query_free(CompiledQuery *compiled);
+
+static inline bool compiled_query_accepts(const CompiledQuery *compiled,
+                                          const char *string, size_t n) {
+  return (int)n >= compiled->min_length &&
+         (compiled->mask & ~char_mask(string, n)) == 0;
+}
+
+// What compiled queries check of a string, for the strings that are matched
+// by many queries
+typedef struct Signature {
+  unsigned long long mask;
+  int length;
+} Signature;
+
+static inline Signature signature_of(const char *string) {
+  const size_t n = strlen(string);
+  return (Signature){.mask = char_mask(string, n), .length = (int)n};
+}
+
+static inline bool compiled_query_accepts_signature(
+    const CompiledQuery *compiled, Signature signature) {
+  return signature.length >= compiled->min_length &&
+         (compiled->mask & ~signature.mask) == 0;
+}
+
+// Matches queries against a sequence of strings. The DP rows of the
+// directories that a string shares with the previous one are reused, so
+// strings should be given in sorted order.
+typedef struct Matcher Matcher;
+
+Matcher *matcher_create(Queries queries, CASE_MODE case_mode);
+
+void matcher_free(Matcher *matcher);
+
+// Accuracy of the best match of the queries in string, 0 if there is none.
+double matcher_score(Matcher *matcher, const char *string);
+
+// Same as matcher_score when the accuracy is above threshold. Otherwise,
+// returns 0 or an accuracy that is not above threshold: the search for matches
+// is then abandoned as soon as none of them can be above threshold.
+double matcher_score_above(Matcher *matcher, const char *string,
+                           double threshold);
+
+// Copy of string where the best match is colored (to be freed by the caller).
+char *matcher_highlight(Matcher *matcher, const char *string);
@@ -0,0 +1,154 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memo.h"
+#include "textfile.h"
+
+static const char memo_suffix[] = ".memo";
+
+// Lines are of the form (with tabs between the fields)
+// <options> <time> <bound> <filters-generation> <visits> <last-visit> <path>
+// <query>, the query being last as it may contain tabs.
+#define N_FIELDS 8
+
+static void free_entry(MemoEntry *entry) {
+  free(entry->query);
+  free(entry->options);
+  free(entry->path);
+}
+
+static bool parse_entry(char *line, MemoEntry *entry) {
+  line[strcspn(line, "\n")] = '\0';
+  char *fields[N_FIELDS];
+  fields[0] = line;
+  for (int i = 1; i < N_FIELDS; i++) {
+    char *tab = strchr(fields[i - 1], '\t');
+    if (!tab) {
+      return false;
+    }
+    *tab = '\0';
+    fields[i] = tab + 1;
+  }
+  if (*fields[6] == '\0' || *fields[7] == '\0') {
+    return false;
+  }
+  entry->options = strdup(fields[0]);
+  entry->time = atoll(fields[1]);
+  entry->bound = strtod(fields[2], NULL);
+  entry->filters_generation = (unsigned int)strtoul(fields[3], NULL, 16);
+  entry->n_visits = strtod(fields[4], NULL);
+  entry->last_visit = atoll(fields[5]);
+  entry->path = strdup(fields[6]);
+  entry->query = strdup(fields[7]);
+  return true;
+}
+
+Memo *memo_load(const char *db_path) {
+  Memo *memo = (Memo *)malloc(sizeof(Memo));
+  if (!memo) {
+    return NULL;
+  }
+  memo->n = 0;
+  memo->path = sidecar_path(db_path, memo_suffix);
+  if (!memo->path) {
+    free(memo);
+    return NULL;
+  }
+  Textfile *f = file_open(memo->path);
+  if (!f) {
+    return memo;
+  }
+  while (memo->n < MEMO_SIZE && next_line(f)) {
+    if (parse_entry(f->line, memo->entries + memo->n)) {
+      memo->n++;
+    }
+  }
+  file_close(f);
+  return memo;
+}
+
+const MemoEntry *memo_find(const Memo *memo, const char *query,
+                           const char *options) {
+  for (int i = 0; i < memo->n; i++) {
+    const MemoEntry *entry = memo->entries + i;
+    if (strcmp(entry->query, query) == 0 &&
+        strcmp(entry->options, options) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+void memo_set(Memo *memo, const MemoEntry *entry) {
+  // Tabs and newlines would break the lines of the file
+  if (strpbrk(entry->path, "\t\n") || strchr(entry->query, '\n') ||
+      strpbrk(entry->options, "\t\n")) {
+    return;
+  }
+  int i = 0;
+  while (i < memo->n && (strcmp(memo->entries[i].query, entry->query) != 0 ||
+                         strcmp(memo->entries[i].options, entry->options) != 0)) {
+    i++;
+  }
+  if (i == MEMO_SIZE) {
+    i--;
+  }
+  if (i < memo->n) {
+    free_entry(memo->entries + i);
+  } else {
+    memo->n++;
+  }
+  memmove(memo->entries + 1, memo->entries, i * sizeof(MemoEntry));
+  memo->entries[0] = *entry;
+  memo->entries[0].query = strdup(entry->query);
+  memo->entries[0].options = strdup(entry->options);
+  memo->entries[0].path = strdup(entry->path);
+}
+
+int memo_save(const Memo *memo) {
+  const size_t n = strlen(memo->path) + 30;
+  char *tempname = (char *)malloc(n);
+  if (!tempname) {
+    return -1;
+  }
+  snprintf(tempname, n, "%s.%ld", memo->path, (long)getpid());
+  FILE *fp = fopen(tempname, "w");
+  if (!fp) {
+    free(tempname);
+    return -1;
+  }
+  for (int i = 0; i < memo->n; i++) {
+    const MemoEntry *e = memo->entries + i;
+    if (!e->query || !e->options || !e->path) {
+      continue;
+    }
+    fprintf(fp, "%s\t%lld\t%.17g\t%x\t%.17g\t%lld\t%s\t%s\n", e->options,
+            e->time, e->bound, e->filters_generation, e->n_visits,
+            e->last_visit, e->path, e->query);
+  }
+  int status = (fclose(fp) == 0) ? rename(tempname, memo->path) : -1;
+  if (status != 0) {
+    unlink(tempname);
+  }
+  free(tempname);
+  return status;
+}
+
+void memo_free(Memo *memo) {
+  for (int i = 0; i < memo->n; i++) {
+    free_entry(memo->entries + i);
+  }
+  free(memo->path);
+  free(memo);
+}
+
+void memo_clear(const char *db_path) {
+  char *path = sidecar_path(db_path, memo_suffix);
+  if (path) {
+    unlink(path);
+  }
+  free(path);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// Memo of the best results of the queries asked repeatedly to a database,
+// stored in <database>.memo. Along with the result of a query, it keeps the
+// best score of the other records at that time: as the scores of the records
+// only decrease until their next visits, a repeated query can be answered
+// without a search, by comparing the result with this score and with the
+// records visited since then (see journal.h).
+#define MEMO_SIZE 64
+
+typedef struct MemoEntry {
+  char *query;
+  char *options;   // of the search that change the scores
+  char *path;      // the result
+  double n_visits; // record of the result at that time
+  long long last_visit;
+  double bound;   // best score of the other records, -INFINITY if none
+  long long time; // of the search
+  unsigned int filters_generation;
+} MemoEntry;
+
+// Entries, the most recently recorded first.
+typedef struct Memo {
+  char *path;
+  MemoEntry entries[MEMO_SIZE];
+  int n;
+} Memo;
+
+// Returns NULL if it can not be allocated. A missing memo is empty.
+Memo *memo_load(const char *db_path);
+
+// Entry of the query, NULL if there is none.
+const MemoEntry *memo_find(const Memo *memo, const char *query,
+                           const char *options);
+
+// Record the entry (copied), which replaces the previous entry of its query.
+// The least recently recorded entry is dropped from a full memo.
+void memo_set(Memo *memo, const MemoEntry *entry);
+
+int memo_save(const Memo *memo);
+void memo_free(Memo *memo);
+
+// Forget all the entries, after the records have been changed otherwise than
+// by visits (clean).
+void memo_clear(const char *db_path);
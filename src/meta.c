@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "meta.h"
+#include "textfile.h"
+
+static const char meta_suffix[] = ".meta";
+
+typedef struct Pair {
+  char *key;
+  double value;
+} Pair;
+
+struct Meta {
+  char *path;
+  Pair *pairs;
+  int n;
+  int size;
+};
+
+Meta *meta_load(const char *db_path) {
+  Meta *meta = (Meta *)malloc(sizeof(Meta));
+  if (!meta) {
+    return NULL;
+  }
+  meta->path = sidecar_path(db_path, meta_suffix);
+  meta->size = 16;
+  meta->n = 0;
+  meta->pairs = (Pair *)malloc(meta->size * sizeof(Pair));
+  if (!meta->path || !meta->pairs) {
+    meta_free(meta);
+    return NULL;
+  }
+
+  Textfile *f = file_open(meta->path);
+  if (!f) {
+    return meta;
+  }
+  // Lines are of the form <key> <value>
+  while (next_line(f)) {
+    char *space = strchr(f->line, ' ');
+    if (space) {
+      *space = '\0';
+      meta_set(meta, f->line, atof(space + 1));
+    }
+  }
+  file_close(f);
+  return meta;
+}
+
+double meta_get(const Meta *meta, const char *key, double default_value) {
+  for (int i = 0; i < meta->n; i++) {
+    if (strcmp(meta->pairs[i].key, key) == 0) {
+      return meta->pairs[i].value;
+    }
+  }
+  return default_value;
+}
+
+void meta_set(Meta *meta, const char *key, double value) {
+  for (int i = 0; i < meta->n; i++) {
+    if (strcmp(meta->pairs[i].key, key) == 0) {
+      meta->pairs[i].value = value;
+      return;
+    }
+  }
+  if (meta->n == meta->size) {
+    Pair *pairs = (Pair *)realloc(meta->pairs, 2 * meta->size * sizeof(Pair));
+    if (!pairs) {
+      return;
+    }
+    meta->pairs = pairs;
+    meta->size *= 2;
+  }
+  meta->pairs[meta->n].key = strdup(key);
+  meta->pairs[meta->n].value = value;
+  meta->n++;
+}
+
+int meta_save(const Meta *meta) {
+  const size_t n = strlen(meta->path) + 30;
+  char *tempname = (char *)malloc(n);
+  if (!tempname) {
+    return -1;
+  }
+  snprintf(tempname, n, "%s.%ld", meta->path, (long)getpid());
+  FILE *fp = fopen(tempname, "w");
+  if (!fp) {
+    free(tempname);
+    return -1;
+  }
+  for (int i = 0; i < meta->n; i++) {
+    fprintf(fp, "%s %.17g\n", meta->pairs[i].key, meta->pairs[i].value);
+  }
+  int status = (fclose(fp) == 0) ? rename(tempname, meta->path) : -1;
+  if (status != 0) {
+    unlink(tempname);
+  }
+  free(tempname);
+  return status;
+}
+
+void meta_free(Meta *meta) {
+  if (meta->pairs) {
+    for (int i = 0; i < meta->n; i++) {
+      free(meta->pairs[i].key);
+    }
+  }
+  free(meta->pairs);
+  free(meta->path);
+  free(meta);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// Small key/value store kept next to a database (in <database>.meta). It holds
+// bookkeeping values that are not part of the records themselves.
+typedef struct Meta Meta;
+
+// Returns an empty store if the file does not exist, NULL on allocation
+// failure.
+Meta *meta_load(const char *db_path);
+
+double meta_get(const Meta *meta, const char *key, double default_value);
+
+void meta_set(Meta *meta, const char *key, double value);
+
+// Atomically replaces the file. Returns 0 on success.
+int meta_save(const Meta *meta);
+
+void meta_free(Meta *meta);
@@ -0,0 +1,418 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pick.h"
+
+// Terminal of the running picker (-1 if there is none), in raw mode
+static int tty = -1;
+static struct termios saved_termios;
+static struct sigaction saved_sigwinch;
+static volatile sig_atomic_t resized = 0;
+
+static void on_resize(int signal) {
+  (void)signal;
+  resized = 1;
+}
+
+// Open the terminal in raw mode, on the alternate screen.
+static bool terminal_open(void) {
+  tty = open("/dev/tty", O_RDWR);
+  if (tty < 0) {
+    return false;
+  }
+  struct termios raw;
+  if (tcgetattr(tty, &saved_termios) != 0) {
+    close(tty);
+    tty = -1;
+    return false;
+  }
+  raw = saved_termios;
+  raw.c_iflag &= ~(IXON | ICRNL | INLCR);
+  raw.c_oflag &= ~OPOST;
+  raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(tty, TCSAFLUSH, &raw);
+  // Without SA_RESTART, a resize interrupts the wait for a key
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_resize;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGWINCH, &action, &saved_sigwinch);
+  static const char enter[] = "\033[?1049h";
+  if (write(tty, enter, sizeof(enter) - 1) < 0) {
+    pick_restore();
+    return false;
+  }
+  return true;
+}
+
+void pick_restore(void) {
+  if (tty < 0) {
+    return;
+  }
+  static const char leave[] = "\033[?25h\033[?1049l";
+  if (write(tty, leave, sizeof(leave) - 1) < 0) {
+    // The terminal is restored anyway
+  }
+  tcsetattr(tty, TCSAFLUSH, &saved_termios);
+  sigaction(SIGWINCH, &saved_sigwinch, NULL);
+  close(tty);
+  tty = -1;
+}
+
+// Whether input arrives on the terminal within timeout milliseconds.
+static bool input_within(int timeout) {
+  struct pollfd fd = {.fd = tty, .events = POLLIN, .revents = 0};
+  return poll(&fd, 1, timeout) > 0;
+}
+
+bool pick_interrupted(void) { return tty >= 0 && input_within(0); }
+
+typedef enum KEY {
+  KEY_none, // nothing to do but drawing again (e.g. on a resize)
+  KEY_char,
+  KEY_backspace,
+  KEY_clear,
+  KEY_delete_word,
+  KEY_up,
+  KEY_down,
+  KEY_toggle,
+  KEY_accept,
+  KEY_cancel,
+} KEY;
+
+// Rest of an escape sequence, whose bytes follow right away. The sequences
+// that are not arrows are dropped.
+static KEY read_escape(void) {
+  unsigned char c;
+  if (!input_within(25) || read(tty, &c, 1) != 1) {
+    return KEY_cancel;
+  }
+  if (c != '[' && c != 'O') {
+    return KEY_none;
+  }
+  // Parameters, up to the final byte
+  do {
+    if (!input_within(25) || read(tty, &c, 1) != 1) {
+      return KEY_none;
+    }
+  } while (c < 0x40 || c > 0x7e);
+  return (c == 'A') ? KEY_up : (c == 'B') ? KEY_down : KEY_none;
+}
+
+// Wait for the next key. The byte of KEY_char is put in *c.
+static KEY read_key(unsigned char *c) {
+  const ssize_t n = read(tty, c, 1);
+  if (n == 0) {
+    return KEY_cancel;
+  }
+  if (n < 0) {
+    return (errno == EINTR) ? KEY_none : KEY_cancel;
+  }
+  switch (*c) {
+  case 27:
+    return read_escape();
+  case 3:  // ctrl-c
+  case 7:  // ctrl-g
+    return KEY_cancel;
+  case 13:
+    return KEY_accept;
+  case 9:
+    return KEY_toggle;
+  case 8:
+  case 127:
+    return KEY_backspace;
+  case 21: // ctrl-u
+    return KEY_clear;
+  case 23: // ctrl-w
+    return KEY_delete_word;
+  case 11: // ctrl-k
+  case 16: // ctrl-p
+    return KEY_up;
+  case 10: // ctrl-j
+  case 14: // ctrl-n
+    return KEY_down;
+  }
+  return (*c < 32) ? KEY_none : KEY_char;
+}
+
+// Frame, written to the terminal at once. Once an allocation fails, the rest
+// of the frame is dropped.
+typedef struct Frame {
+  char *data;
+  size_t length;
+  size_t size;
+} Frame;
+
+static void frame_append(Frame *frame, const char *string, size_t n) {
+  if (frame->length + n > frame->size) {
+    const size_t size = 2 * (frame->length + n);
+    char *data = (char *)realloc(frame->data, size);
+    if (!data) {
+      return;
+    }
+    frame->data = data;
+    frame->size = size;
+  }
+  memcpy(frame->data + frame->length, string, n);
+  frame->length += n;
+}
+
+static void frame_puts(Frame *frame, const char *string) {
+  frame_append(frame, string, strlen(string));
+}
+
+// Length of the escape sequence (\033[...m) starting at s, 0 if there is none.
+static size_t escape_length(const char *s) {
+  if (s[0] != '\033' || s[1] != '[') {
+    return 0;
+  }
+  size_t n = 2;
+  while (s[n] != '\0' && ((unsigned char)s[n] < 0x40 ||
+                          (unsigned char)s[n] > 0x7e)) {
+    n++;
+  }
+  return (s[n] == '\0') ? n : n + 1;
+}
+
+// Columns taken by string: escape sequences take none, and UTF-8 characters
+// one.
+static int columns(const char *string) {
+  int n = 0;
+  for (const char *s = string; *s != '\0'; s++) {
+    const size_t escape = escape_length(s);
+    if (escape > 0) {
+      s += escape - 1;
+    } else if (((unsigned char)*s & 0xc0) != 0x80) {
+      n++;
+    }
+  }
+  return n;
+}
+
+// Append string, within width columns. Longer strings lose their beginning:
+// the ends of the paths tell them apart.
+static void frame_fit(Frame *frame, const char *string, int width) {
+  const int n = columns(string);
+  if (n <= width) {
+    frame_puts(frame, string);
+    return;
+  }
+  if (width < 2) {
+    return;
+  }
+  frame_puts(frame, "..");
+  // Columns to skip, whose escape sequences are kept
+  int skip = n - (width - 2);
+  const char *s = string;
+  while (*s != '\0') {
+    const size_t escape = escape_length(s);
+    if (escape > 0) {
+      frame_append(frame, s, escape);
+      s += escape;
+      continue;
+    }
+    if (((unsigned char)*s & 0xc0) != 0x80 && skip > 0) {
+      skip--;
+      s++;
+      // With the continuation bytes of the character
+      while (((unsigned char)*s & 0xc0) == 0x80) {
+        s++;
+      }
+      continue;
+    }
+    frame_append(frame, s, 1);
+    s++;
+  }
+}
+
+static void window_size(int *rows, int *cols) {
+  struct winsize size;
+  if (ioctl(tty, TIOCGWINSZ, &size) == 0 && size.ws_row > 0 &&
+      size.ws_col > 0) {
+    *rows = size.ws_row;
+    *cols = size.ws_col;
+  } else {
+    *rows = 24;
+    *cols = 80;
+  }
+}
+
+// Time between the frames of a running search, in milliseconds
+#define FRAME_TIME 16
+
+// Everything that is drawn
+typedef struct View {
+  const char *query;
+  const char *label; // of the database
+  const PickResults *results; // NULL before the first search
+  bool stale;                 // the results are not the query's yet
+  int selected;
+  int offset; // of the first result on the screen
+} View;
+
+// View of the running picker, and the time of its last frame
+static View *current_view = NULL;
+static struct timespec last_frame;
+
+static long milliseconds_since(const struct timespec *t) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+// Draw the view: the query, a status line, and the results below them.
+static void draw(View *view) {
+  int rows, cols;
+  window_size(&rows, &cols);
+  resized = 0;
+  const int visible = (rows > 2) ? rows - 2 : 0;
+  if (view->selected < view->offset) {
+    view->offset = view->selected;
+  } else if (view->selected >= view->offset + visible) {
+    view->offset = view->selected - visible + 1;
+  }
+  Frame frame = {.data = NULL, .length = 0, .size = 0};
+  frame_puts(&frame, "\033[?25l\033[H\033[1m> \033[0m");
+  frame_fit(&frame, view->query, cols - 3);
+  char status[256];
+  const PickResults *results = view->results;
+  snprintf(status, sizeof(status), "\033[K\r\n\033[2m  %d/%d %s%s\033[0m",
+           results ? results->n : 0, results ? results->n_records : 0,
+           view->label, view->stale ? " ..." : "");
+  frame_puts(&frame, status);
+  for (int i = 0; results && i < visible && view->offset + i < results->n;
+       i++) {
+    const int index = view->offset + i;
+    frame_puts(&frame, "\033[K\r\n");
+    frame_puts(&frame, (index == view->selected) ? "\033[1m> \033[0m" : "  ");
+    frame_fit(&frame, results->highlighted[index], cols - 2);
+    frame_puts(&frame, "\033[0m");
+  }
+  // The cursor is left at the end of the query
+  char cursor[64];
+  const int query_columns = columns(view->query);
+  snprintf(cursor, sizeof(cursor), "\033[K\r\n\033[J\033[1;%dH\033[?25h",
+           (query_columns < cols - 3 ? query_columns : cols - 3) + 3);
+  frame_puts(&frame, cursor);
+  if (frame.data && write(tty, frame.data, frame.length) < 0) {
+    // The next frame may be drawn
+  }
+  free(frame.data);
+  clock_gettime(CLOCK_MONOTONIC, &last_frame);
+}
+
+bool pick_frame_due(void) {
+  return current_view && milliseconds_since(&last_frame) >= FRAME_TIME;
+}
+
+void pick_show(const PickResults *partial) {
+  View view = *current_view;
+  view.results = partial;
+  view.stale = true;
+  view.selected = 0;
+  view.offset = 0;
+  draw(&view);
+}
+
+#define MAX_QUERY 1024
+
+char *pick(const Picker *picker, const char *initial, bool *failed) {
+  *failed = !terminal_open();
+  if (*failed) {
+    return NULL;
+  }
+  char query[MAX_QUERY];
+  snprintf(query, sizeof(query), "%s", initial);
+  size_t length = strlen(query);
+  int database = picker->database;
+  PickResults *results = NULL;
+  PickResults last;
+  bool stale = true;
+  View view = {.query = query,
+               .label = picker->labels[database],
+               .results = NULL,
+               .stale = true,
+               .selected = 0,
+               .offset = 0};
+  current_view = &view;
+  clock_gettime(CLOCK_MONOTONIC, &last_frame);
+  KEY key = KEY_none;
+  while (key != KEY_accept && key != KEY_cancel) {
+    view.label = picker->labels[database];
+    view.stale = stale;
+    if (stale) {
+      // The keystrokes are shown before the search
+      draw(&view);
+    }
+    if (stale && picker->search(picker->data, query, database, &last)) {
+      results = &last;
+      stale = false;
+      view.selected = 0;
+      view.offset = 0;
+    }
+    view.results = results;
+    view.stale = stale;
+    draw(&view);
+    // The keys that are already waiting are all handled before the next
+    // search
+    do {
+      unsigned char c;
+      key = read_key(&c);
+      if (key == KEY_char && length < MAX_QUERY - 1) {
+        query[length++] = (char)c;
+        stale = true;
+      } else if (key == KEY_backspace && length > 0) {
+        // The last character, with its UTF-8 continuation bytes
+        do {
+          length--;
+        } while (length > 0 && ((unsigned char)query[length] & 0xc0) == 0x80);
+        stale = true;
+      } else if (key == KEY_clear) {
+        length = 0;
+        stale = true;
+      } else if (key == KEY_delete_word) {
+        while (length > 0 && query[length - 1] == ' ') {
+          length--;
+        }
+        while (length > 0 && query[length - 1] != ' ') {
+          length--;
+        }
+        stale = true;
+      } else if (key == KEY_toggle && picker->n_databases > 1) {
+        database = (database + 1) % picker->n_databases;
+        stale = true;
+      } else if (key == KEY_up && view.selected > 0) {
+        view.selected--;
+      } else if (key == KEY_down && results &&
+                 view.selected < results->n - 1) {
+        view.selected++;
+      }
+      query[length] = '\0';
+    } while (key != KEY_accept && key != KEY_cancel && !resized &&
+             pick_interrupted());
+  }
+  // The results of the last keystrokes are the ones that are selected
+  if (key == KEY_accept && stale &&
+      picker->search(picker->data, query, database, &last)) {
+    results = &last;
+    view.selected = 0;
+  }
+  char *path = NULL;
+  if (key == KEY_accept && results && view.selected < results->n) {
+    path = strdup(results->paths[view.selected]);
+  }
+  current_view = NULL;
+  pick_restore();
+  return path;
+}
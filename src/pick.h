@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Results of a search of the picker, by decreasing score
+typedef struct PickResults {
+  char **paths;       // printed when selected
+  char **highlighted; // displayed, with the matches colored
+  int n;
+  int n_records; // of the database that was searched
+} PickResults;
+
+// Search query in the database of the given index (see Picker), filling
+// results, which stay owned by the callee: the previous ones are freed. If the
+// search is abandoned because pick_interrupted returned true, they are left
+// unchanged and it returns false.
+typedef bool (*PickSearch)(void *data, const char *query, int database,
+                           PickResults *results);
+
+typedef struct Picker {
+  PickSearch search;
+  void *data;
+  const char *const *labels; // of the databases, that Tab cycles through
+  int n_databases;
+  int database; // searched first
+} Picker;
+
+// Run the picker on the terminal, starting from query. Each keystroke runs a
+// new search, which is abandoned if other keystrokes arrive in the meantime.
+// Returns the selected path (to be freed), or NULL if the picker was
+// cancelled. The terminal can not be opened if it returns NULL with
+// *failed set.
+char *pick(const Picker *picker, const char *query, bool *failed);
+
+// Whether keystrokes are waiting: the running search should then be abandoned.
+bool pick_interrupted(void);
+
+// Whether the running search has taken a frame's time since the last frame:
+// its results so far should then be shown by pick_show.
+bool pick_frame_due(void);
+
+// Draw the partial results of the running search (still owned by the caller).
+void pick_show(const PickResults *partial);
+
+// Restore the terminal if the picker is running (when jumper exits).
+void pick_restore(void);
@@ -81,38 +81,41 @@ static Token *make_token(const char *token) {
   return t;
 }
 
-static TokenArray parse(const char *query) {
+// Returns false if the query has more than MAX_TOKENS tokens.
+static bool parse(const char *query, TokenArray *array) {
   char *pch;
   char *str = strdup(query);
-  const int max_tokens = 50;
-  TokenArray array;
-  array.tokens = (Token **)malloc(max_tokens * sizeof(Token *));
-  array.length = 0;
-  array.start = NULL;
-  array.end = NULL;
+  array->tokens = (Token **)malloc(MAX_TOKENS * sizeof(Token *));
+  array->length = 0;
+  array->start = NULL;
+  array->end = NULL;
   pch = strtok(str, " ");
   while (pch != NULL) {
     if (strlen(pch) > 1 || (*pch != '^' && *pch != '\'' && *pch != '$')) {
       Token *token = make_token(pch);
-      if (token->type == TTYPE_start) {
-        array.start = token;
-      } else if (token->type == TTYPE_end) {
-        array.end = token;
-      } else {
-        if (array.length < max_tokens) {
-          array.tokens[array.length++] = token;
-        } else {
-          fprintf(stderr,
-                  "Error: jumper does not accept more than %d tokens.\n",
-                  max_tokens);
-          exit(EXIT_FAILURE);
+      // A second anchor replaces the first one
+      Token **anchor = (token->type == TTYPE_start) ? &array->start
+                       : (token->type == TTYPE_end) ? &array->end
+                                                     : NULL;
+      if (anchor) {
+        if (*anchor) {
+          free((*anchor)->token);
+          free(*anchor);
         }
+        *anchor = token;
+      } else if (array->length < MAX_TOKENS) {
+        array->tokens[array->length++] = token;
+      } else {
+        free(token->token);
+        free(token);
+        free(str);
+        return false;
       }
     }
     pch = strtok(NULL, " ");
   }
   free(str);
-  return array;
+  return true;
 }
 
 static Query make_query(TokenArray array, Permutation *p) {
@@ -162,16 +165,18 @@ static Query make_query(TokenArray array, Permutation *p) {
 // that are close enough (in the sense of having a certain number of
 // pairs of token well ordered) to the identity.
 Queries make_extended_queries(const char *query, bool orderless) {
-  TokenArray array = parse(query);
+  Queries q = {.queries = NULL, .n = 0};
+  TokenArray array;
+  if (!parse(query, &array)) {
+    free_tokenarray(array);
+    return q;
+  }
   const int N = array.length;
   Permutation *p = init_permutation(N);
   if (!p) {
-    fprintf(stderr,
-            "ERROR: failed to allocate memory for permutations of size %d.\n",
-            N);
-    exit(EXIT_FAILURE);
+    free_tokenarray(array);
+    return q;
   }
-  Queries q;
   q.queries = (Query *)malloc(30 * sizeof(Query));
   q.queries[0] = make_query(array, p);
   q.n = 1;
@@ -196,3 +201,47 @@ Queries make_extended_queries(const char *query, bool orderless) {
   free_tokenarray(array);
   return q;
 }
+
+// Number of the tokens of query that parse() takes for anchors of the given
+// kind ('^' for start, '$' for end).
+static int count_anchors(const char *query, char kind) {
+  int n = 0;
+  const char *token = query;
+  while (*token != '\0') {
+    const size_t length = strcspn(token, " ");
+    if (length > 1) {
+      if (kind == '^') {
+        n += (*token == '^');
+      } else {
+        n += (token[length - 1] == '$' && *token != '^' && *token != '\'');
+      }
+    }
+    token += length;
+    token += (*token == ' ');
+  }
+  return n;
+}
+
+bool query_refines(const char *query, const char *refinement, SYNTAX syntax) {
+  const size_t n = strlen(query);
+  if (strncmp(query, refinement, n) != 0) {
+    return false;
+  }
+  if (syntax != SYNTAX_extended) {
+    return true;
+  }
+  // An end anchor that is extended becomes a fuzzy token
+  const char *last = query;
+  for (const char *p = query; *p != '\0'; p++) {
+    if (*p == ' ') {
+      last = p + 1;
+    }
+  }
+  if (refinement[n] != '\0' && refinement[n] != ' ' &&
+      count_anchors(last, '$') == 1) {
+    return false;
+  }
+  // A second anchor of a kind replaces the first one
+  return count_anchors(refinement, '^') <= 1 &&
+         count_anchors(refinement, '$') <= 1;
+}
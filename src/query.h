@@ -44,4 +44,15 @@ typedef struct Queries {
 
 void free_queries(Queries queries);
 Query make_standard_query(const char *query, bool gap_allowed);
+
+// Extended queries accept at most this many tokens (anchors aside)
+#define MAX_TOKENS 50
+
+// Queries of an extended query: one per order of its tokens that is tried.
+// There are none (n == 0) if the query has too many tokens or if they can not
+// be allocated.
 Queries make_extended_queries(const char *query, bool orderless);
+
+// Whether every match of refinement is a match of query: refinement extends
+// query, and the tokens of query keep their kind.
+bool query_refines(const char *query, const char *refinement, SYNTAX syntax);
@@ -1,27 +1,153 @@
 #include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "record.h"
+#include "textfile.h"
 
 static const double SHORT_DECAY = 2 * 1e-5;
 static const double LONG_DECAY = 3 * 1e-7;
 
-void parse_record(char *string, Record *rec) {
+// Powers of ten that are exact doubles
+static const double POWERS_OF_TEN[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+// Number of visits, as written by "%f": [-]digits[.digits]. Below 2^53, the
+// digits form an exact integer and the power of ten is exact, so that the
+// division is correctly rounded, as strtod is. The other numbers are left to
+// strtod. Returns the end of the number, NULL if there is none.
+static const char *parse_visits(const char *s, double *value) {
+  const char *p = s;
+  const bool negative = (*p == '-');
+  p += negative;
+  uint64_t digits = 0;
+  int n_digits = 0;
+  int n_decimals = 0;
+  for (; is_digit(*p); p++, n_digits++) {
+    digits = digits * 10 + (*p - '0');
+  }
+  if (*p == '.') {
+    for (p++; is_digit(*p); p++, n_digits++, n_decimals++) {
+      digits = digits * 10 + (*p - '0');
+    }
+  }
+  if (n_digits > 0 && n_digits <= 15 && *p != 'e' && *p != 'E') {
+    *value = (double)digits / POWERS_OF_TEN[n_decimals];
+    *value = negative ? -*value : *value;
+    return p;
+  }
+  char *end;
+  *value = strtod(s, &end);
+  return end == s ? NULL : end;
+}
+
+// Timestamp: [-]digits, as atoll reads them.
+static const char *parse_timestamp(const char *s, long long *value) {
+  const char *p = s;
+  const bool negative = (*p == '-');
+  p += negative;
+  long long t = 0;
+  int n_digits = 0;
+  for (; is_digit(*p) && n_digits < 18; p++, n_digits++) {
+    t = t * 10 + (*p - '0');
+  }
+  if (n_digits == 0) {
+    return NULL;
+  }
+  if (is_digit(*p)) {
+    char *end;
+    *value = strtoll(s, &end, 10);
+    return end;
+  }
+  *value = negative ? -t : t;
+  return p;
+}
+
+static unsigned int hex_value(char c) {
+  if (is_digit(c)) {
+    return c - '0';
+  }
+  c |= 0x20;
+  return (c >= 'a' && c <= 'f') ? (unsigned int)(c - 'a' + 10) : 16;
+}
+
+bool parse_record(char *string, Record *rec) {
   // Warning: this modifies string
-  char *current = string;
-  rec->path = strtok_r(string, "|", &current);
-  char *parsed = strtok_r(current, "|", &current);
-  if (parsed == NULL || current == NULL || *parsed == '\0' ||
-      *current == '\0') {
-    fprintf(stderr, "ERROR: Invalid line format for the database file.\n"
-                    "Lines have to be of the form "
-                    "<path>|<number-of-visits>|<timestamp>.\n");
-    exit(EXIT_FAILURE);
+  char *separator = strchr(string, '|');
+  if (separator == NULL || separator == string) {
+    return false;
+  }
+  *separator = '\0';
+  rec->path = string;
+  const char *p = parse_visits(separator + 1, &rec->n_visits);
+  if (p == NULL || *p != '|' ||
+      (p = parse_timestamp(p + 1, &rec->last_visit)) == NULL) {
+    return false;
+  }
+  // Lines that have been overwritten by shorter ones are padded with spaces,
+  // and lines edited elsewhere may end with blanks or "\r\n"
+  while (*p == ' ' || *p == '\t' || *p == '\r') {
+    p++;
+  }
+  // Optional 4th field: <filter-generation>:<filtered>
+  rec->filter_generation = 0;
+  rec->filtered = false;
+  if (*p == '|') {
+    unsigned int generation = 0;
+    unsigned int digit;
+    for (p++; (digit = hex_value(*p)) < 16; p++) {
+      generation = (generation << 4) | digit;
+    }
+    rec->filter_generation = generation;
+    rec->filtered = (p[0] == ':' && p[1] == '1');
+    return true;
+  }
+  return *p == '\0' || *p == '\n';
+}
+
+int compare_line_path(const char *line, const void *k) {
+  const char *key = (const char *)k;
+  while (*line != '|' && *line != '\n' && *line != '\0' && *line == *key) {
+    line++;
+    key++;
+  }
+  const unsigned char c = (*line == '|' || *line == '\n') ? 0 : *line;
+  return (int)c - (int)(unsigned char)*key;
+}
+
+static __thread WarningHandler warning_handler;
+
+WarningHandler set_warning_handler(WarningHandler handler) {
+  const WarningHandler previous = warning_handler;
+  warning_handler = handler;
+  return previous;
+}
+
+void report_warning(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  if (warning_handler.report) {
+    char message[1024];
+    vsnprintf(message, sizeof(message), format, args);
+    warning_handler.report(message, warning_handler.data);
+  } else {
+    fprintf(stderr, "WARNING: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
   }
-  rec->n_visits = atof(parsed);
-  rec->last_visit = atoll(current);
+  va_end(args);
+}
+
+void report_invalid_record(struct Textfile *f) {
+  report_warning("Skipping line %ld of %s: lines have to be of the form "
+                 "<path>|<number-of-visits>|<timestamp>.",
+                 file_line_number(f), f->path);
 }
 
 void update_record(Record *rec, long long now, double weight) {
@@ -31,12 +157,19 @@ void update_record(Record *rec, long long now, double weight) {
 }
 
 char *record_to_string(Record *rec) {
-  const int n = strlen(rec->path) + 30;
+  const int n = strlen(rec->path) + 50;
   char *buffer = (char *)malloc(n * sizeof(char));
   if (!buffer)
     return NULL;
-  if (snprintf(buffer, n, "%s|%f|%lld", rec->path, rec->n_visits,
-               rec->last_visit) < 0) {
+  int written;
+  if (rec->filter_generation != 0) {
+    written = snprintf(buffer, n, "%s|%f|%lld|%x:%d", rec->path, rec->n_visits,
+                       rec->last_visit, rec->filter_generation, rec->filtered);
+  } else {
+    written = snprintf(buffer, n, "%s|%f|%lld", rec->path, rec->n_visits,
+                       rec->last_visit);
+  }
+  if (written < 0) {
     free(buffer);
     return NULL;
   }
@@ -52,3 +185,115 @@ double frecency(double n_visits, double delta) {
   return 2.4 + log(0.1 + 10 / (1 + delta * SHORT_DECAY) +
                    exp(-LONG_DECAY * delta) * n_visits);
 }
+
+double log_visits(double n_visits, long long last_visit, long long epoch) {
+  return log(n_visits) + LONG_DECAY * (last_visit - epoch);
+}
+
+double visits_from_log(double log_visits, long long epoch, long long now) {
+  return exp(log_visits - LONG_DECAY * (now - epoch));
+}
+
+double frecency_from_log(double log_visits, long long epoch,
+                         long long last_visit, long long now) {
+  return 2.4 + log(0.1 + 10 / (1 + (now - last_visit) * SHORT_DECAY) +
+                   visits_from_log(log_visits, epoch, now));
+}
+
+// exp and log are approximated with polynomials after the usual range
+// reductions: the loops below have no branches nor calls, so that they can be
+// vectorized.
+static const double LN2_HI = 0.693147180369123816490;
+static const double LN2_LO = 1.90821492927058770002e-10;
+static const double LOG_1_5 = 0.405465108108164381978;
+
+static inline double bits_to_double(uint64_t bits) {
+  double x;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+static inline uint64_t double_to_bits(double x) {
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  return bits;
+}
+
+// 1.5 * 2^52: adding it rounds a double of magnitude below 2^51 to an integer,
+// which is then in the low bits of the sum.
+static const double ROUNDING = 6755399441055744.0;
+
+// exp(x) for |x| <= 700, with a relative error below 2e-7
+static inline double approximate_exp(double x) {
+  const double t = x * (1 / M_LN2) + ROUNDING;
+  const double k = t - ROUNDING;
+  // |r| <= ln(2) / 2: the Taylor series up to r^6 is accurate to 2e-7
+  const double r = (x - k * LN2_HI) - k * LN2_LO;
+  double p = 1.0 / 720;
+  p = p * r + 1.0 / 120;
+  p = p * r + 1.0 / 24;
+  p = p * r + 1.0 / 6;
+  p = p * r + 0.5;
+  p = p * r + 1;
+  p = p * r + 1;
+  // 2^k
+  const uint64_t exponent = double_to_bits(t) - double_to_bits(ROUNDING) + 1023;
+  return p * bits_to_double(exponent << 52);
+}
+
+// log(x) for normal x > 0, with an absolute error below 2e-7
+static inline double approximate_log(double x) {
+  const uint64_t bits = double_to_bits(x);
+  // x = 2^e * m with m in [1, 2), and log(m) = log(1.5) + 2 atanh(s)
+  const double m =
+      bits_to_double((bits & 0x000fffffffffffffULL) | double_to_bits(1));
+  const double e = bits_to_double((bits >> 52) | double_to_bits(0x1p52)) -
+                   (0x1p52 + 1023);
+  // |s| <= 0.2: the series up to s^7 is accurate to 2e-7
+  const double s = (m - 1.5) / (m + 1.5);
+  const double s2 = s * s;
+  double p = 1.0 / 7;
+  p = p * s2 + 1.0 / 5;
+  p = p * s2 + 1.0 / 3;
+  p = p * s2 + 1;
+  return e * LN2_HI + (e * LN2_LO + (LOG_1_5 + 2 * s * p));
+}
+
+void approximate_frecencies(const Record *records, int n, long long now,
+                            double *frecencies) {
+  // The records are copied in columns, by blocks
+  enum { BLOCK = 64 };
+  // Beyond 2e9 seconds, the visits have decayed by exp(-600)
+  const long long max_delta = 2000000000;
+  double n_visits[BLOCK];
+  double delta[BLOCK];
+  double decay[BLOCK];
+  for (int start = 0; start < n; start += BLOCK) {
+    const int size = (n - start < BLOCK) ? n - start : BLOCK;
+    for (int i = 0; i < size; i++) {
+      const long long d = now - records[start + i].last_visit;
+      n_visits[i] = records[start + i].n_visits;
+      delta[i] = d;
+      decay[i] = -LONG_DECAY * (d < -max_delta  ? -max_delta
+                                : d > max_delta ? max_delta
+                                                : d);
+    }
+    double *out = frecencies + start;
+    for (int i = 0; i < size; i++) {
+      out[i] = 2.4 + approximate_log(0.1 + 10 / (1 + delta[i] * SHORT_DECAY) +
+                                     approximate_exp(decay[i]) * n_visits[i]);
+    }
+  }
+}
+
+void bound_record(Record *bound, const Record *rec) {
+  if (rec->last_visit > bound->last_visit) {
+    bound->n_visits =
+        visits(bound->n_visits, rec->last_visit - bound->last_visit);
+    bound->last_visit = rec->last_visit;
+  }
+  const double v = visits(rec->n_visits, bound->last_visit - rec->last_visit);
+  if (v > bound->n_visits) {
+    bound->n_visits = v;
+  }
+}
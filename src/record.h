@@ -1,12 +1,47 @@
 #pragma once
 
+#include <stdbool.h>
+
 typedef struct Record {
   const char *path;
   double n_visits;
   long long last_visit;
+  // Cached verdict of the filters: 'filtered' is only meaningful if
+  // 'filter_generation' matches the current generation of the filters' file
+  // (0 means that no verdict has been recorded).
+  unsigned int filter_generation;
+  bool filtered;
 } Record;
 
-void parse_record(char *string, Record *rec);
+// Parse a line of a database: <path>|<visits>|<timestamp>[|<filters>].
+// Warning: this modifies string, into which rec->path points. Returns false
+// if the line is malformed.
+bool parse_record(char *string, Record *rec);
+
+// Compare the path of a line of a database with key, as strcmp does: it
+// orders the sorted regions of the databases (see lower_bound).
+int compare_line_path(const char *line, const void *key);
+
+struct Textfile;
+
+// Warnings about the contents of the files (malformed records, invalid
+// filters) are printed on stderr, unless the calling thread has installed a
+// handler, which then receives them (see libjumper.c).
+typedef struct WarningHandler {
+  void (*report)(const char *message, void *data);
+  void *data;
+} WarningHandler;
+
+// Install handler for the calling thread, and return the previous one. The
+// default handler, {NULL, NULL}, prints on stderr.
+WarningHandler set_warning_handler(WarningHandler handler);
+
+void report_warning(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+// Warn that the line that has just been read from f is malformed, with its
+// line number.
+void report_invalid_record(struct Textfile *f);
 
 void update_record(Record *rec, long long now, double weight);
 
@@ -15,3 +50,31 @@ char *record_to_string(Record *rec);
 double frecency(double n_visits, double delta);
 
 double visits(double n_visits, double delta);
+
+// Visits in the log domain: log(n_visits) + LONG_DECAY * (last_visit - epoch).
+// All the visits decay at the same rate, so the decayed visits of records
+// compare as their log visits at any time, without computing any decay. The
+// epoch should be a recent time, such as the time of the last compaction, for
+// the log visits to stay small.
+double log_visits(double n_visits, long long last_visit, long long epoch);
+
+// visits(n_visits, now - last_visit), from the log visits of a record.
+double visits_from_log(double log_visits, long long epoch, long long now);
+
+// frecency(n_visits, now - last_visit), from the log visits of a record.
+double frecency_from_log(double log_visits, long long epoch,
+                         long long last_visit, long long now);
+
+// Bound on the error of approximate_frecencies
+#define FRECENCY_ERROR 1e-6
+
+// Frecencies of records[0..n) at time now, up to FRECENCY_ERROR. They are
+// much cheaper to compute than with frecency, to screen the records of a
+// search: the ones that are close to making it to the results then get their
+// exact frecency.
+void approximate_frecencies(const Record *records, int n, long long now,
+                            double *frecencies);
+
+// Raise the "virtual" record bound so that, at any time after their last
+// visits, its frecency is at least the one of rec.
+void bound_record(Record *bound, const Record *rec);
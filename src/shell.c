@@ -2,11 +2,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "jumper.h"
 
 static const char bash_variables[] =
     "[[ -n $__JUMPER_FLAGS ]] || __JUMPER_FLAGS='-cHo -n 500'\n"
     "[[ -n $__JUMPER_ZFLAGS ]] || __JUMPER_ZFLAGS='-o'\n"
-    "[[ -n $__JUMPER_FZF_OPTS ]] || __JUMPER_FZF_OPTS='--height=70%% "
+    "[[ -n $__JUMPER_FZF_OPTS ]] || __JUMPER_FZF_OPTS='--height=70% "
     "--layout=reverse --keep-right --info=hidden --preview-window=hidden "
     "--ansi'\n"
     "if [[ -z $__JUMPER_FZF_FILES_PREVIEW ]]; then\n"
@@ -18,19 +22,42 @@ static const char bash_variables[] =
     "fi\n"
     "[[ -n $__JUMPER_FZF_FOLDERS_PREVIEW ]] || "
     "__JUMPER_FZF_FOLDERS_PREVIEW='ls -1UpC --color=always'\n"
-    "[[ -n $__JUMPER_TOGGLE_PREVIEW ]] || __JUMPER_TOGGLE_PREVIEW='ctrl-p'\n"
+    "[[ -n $__JUMPER_TOGGLE_PREVIEW ]] || __JUMPER_TOGGLE_PREVIEW='ctrl-p'\n";
+
+// Detection of fzf's features, resolved in the cached scripts
+static const char bash_fzf_version[] =
     "__fzf_version=$(fzf --version 2>/dev/null || echo '0.0.0')\n"
-    "__fzf_version=${__fzf_version%%%% *}\n"
-    "__fzf_major=${__fzf_version%%%%.*}\n"
+    "__fzf_version=${__fzf_version%% *}\n"
+    "__fzf_major=${__fzf_version%%.*}\n"
     "__fzf_minor=${__fzf_version#*.}\n"
-    "__fzf_minor=${__fzf_minor%%%%.*}\n"
+    "__fzf_minor=${__fzf_minor%%.*}\n"
     "if [[ $__fzf_major -gt 0 || $__fzf_minor -ge 45 ]]; then\n"
     "  export __JUMPER_HAS_FZF_PROMPT=1\n"
     "else\n"
     "  export __JUMPER_HAS_FZF_PROMPT=0\n"
     "fi\n";
 
-static const char bash_functions[] =
+// Its location is resolved in the cached scripts. Otherwise $PATH is walked
+// by parameter expansions, which spare the startup a fork.
+static const char bash_builtin_path[] =
+    "if [[ -z $__JUMPER_BASH_BUILTIN ]]; then\n"
+    "  __jumper_dirs=$PATH:\n"
+    "  while [[ -n $__jumper_dirs ]]; do\n"
+    "    __jumper_dir=${__jumper_dirs%%:*}\n"
+    "    __jumper_dirs=${__jumper_dirs#*:}\n"
+    "    if [[ -f ${__jumper_dir:-.}/jumper && -x ${__jumper_dir:-.}/jumper ]]; then\n"
+    "      __JUMPER_BASH_BUILTIN=\"${__jumper_dir%/*}/lib/bash/jumper.so\"\n"
+    "      break\n"
+    "    fi\n"
+    "  done\n"
+    "  unset __jumper_dirs __jumper_dir\n"
+    "fi\n";
+
+static const char bash_builtin[] =
+    "[[ -f $__JUMPER_BASH_BUILTIN ]] && enable -f \"$__JUMPER_BASH_BUILTIN\" "
+    "jumper 2>/dev/null\n";
+
+static const char *const bash_functions[] = {
     "z() {\n"
     "  if [[ $# -eq 0 ]]; then\n"
     "    cd\n"
@@ -54,6 +81,30 @@ static const char bash_functions[] =
     "    $EDITOR \"${file}\"\n"
     "  fi\n"
     "}\n"
+    "__jumper_serve_start() {\n"
+    "  __jumper_server=$(mktemp -d \"${TMPDIR:-/tmp}/jumper.XXXXXX\") || return 1\n"
+    "  if ! mkfifo \"$__jumper_server/in\" \"$__jumper_server/out\"; then\n"
+    "    rm -rf \"$__jumper_server\"\n"
+    "    return 1\n"
+    "  fi\n"
+    "  # The server stops when the shell closes its input, even if the shell is\n"
+    "  # killed: it then removes the directory\n"
+    "  { trap '' HUP\n"
+    "    jumper find --serve-stdin <\"$__jumper_server/in\" >\"$__jumper_server/out\" 2>/dev/null\n"
+    "    rm -rf \"$__jumper_server\"; } &\n"
+    "  exec 7>\"$__jumper_server/in\" 8<\"$__jumper_server/out\"\n"
+    "  cat >\"$__jumper_server/query\" <<'EOF'\n"
+    "eval \"query=\\${$#}\"\n"
+    "options=\n"
+    "while [ $# -gt 2 ]; do options=\"$options $1\"; shift; done\n"
+    "printf '%s\\n' \"#$$$options -- $query\" >\"${0%/*}/in\"\n"
+    "exec sed -n \"/^#$$\\$/,/^\\$/{ /^#/d; /^\\$/q; p; }\" <\"${0%/*}/out\"\n"
+    "EOF\n"
+    "}\n"
+    "__jumper_serve_stop() {\n"
+    "  exec 7>&- 8<&-\n"
+    "  rm -rf \"$__jumper_server\"\n"
+    "}\n"
     "__jumper_fzf() {\n"
     "  if [[ $1 == 'directories' ]]; then\n"
     "    preview=\"${__JUMPER_FZF_FOLDERS_PREVIEW}\"\n"
@@ -61,23 +112,35 @@ static const char bash_functions[] =
     "    preview=\"${__JUMPER_FZF_FILES_PREVIEW}\"\n"
     "  fi\n"
     "  if [[ $__JUMPER_HAS_FZF_PROMPT == 1 ]]; then\n"
+    "    # Queries are answered by a server, that keeps the databases in memory\n"
+    "    find='jumper find'\n"
+    "    __jumper_serve_start && find=\"sh $__jumper_server/query\"\n"
     "    selected=$(fzf ${__JUMPER_FZF_OPTS} --disabled --query \"$2\" \\\n"
     "      --prompt \"$1> \" \\\n"
     "      --preview \"eval x={}; ${preview} \\$x\" \\\n"
     "      --bind \"${__JUMPER_TOGGLE_PREVIEW}:toggle-preview\" \\\n"
-    "      --bind \"start:reload:jumper find --type=${1:0:1} ${__JUMPER_FLAGS} {q}\" \\\n"
-    "      --bind \"change:reload:sleep 0.01; p={fzf:prompt}; jumper find --type=\\${p:0:1} ${__JUMPER_FLAGS} {q} || true\" \\\n"
-    "      --bind \"ctrl-u:change-prompt(files> )+reload(jumper find --type=f ${__JUMPER_FLAGS} {q})\" \\\n"
-    "      --bind \"ctrl-y:change-prompt(directories> )+reload(jumper find --type=d ${__JUMPER_FLAGS} {q})\" \\\n"
-    "      --bind \"enter:become(echo {fzf:prompt}{})\")\n"
+    "      --bind \"start:reload:${find} --type=${1:0:1} ${__JUMPER_FLAGS} -- {q}\" \\\n"
+    "      --bind \"change:reload:sleep 0.01; p={fzf:prompt}; ${find} --type=\\${p:0:1} ${__JUMPER_FLAGS} -- {q} || true\" \\\n"
+    "      --bind \"ctrl-u:change-prompt(files> )+reload(${find} --type=f ${__JUMPER_FLAGS} -- {q})\" \\\n"
+    "      --bind \"ctrl-y:change-prompt(directories> )+reload(${find} --type=d ${__JUMPER_FLAGS} -- {q})\" \\\n"
+    "      --bind \"enter:become(printf '%s\\n' {q} {fzf:prompt}{})\")\n"
+    "    __jumper_serve_stop\n"
     "  else\n"
     "    selected=$(fzf ${__JUMPER_FZF_OPTS} --disabled --query \"$2\" \\\n"
-    "      --prompt \"$1> \" \\\n"
+    "      --prompt \"$1> \" --print-query \\\n"
     "      --preview \"eval x={}; ${preview} \\$x\" \\\n"
     "      --bind \"${__JUMPER_TOGGLE_PREVIEW}:toggle-preview\" \\\n"
     "      --bind \"start:reload:jumper find --type=${1:0:1} ${__JUMPER_FLAGS} {q}\" \\\n"
     "      --bind \"change:reload:sleep 0.01; jumper find --type=${1:0:1} ${__JUMPER_FLAGS} {q} || true\")\n"
     "  fi\n"
+    "  # The query comes first, on its own line\n"
+    "  query=\"\"\n"
+    "  if [[ $selected == *$'\\n'* ]]; then\n"
+    "    query=\"${selected%%$'\\n'*}\"\n"
+    "    selected=\"${selected#*$'\\n'}\"\n"
+    "  else\n"
+    "    selected=\"\"\n"
+    "  fi\n"
     "  actual_selection=\"\"\n"
     "  if [[ -n $selected ]]; then\n"
     "    if [[ $__JUMPER_HAS_FZF_PROMPT == 1 ]]; then\n"
@@ -94,7 +157,8 @@ static const char bash_functions[] =
     "    fi\n"
     "    if [[ -n $actual_selection ]]; then\n"
     "      expanded=\"${actual_selection/#\\~/$HOME}\"\n"
-    "      jumper update --type=\"$actual_type\" -w 0.3 \"$expanded\"\n"
+    "      jumper update --type=\"$actual_type\" -w 0.3 ${__JUMPER_ZFLAGS} \\\n"
+    "        --query=\"$query\" \"$expanded\"\n"
     "    fi\n"
     "  fi\n"
     "  echo \"$actual_selection\"\n"
@@ -105,7 +169,7 @@ static const char bash_functions[] =
     "  if [[ -n $new_path ]]; then\n"
     "    cd \"${new_path/#\\~/$HOME}\"\n"
     "  fi\n"
-    "}\n"
+    "}\n",
     "zfi() {\n"
     "  args=\"${@// /\\ }\"\n"
     "  file=$(__jumper_fzf 'files' \"$args\")\n"
@@ -113,33 +177,8 @@ static const char bash_functions[] =
     "    $EDITOR \"${file/#\\~/$HOME}\"\n"
     "  fi\n"
     "}\n"
-    "__jumper_delete_duplicate_symlinks(){\n"
-    "  tempfile=\"${__JUMPER_FOLDERS}_temp\"\n"
-    "  cp \"${__JUMPER_FOLDERS}\" \"${tempfile}\"\n"
-    "  while IFS= read -r line ; do\n"
-    "    entry=\"${line%%%%|*}\"\n"
-    "    real=$(realpath \"$entry\")\n"
-    "    if [[ $entry != $real ]]; then\n"
-    "      sed -i -e \"\\:^${real}|:d\" \"${tempfile}\"\n"
-    "    fi\n"
-    "  done < \"${__JUMPER_FOLDERS}\"\n"
-    "  mv \"${tempfile}\" \"${__JUMPER_FOLDERS}\"\n"
-    "}\n"
-    "__jumper_replace_symlinks(){\n"
-    "  tempfile=\"${__JUMPER_FOLDERS}_temp\"\n"
-    "  cp \"${__JUMPER_FOLDERS}\" \"${tempfile}\"\n"
-    "  while IFS= read -r line ; do\n"
-    "    entry=\"${line%%%%|*}\"\n"
-    "    real=$(realpath \"$entry\")\n"
-    "    if [[ $entry != $real ]]; then\n"
-    "      sed -i -e \"s:^${real}/:${entry}/:g\" \"${tempfile}\"\n"
-    "    fi\n"
-    "  done < \"${__JUMPER_FOLDERS}\"\n"
-    "  mv \"${tempfile}\" \"${__JUMPER_FOLDERS}\"\n"
-    "}\n"
     "__jumper_clean_symlinks(){\n"
-    "  __jumper_delete_duplicate_symlinks\n"
-    "  __jumper_replace_symlinks\n"
+    "  jumper clean --type=directories --canonicalize\n"
     "}\n"
     "__jumper_update_db() {\n"
     "  if [[ -n $__jumper_current_folder ]]; then\n"
@@ -150,9 +189,9 @@ static const char bash_functions[] =
     "    fi\n"
     "  fi\n"
     "  __jumper_current_folder=$PWD\n"
-    "  if [[ -n $__JUMPER_CLEAN_FREQ ]] && [[ $(( RANDOM %% "
+    "  if [[ -n $__JUMPER_CLEAN_FREQ ]] && [[ $(( RANDOM % "
     "__JUMPER_CLEAN_FREQ )) == 0 ]]; then\n"
-    "    jumper clean > /dev/null 2>&1\n"
+    "    jumper clean --incremental > /dev/null 2>&1\n"
     "  fi\n"
     "}\n"
     "jumper-find-dir() {\n"
@@ -166,7 +205,8 @@ static const char bash_functions[] =
     "  pre=\"${READLINE_LINE:0:$READLINE_POINT}\"\n"
     "  READLINE_LINE=\"${pre}$selected${READLINE_LINE:$READLINE_POINT}\"\n"
     "  READLINE_POINT=$(( READLINE_POINT + ${#selected} ))\n"
-    "}\n";
+    "}\n",
+    NULL};
 
 static const char bash_completions[] =
     "_z_completion() {\n"
@@ -195,7 +235,7 @@ static const char bash_prompt[] =
 static const char zsh_variables[] =
     "[[ -n $__JUMPER_FLAGS ]] || __JUMPER_FLAGS='-cHo -n 500'\n"
     "[[ -n $__JUMPER_ZFLAGS ]] || __JUMPER_ZFLAGS='-o'\n"
-    "[[ -n $__JUMPER_FZF_OPTS ]] || __JUMPER_FZF_OPTS=(--height=70%% "
+    "[[ -n $__JUMPER_FZF_OPTS ]] || __JUMPER_FZF_OPTS=(--height=70% "
     "--layout=reverse --keep-right --info=hidden --preview-window=hidden "
     "--ansi)\n"
     "if [[ -z $__JUMPER_FZF_FILES_PREVIEW ]]; then\n"
@@ -207,19 +247,11 @@ static const char zsh_variables[] =
     "fi\n"
     "[[ -n $__JUMPER_FZF_FOLDERS_PREVIEW ]] || "
     "__JUMPER_FZF_FOLDERS_PREVIEW='ls -1UpC --color=always'\n"
-    "[[ -n $__JUMPER_TOGGLE_PREVIEW ]] || __JUMPER_TOGGLE_PREVIEW='ctrl-p'\n"
-    "__fzf_version=$(fzf --version 2>/dev/null || echo '0.0.0')\n"
-    "__fzf_version=${__fzf_version%%%% *}\n"
-    "__fzf_major=${__fzf_version%%%%.*}\n"
-    "__fzf_minor=${__fzf_version#*.}\n"
-    "__fzf_minor=${__fzf_minor%%%%.*}\n"
-    "if [[ $__fzf_major -gt 0 || $__fzf_minor -ge 45 ]]; then\n"
-    "  export __JUMPER_HAS_FZF_PROMPT=1\n"
-    "else\n"
-    "  export __JUMPER_HAS_FZF_PROMPT=0\n"
-    "fi\n";
+    "[[ -n $__JUMPER_TOGGLE_PREVIEW ]] || __JUMPER_TOGGLE_PREVIEW='ctrl-p'\n";
 
-static const char zsh_functions[] =
+static const char zsh_builtin[] = "zmodload jumper/jumper 2>/dev/null\n";
+
+static const char *const zsh_functions[] = {
     "z() {\n"
     "  if [[ $# -eq 0 ]]; then\n"
     "    cd\n"
@@ -243,6 +275,30 @@ static const char zsh_functions[] =
     "    $EDITOR \"${file}\"\n"
     "  fi\n"
     "}\n"
+    "__jumper_serve_start() {\n"
+    "  __jumper_server=$(mktemp -d \"${TMPDIR:-/tmp}/jumper.XXXXXX\") || return 1\n"
+    "  if ! mkfifo \"$__jumper_server/in\" \"$__jumper_server/out\"; then\n"
+    "    rm -rf \"$__jumper_server\"\n"
+    "    return 1\n"
+    "  fi\n"
+    "  # The server stops when the shell closes its input, even if the shell is\n"
+    "  # killed: it then removes the directory\n"
+    "  { trap '' HUP\n"
+    "    jumper find --serve-stdin <\"$__jumper_server/in\" >\"$__jumper_server/out\" 2>/dev/null\n"
+    "    rm -rf \"$__jumper_server\"; } &\n"
+    "  exec 7>\"$__jumper_server/in\" 8<\"$__jumper_server/out\"\n"
+    "  cat >\"$__jumper_server/query\" <<'EOF'\n"
+    "eval \"query=\\${$#}\"\n"
+    "options=\n"
+    "while [ $# -gt 2 ]; do options=\"$options $1\"; shift; done\n"
+    "printf '%s\\n' \"#$$$options -- $query\" >\"${0%/*}/in\"\n"
+    "exec sed -n \"/^#$$\\$/,/^\\$/{ /^#/d; /^\\$/q; p; }\" <\"${0%/*}/out\"\n"
+    "EOF\n"
+    "}\n"
+    "__jumper_serve_stop() {\n"
+    "  exec 7>&- 8<&-\n"
+    "  rm -rf \"$__jumper_server\"\n"
+    "}\n"
     "__jumper_fzf() {\n"
     "  if [[ $1 == 'directories' ]]; then\n"
     "    preview=\"${__JUMPER_FZF_FOLDERS_PREVIEW}\"\n"
@@ -250,23 +306,35 @@ static const char zsh_functions[] =
     "    preview=\"${__JUMPER_FZF_FILES_PREVIEW}\"\n"
     "  fi\n"
     "  if [[ $__JUMPER_HAS_FZF_PROMPT == 1 ]]; then\n"
+    "    # Queries are answered by a server, that keeps the databases in memory\n"
+    "    find='jumper find'\n"
+    "    __jumper_serve_start && find=\"sh $__jumper_server/query\"\n"
     "    selected=$(fzf ${__JUMPER_FZF_OPTS} --disabled --query \"$2\" \\\n"
     "      --prompt \"$1> \" \\\n"
     "      --preview \"eval x={}; ${preview} \\$x\" \\\n"
     "      --bind \"${__JUMPER_TOGGLE_PREVIEW}:toggle-preview\" \\\n"
-    "      --bind \"start:reload:jumper find --type=${1:0:1} ${__JUMPER_FLAGS} {q}\" \\\n"
-    "      --bind \"change:reload:sleep 0.01; p={fzf:prompt}; jumper find --type=\\${p:0:1} ${__JUMPER_FLAGS} {q} || true\" \\\n"
-    "      --bind \"ctrl-u:change-prompt(files> )+reload(jumper find --type=f ${__JUMPER_FLAGS} {q})\" \\\n"
-    "      --bind \"ctrl-y:change-prompt(directories> )+reload(jumper find --type=d ${__JUMPER_FLAGS} {q})\" \\\n"
-    "      --bind \"enter:become(echo {fzf:prompt}{})\")\n"
+    "      --bind \"start:reload:${find} --type=${1:0:1} ${__JUMPER_FLAGS} -- {q}\" \\\n"
+    "      --bind \"change:reload:sleep 0.01; p={fzf:prompt}; ${find} --type=\\${p:0:1} ${__JUMPER_FLAGS} -- {q} || true\" \\\n"
+    "      --bind \"ctrl-u:change-prompt(files> )+reload(${find} --type=f ${__JUMPER_FLAGS} -- {q})\" \\\n"
+    "      --bind \"ctrl-y:change-prompt(directories> )+reload(${find} --type=d ${__JUMPER_FLAGS} -- {q})\" \\\n"
+    "      --bind \"enter:become(printf '%s\\n' {q} {fzf:prompt}{})\")\n"
+    "    __jumper_serve_stop\n"
     "  else\n"
     "    selected=$(fzf ${__JUMPER_FZF_OPTS} --disabled --query \"$2\" \\\n"
-    "      --prompt \"$1> \" \\\n"
+    "      --prompt \"$1> \" --print-query \\\n"
     "      --preview \"eval x={}; ${preview} \\$x\" \\\n"
     "      --bind \"${__JUMPER_TOGGLE_PREVIEW}:toggle-preview\" \\\n"
     "      --bind \"start:reload:jumper find --type=${1:0:1} ${__JUMPER_FLAGS} {q}\" \\\n"
     "      --bind \"change:reload:sleep 0.01; jumper find --type=${1:0:1} ${__JUMPER_FLAGS} {q} || true\")\n"
     "  fi\n"
+    "  # The query comes first, on its own line\n"
+    "  query=\"\"\n"
+    "  if [[ $selected == *$'\\n'* ]]; then\n"
+    "    query=\"${selected%%$'\\n'*}\"\n"
+    "    selected=\"${selected#*$'\\n'}\"\n"
+    "  else\n"
+    "    selected=\"\"\n"
+    "  fi\n"
     "  actual_selection=\"\"\n"
     "  if [[ -n $selected ]]; then\n"
     "    if [[ $__JUMPER_HAS_FZF_PROMPT == 1 ]]; then\n"
@@ -283,7 +351,8 @@ static const char zsh_functions[] =
     "    fi\n"
     "    if [[ -n $actual_selection ]]; then\n"
     "      expanded=\"${actual_selection/#\\~/$HOME}\"\n"
-    "      jumper update --type=\"$actual_type\" -w 0.3 \"$expanded\"\n"
+    "      jumper update --type=\"$actual_type\" -w 0.3 ${__JUMPER_ZFLAGS} \\\n"
+    "        --query=\"$query\" \"$expanded\"\n"
     "    fi\n"
     "  fi\n"
     "  echo $actual_selection\n"
@@ -295,7 +364,7 @@ static const char zsh_functions[] =
     "    # Manually perform tilde expansion\n"
     "    cd \"${new_path/#\\~/$HOME}\"\n"
     "  fi\n"
-    "}\n"
+    "}\n",
     "zfi() {\n"
     "  args=\"${@// /\\ }\"\n"
     "  file=$(__jumper_fzf 'files' \"$args\")\n"
@@ -304,33 +373,8 @@ static const char zsh_functions[] =
     "    $EDITOR \"${file/#\\~/$HOME}\"\n"
     "  fi\n"
     "}\n"
-    "__jumper_delete_duplicate_symlinks(){\n"
-    "  tempfile=\"${__JUMPER_FOLDERS}_temp\"\n"
-    "  cp \"${__JUMPER_FOLDERS}\" \"${tempfile}\"\n"
-    "  while IFS= read -r line ; do\n"
-    "    entry=\"${line%%%%|*}\"\n"
-    "    real=$(realpath \"$entry\")\n"
-    "    if [[ $entry != $real ]]; then\n"
-    "      sed -i -e \"\\:^${real}|:d\" \"${tempfile}\"\n"
-    "    fi\n"
-    "  done < \"${__JUMPER_FOLDERS}\"\n"
-    "  mv \"${tempfile}\" \"${__JUMPER_FOLDERS}\"\n"
-    "}\n"
-    "__jumper_replace_symlinks(){\n"
-    "  tempfile=\"${__JUMPER_FOLDERS}_temp\"\n"
-    "  cp \"${__JUMPER_FOLDERS}\" \"${tempfile}\"\n"
-    "  while IFS= read -r line ; do\n"
-    "    entry=\"${line%%%%|*}\"\n"
-    "    real=$(realpath \"$entry\")\n"
-    "    if [[ $entry != $real ]]; then\n"
-    "      sed -i -e \"s:^${real}/:${entry}/:g\" \"${tempfile}\"\n"
-    "    fi\n"
-    "  done < \"${__JUMPER_FOLDERS}\"\n"
-    "  mv \"${tempfile}\" \"${__JUMPER_FOLDERS}\"\n"
-    "}\n"
     "__jumper_clean_symlinks(){\n"
-    "  __jumper_delete_duplicate_symlinks\n"
-    "  __jumper_replace_symlinks\n"
+    "  jumper clean --type=directories --canonicalize\n"
     "}\n"
     "__jumper_update_db() {\n"
     "  if [[ ! -z $__jumper_current_folder ]]; then\n"
@@ -343,10 +387,10 @@ static const char zsh_functions[] =
     "    fi\n"
     "  fi\n"
     "  __jumper_current_folder=$PWD\n"
-    "  # Remove files and folders that do not exist anymore\n"
-    "  if [[ -n $__JUMPER_CLEAN_FREQ ]] && [[ $(( RANDOM %% "
+    "  # Remove files and folders that do not exist anymore (a few at a time)\n"
+    "  if [[ -n $__JUMPER_CLEAN_FREQ ]] && [[ $(( RANDOM % "
     "__JUMPER_CLEAN_FREQ )) == 0 ]]; then\n"
-    "    jumper clean > /dev/null 2>&1\n"
+    "    jumper clean --incremental > /dev/null 2>&1\n"
     "  fi\n"
     "}\n"
     "jumper-find-dir() {\n"
@@ -358,7 +402,8 @@ static const char zsh_functions[] =
     "  selected=$(__jumper_fzf 'files')\n"
     "  LBUFFER=\"${LBUFFER}${selected}\"\n"
     "  zle reset-prompt\n"
-    "}\n";
+    "}\n",
+    NULL};
 
 static const char zsh_completions[] =
     "if ! type compdef >/dev/null 2>&1; then\n"
@@ -398,7 +443,7 @@ static const char fish_variables[] =
     "  set __JUMPER_ZFLAGS '-o'\n"
     "end\n"
     "if not set -q __JUMPER_FZF_OPTS\n"
-    "  set __JUMPER_FZF_OPTS --info=hidden --height=70%% --layout=reverse "
+    "  set __JUMPER_FZF_OPTS --info=hidden --height=70% --layout=reverse "
     "--keep-right "
     "--preview-window=hidden --ansi\n"
     "end\n"
@@ -424,7 +469,7 @@ static const char fish_variables[] =
     "  set -gx __JUMPER_HAS_FZF_PROMPT 0\n"
     "end\n";
 
-static const char fish_functions[] =
+static const char *const fish_functions[] = {
     "function jumper_update_db --on-event fish_postexec\n"
     "  if set -q __jumper_current_folder\n"
     "    if [ $__jumper_current_folder != $PWD ]\n"
@@ -436,9 +481,9 @@ static const char fish_functions[] =
     "    end\n"
     "  end\n"
     "  set -g __jumper_current_folder \"$PWD\"\n"
-    "  if [ -n \"$__JUMPER_CLEAN_FREQ\" ] && [ (math (random) %% "
+    "  if [ -n \"$__JUMPER_CLEAN_FREQ\" ] && [ (math (random) % "
     "$__JUMPER_CLEAN_FREQ) -eq 0 ]\n"
-    "    jumper clean > /dev/null 2>&1\n"
+    "    jumper clean --incremental > /dev/null 2>&1\n"
     "  end\n"
     "end\n"
     "function z -d \"Jump to folder\"\n"
@@ -480,16 +525,24 @@ static const char fish_functions[] =
     "        --bind \"change:reload:sleep 0.01; p={fzf:prompt}; t=\\${p:0:1}; jumper find --type=\\$t $__JUMPER_FLAGS {q} || true\" \\\n"
     "        --bind \"ctrl-u:change-prompt(files> )+reload(jumper find --type=f $__JUMPER_FLAGS {q})\" \\\n"
     "        --bind \"ctrl-y:change-prompt(directories> )+reload(jumper find --type=d $__JUMPER_FLAGS {q})\" \\\n"
-    "        --bind \"enter:become(echo {fzf:prompt}{})\")\n"
+    "        --bind \"enter:become(printf '%s\\n' {q} {fzf:prompt}{})\")\n"
     "  else\n"
     "    set selected (fzf $__JUMPER_FZF_OPTS --disabled --query \"$argv[2]\" "
     "\\\n"
-    "        --prompt \"$argv[1]> \" \\\n"
+    "        --prompt \"$argv[1]> \" --print-query \\\n"
     "        --preview \"eval set -l x {}; $preview \\$x\" \\\n"
     "        --bind \"$__JUMPER_TOGGLE_PREVIEW:toggle-preview\" \\\n"
     "        --bind \"start:reload:jumper find --type=$type_char $__JUMPER_FLAGS {q}\" \\\n"
     "        --bind \"change:reload:sleep 0.01; jumper find --type=$type_char $__JUMPER_FLAGS {q} || true\")\n"
     "  end\n"
+    "  # The query comes first, on its own line\n"
+    "  set -l query ''\n"
+    "  if test (count $selected) -eq 2\n"
+    "    set query $selected[1]\n"
+    "    set selected $selected[2]\n"
+    "  else\n"
+    "    set selected ''\n"
+    "  end\n"
     "  set actual_selection ''\n"
     "  if [ -n \"$selected\" ]\n"
     "    if test $__JUMPER_HAS_FZF_PROMPT -eq 1\n"
@@ -506,7 +559,8 @@ static const char fish_functions[] =
     "    end\n"
     "    if [ -n \"$actual_selection\" ]\n"
     "      set new_path (string replace '~' $HOME $actual_selection)\n"
-    "      jumper update --type=$actual_type -w 0.3 \"$new_path\"\n"
+    "      jumper update --type=$actual_type -w 0.3 $__JUMPER_ZFLAGS \\\n"
+    "        --query=\"$query\" \"$new_path\"\n"
     "    end\n"
     "  end\n"
     "  echo $actual_selection\n"
@@ -524,7 +578,7 @@ static const char fish_functions[] =
     "    set file (string replace '~' $HOME $file)\n"
     "    $EDITOR \"$file\"\n"
     "  end\n"
-    "end\n"
+    "end\n",
     "function jumper-find-dir -d \"Fuzzy-find directories\"\n"
     "  set -l commandline (commandline -t)\n"
     "  set result (__jumper_fzf 'directories')\n"
@@ -540,31 +594,273 @@ static const char fish_functions[] =
     "      commandline -it -- $result\n"
     "  end\n"
     "  commandline -f repaint\n"
-    "end\n";
+    "end\n",
+    NULL};
 
 static const char fish_bindings[] = "bind \\cy jumper-find-dir\n"
                                     "bind \\cu jumper-find-file\n";
 
-void shell_setup(const char *shell, bool no_bind) {
-  if (strcmp(shell, "bash") == 0) {
-    printf(bash_variables);
-    printf(bash_functions);
-    printf(bash_completions);
-    if (!no_bind) printf(bash_bindings);
-    printf(bash_prompt);
-  } else if (strcmp(shell, "zsh") == 0) {
-    printf(zsh_variables);
-    printf(zsh_functions);
-    printf(zsh_completions);
-    if (!no_bind) printf(zsh_bindings);
-    printf(zsh_prompt);
-  } else if (strcmp(shell, "fish") == 0) {
-    printf(fish_variables);
-    printf(fish_functions);
-    if (!no_bind) printf(fish_bindings);
+// Scripts of a shell, in the order of its setup
+typedef struct Setup {
+  const char *name;
+  const char *variables;
+  const char *fzf_version; // NULL if it is part of the variables
+  const char *builtin_path;
+  const char *builtin_variable; // holding the path of the builtin
+  const char *builtin;
+  // NULL-terminated: ISO C only guarantees string literals of 4095 characters
+  const char *const *functions;
+  const char *completions;
+  const char *bindings;
+  const char *prompt;
+  // Whether fzf is installed, without running any process (NULL if the
+  // scripts can not be cached)
+  const char *has_fzf;
+} Setup;
+
+static const Setup setups[] = {
+    {"bash", bash_variables, bash_fzf_version, bash_builtin_path,
+     "__JUMPER_BASH_BUILTIN", bash_builtin, bash_functions, bash_completions,
+     bash_bindings, bash_prompt, "hash fzf 2>/dev/null"},
+    {"zsh", zsh_variables, bash_fzf_version, NULL, NULL, zsh_builtin,
+     zsh_functions, zsh_completions, zsh_bindings, zsh_prompt,
+     "(( $+commands[fzf] ))"},
+    {"fish", fish_variables, NULL, NULL, NULL, NULL, fish_functions, NULL,
+     fish_bindings, NULL, NULL},
+};
+
+// What the cached scripts find out at startup otherwise
+typedef struct Resolved {
+  char *jumper; // paths in $PATH, NULL if not found
+  char *fzf;
+  bool fzf_prompt; // fzf supports {fzf:prompt} (0.45 and later)
+  char *builtin;   // path of the builtin of bash (whether it exists or not)
+} Resolved;
+
+// Path of the executable name in $PATH (to be freed), NULL if there is none.
+static char *find_in_path(const char *name) {
+  const char *path = getenv("PATH");
+  if (!path) {
+    return NULL;
+  }
+  while (true) {
+    const size_t len = strcspn(path, ":");
+    // Relative directories are skipped: the cache is sourced from anywhere
+    if (path[0] == '/') {
+      const size_t n = len + strlen(name) + 2;
+      char *file = (char *)malloc(n);
+      if (!file) {
+        return NULL;
+      }
+      snprintf(file, n, "%.*s/%s", (int)len, path, name);
+      struct stat st;
+      if (stat(file, &st) == 0 && S_ISREG(st.st_mode) &&
+          access(file, X_OK) == 0) {
+        return file;
+      }
+      free(file);
+    }
+    if (path[len] == '\0') {
+      return NULL;
+    }
+    path += len + 1;
+  }
+}
+
+static bool fzf_has_prompt(void) {
+  FILE *fp = popen("fzf --version 2>/dev/null", "r");
+  if (!fp) {
+    return false;
+  }
+  int major = 0, minor = 0;
+  const bool parsed = fscanf(fp, "%d.%d", &major, &minor) == 2;
+  pclose(fp);
+  return parsed && (major > 0 || minor >= 45);
+}
+
+static void resolve(Resolved *resolved) {
+  resolved->jumper = find_in_path("jumper");
+  resolved->fzf = find_in_path("fzf");
+  resolved->fzf_prompt = resolved->fzf && fzf_has_prompt();
+  resolved->builtin = NULL;
+  if (resolved->jumper) {
+    // Installed in <prefix>/bin, and the builtin in <prefix>/lib/bash
+    char *prefix = strdup(resolved->jumper);
+    for (int i = 0; prefix && i < 2; i++) {
+      char *slash = strrchr(prefix, '/');
+      if (slash) {
+        *slash = '\0';
+      }
+    }
+    if (prefix) {
+      const size_t n = strlen(prefix) + 32;
+      resolved->builtin = (char *)malloc(n);
+      if (resolved->builtin) {
+        snprintf(resolved->builtin, n, "%s/lib/bash/jumper.so", prefix);
+      }
+    }
+    free(prefix);
+  }
+}
+
+static void resolved_free(Resolved *resolved) {
+  free(resolved->jumper);
+  free(resolved->fzf);
+  free(resolved->builtin);
+}
+
+// Write string in single quotes, for bash and zsh.
+static void write_quoted(FILE *out, const char *string) {
+  fputc('\'', out);
+  for (const char *c = string; *c != '\0'; c++) {
+    if (*c == '\'') {
+      fputs("'\\''", out);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('\'', out);
+}
+
+static void write_setup(FILE *out, const Setup *setup, bool no_bind,
+                        const Resolved *resolved) {
+  fputs(setup->variables, out);
+  if (resolved && setup->fzf_version) {
+    fprintf(out, "export __JUMPER_HAS_FZF_PROMPT=%d\n", resolved->fzf_prompt);
+  } else if (setup->fzf_version) {
+    fputs(setup->fzf_version, out);
+  }
+  if (resolved && setup->builtin_path && resolved->builtin) {
+    fprintf(out, "[[ -n $%s ]] || %s=", setup->builtin_variable,
+            setup->builtin_variable);
+    write_quoted(out, resolved->builtin);
+    fputc('\n', out);
+  } else if (setup->builtin_path) {
+    fputs(setup->builtin_path, out);
+  }
+  if (setup->builtin) {
+    fputs(setup->builtin, out);
+  }
+  for (const char *const *part = setup->functions; *part; part++) {
+    fputs(*part, out);
+  }
+  if (setup->completions) {
+    fputs(setup->completions, out);
+  }
+  if (!no_bind) {
+    fputs(setup->bindings, out);
+  }
+  if (setup->prompt) {
+    fputs(setup->prompt, out);
+  }
+}
+
+// $XDG_CACHE_HOME/jumper/init[-no-bind].<shell> (to be freed), whose
+// directories are created. NULL if there is no cache directory.
+static char *cache_path(const char *shell, bool no_bind) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char base[4096];
+  if (xdg && *xdg != '\0') {
+    snprintf(base, sizeof(base), "%s", xdg);
+  } else if (home) {
+    snprintf(base, sizeof(base), "%s/.cache", home);
   } else {
+    return NULL;
+  }
+  mkdir(base, 0755);
+  const size_t n = strlen(base) + strlen(shell) + 32;
+  char *path = (char *)malloc(n);
+  if (!path) {
+    return NULL;
+  }
+  snprintf(path, n, "%s/jumper", base);
+  mkdir(path, 0755);
+  snprintf(path, n, "%s/jumper/init%s.%s", base, no_bind ? "-no-bind" : "",
+           shell);
+  return path;
+}
+
+// The cached script starts by checking, with tests built in the shell, that
+// neither jumper nor fzf have been updated (or installed) since it was made.
+// Otherwise, it is made again.
+static void write_guard(FILE *out, const Setup *setup, bool no_bind,
+                        const Resolved *resolved, const char *path) {
+  fprintf(out, "# Made by `jumper shell %s --cache`\nif ", setup->name);
+  if (resolved->jumper) {
+    fputs("[[ ", out);
+    write_quoted(out, resolved->jumper);
+    fputs(" -nt ", out);
+    write_quoted(out, path);
+    fputs(" ]] || ", out);
+  }
+  if (resolved->fzf) {
+    fputs("[[ ", out);
+    write_quoted(out, resolved->fzf);
+    fputs(" -nt ", out);
+    write_quoted(out, path);
+    fputs(" ]]", out);
+  } else {
+    fputs(setup->has_fzf, out);
+  }
+  fprintf(out, "; then\n  eval \"$(jumper shell %s --cache%s)\"\n  return\nfi\n",
+          setup->name, no_bind ? " --no-bind" : "");
+}
+
+// Save the setup to its cache, atomically. Prints an error if it fails.
+static void cache_setup(const Setup *setup, bool no_bind,
+                        const Resolved *resolved) {
+  char *path = cache_path(setup->name, no_bind);
+  if (!path) {
+    fprintf(stderr, "ERROR: no cache directory ($XDG_CACHE_HOME or $HOME).\n");
+    return;
+  }
+  const size_t n = strlen(path) + 32;
+  char *tempname = (char *)malloc(n);
+  FILE *fp = NULL;
+  if (tempname) {
+    snprintf(tempname, n, "%s.%ld", path, (long)getpid());
+    fp = fopen(tempname, "w");
+  }
+  if (!fp) {
+    fprintf(stderr, "ERROR: Couldn't write the cached setup %s.\n", path);
+    free(tempname);
+    free(path);
+    return;
+  }
+  write_guard(fp, setup, no_bind, resolved, path);
+  write_setup(fp, setup, no_bind, resolved);
+  if (fclose(fp) != 0 || rename(tempname, path) != 0) {
+    fprintf(stderr, "ERROR: Couldn't write the cached setup %s.\n", path);
+    unlink(tempname);
+  }
+  free(tempname);
+  free(path);
+}
+
+void shell_setup(const char *shell, bool no_bind, bool cache) {
+  const Setup *setup = NULL;
+  for (size_t i = 0; i < sizeof(setups) / sizeof(*setups); i++) {
+    if (strcmp(shell, setups[i].name) == 0) {
+      setup = setups + i;
+    }
+  }
+  if (!setup) {
     fprintf(stderr, "ERROR: Invalid argument for shell: %s.\n", shell);
     fprintf(stderr, "Accepted arguments: bash, zsh, fish.\n");
-    exit(EXIT_FAILURE);
+    jumper_exit(EXIT_FAILURE);
+  }
+  if (cache && !setup->has_fzf) {
+    fprintf(stderr, "ERROR: --cache only supports bash and zsh.\n");
+    jumper_exit(EXIT_FAILURE);
+  }
+  if (!cache) {
+    write_setup(stdout, setup, no_bind, NULL);
+    return;
   }
+  Resolved resolved;
+  resolve(&resolved);
+  cache_setup(setup, no_bind, &resolved);
+  write_setup(stdout, setup, no_bind, &resolved);
+  resolved_free(&resolved);
 }
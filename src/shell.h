@@ -1,3 +1,5 @@
 #pragma once
 
-void shell_setup(const char *shell, bool no_bind);
+// Print the setup script of shell. With cache, it is also saved, resolved,
+// to $XDG_CACHE_HOME/jumper (bash and zsh).
+void shell_setup(const char *shell, bool no_bind, bool cache);
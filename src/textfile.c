@@ -2,36 +2,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "textfile.h"
 
+// Initial size of the buffer of the files opened for reading: it grows with
+// the longest line.
+#define BLOCK_SIZE (1 << 16)
+
 Textfile *file_open(const char *path) {
   Textfile *f = (Textfile *)malloc(sizeof(Textfile));
+  if (!f) {
+    return NULL;
+  }
   f->fp = fopen(path, "r");
   if (!f->fp) {
 	  free(f);
 	  return NULL;
   }
+  f->path = strdup(path);
+  f->capacity = BLOCK_SIZE;
+  // With room for the '\0' after a last line that does not end with '\n'
+  f->buffer = (char *)malloc(f->capacity + 1);
+  if (!f->path || !f->buffer) {
+    fclose(f->fp);
+    free(f->path);
+    free(f->buffer);
+    free(f);
+    return NULL;
+  }
   f->line = NULL;
   f->len = 0;
+  f->length = 0;
+  f->size = 0;
+  f->next = 0;
+  f->offset = 0;
+  f->saved = '\0';
   return f;
 }
 Textfile *file_open_rw(const char *path) {
   Textfile *f = (Textfile *)malloc(sizeof(Textfile));
+  if (!f) {
+    return NULL;
+  }
   f->fp = fopen(path, "r+");
   if (!f->fp) {
     // Textfile does not exist, we create it.
     f->fp = fopen(path, "w+");
     if (!f->fp) {
-      fprintf(stderr, "ERROR: Couldn't open file %s.\n", path);
-      exit(EXIT_FAILURE);
+      free(f);
+      return NULL;
     }
   }
+  f->path = strdup(path);
+  f->buffer = NULL;
   f->line = NULL;
   f->len = 0;
+  f->length = 0;
   return f;
 }
 
+// Rest of the file, NULL if it can not be read.
 static char *file_to_buffer(FILE *fp) {
   const long position = ftell(fp); // save current position
   fseek(fp, 0, SEEK_END);
@@ -40,24 +75,151 @@ static char *file_to_buffer(FILE *fp) {
   const size_t size = end_position - position;
   char *buffer = (char *)malloc((size + 1) * sizeof(char));
   if (!buffer) {
-    fprintf(stderr, "ERROR: failed to allocate %zu bytes.\n", size + 1);
-    exit(EXIT_FAILURE);
+    return NULL;
   }
   const size_t n_read = fread(buffer, sizeof(char), size, fp);
   if (n_read != size) {
-    fprintf(stderr, "ERROR: Could not read file.\n");
-    exit(EXIT_FAILURE);
+    free(buffer);
+    fseek(fp, position, SEEK_SET);
+    return NULL;
   }
   buffer[size] = '\0';
   fseek(fp, position, SEEK_SET);
   return buffer;
 }
 
+// First '\n' of [p, p + n), NULL if there is none. Lines are about a hundred
+// bytes long: the bytes are compared by vectors, inline.
+static inline char *find_newline(char *p, size_t n) {
+  char *end = p + n;
+#if defined(__AVX2__)
+  const __m256i newline = _mm256_set1_epi8('\n');
+  for (; p + 32 <= end; p += 32) {
+    const __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    const unsigned int mask =
+        (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8('\n');
+  for (; p + 16 <= end; p += 16) {
+    const __m128i block = _mm_loadu_si128((const __m128i *)p);
+    const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+  return (char *)memchr(p, '\n', end - p);
+}
+
+static bool next_buffered_line(Textfile *f) {
+  f->buffer[f->next] = f->saved;
+  // No '\n' before scanned
+  size_t scanned = f->next;
+  size_t end;
+  while (true) {
+    const char *newline =
+        find_newline(f->buffer + scanned, f->size - scanned);
+    if (newline) {
+      end = newline - f->buffer + 1;
+      break;
+    }
+    // The beginning of the line is moved to the front, and the buffer refilled
+    memmove(f->buffer, f->buffer + f->next, f->size - f->next);
+    f->offset += f->next;
+    f->size -= f->next;
+    f->next = 0;
+    scanned = f->size;
+    if (f->size == f->capacity) {
+      f->capacity *= 2;
+      f->buffer = (char *)realloc(f->buffer, f->capacity + 1);
+      if (!f->buffer) {
+        // The line can neither be read nor skipped (see matching.c)
+        fprintf(stderr, "ERROR: failed to allocate %zu bytes.\n",
+                f->capacity + 1);
+        abort();
+      }
+    }
+    const size_t n_read =
+        fread(f->buffer + f->size, 1, f->capacity - f->size, f->fp);
+    f->size += n_read;
+    if (n_read == 0) {
+      end = f->size;
+      break;
+    }
+  }
+  if (end == f->next) {
+    f->saved = f->buffer[f->next];
+    return false;
+  }
+  f->line = f->buffer + f->next;
+  f->length = end - f->next;
+  f->saved = f->buffer[end];
+  f->buffer[end] = '\0';
+  f->next = end;
+  return true;
+}
+
 bool next_line(Textfile *f) {
-  return (getline(&f->line, &f->len, f->fp) != -1);
+  if (f->buffer) {
+    return next_buffered_line(f);
+  }
+  const ssize_t length = getline(&f->line, &f->len, f->fp);
+  f->length = length > 0 ? (size_t)length : 0;
+  return length != -1;
+}
+
+long file_tell(Textfile *f) {
+  return f->buffer ? f->offset + (long)f->next : ftell(f->fp);
 }
 
-void overwrite_line(Textfile *f, const char *newline) {
+void file_seek(Textfile *f, long position) {
+  if (!f->buffer) {
+    fseek(f->fp, position, SEEK_SET);
+    return;
+  }
+  f->buffer[f->next] = f->saved;
+  // Binary searches seek back and forth in a few blocks
+  if (position >= f->offset && position <= f->offset + (long)f->size) {
+    f->next = position - f->offset;
+  } else {
+    fseek(f->fp, position, SEEK_SET);
+    f->offset = position;
+    f->size = 0;
+    f->next = 0;
+  }
+  f->saved = f->buffer[f->next];
+}
+
+long file_size(Textfile *f) {
+  struct stat st;
+  return fstat(fileno(f->fp), &st) == 0 ? (long)st.st_size : 0;
+}
+
+long file_line_number(Textfile *f) {
+  const long start = f->buffer ? f->offset + (f->line - f->buffer)
+                               : ftell(f->fp) - (long)f->length;
+  long number = 1;
+  char block[BLOCK_SIZE];
+  for (long position = 0; position < start;) {
+    const long size = (start - position < BLOCK_SIZE) ? start - position
+                                                      : BLOCK_SIZE;
+    const ssize_t n_read = pread(fileno(f->fp), block, size, position);
+    if (n_read <= 0) {
+      break;
+    }
+    for (ssize_t i = 0; i < n_read; i++) {
+      number += (block[i] == '\n');
+    }
+    position += n_read;
+  }
+  return number;
+}
+
+bool overwrite_line(Textfile *f, const char *newline) {
   const size_t len = strlen(f->line);
   size_t newlen = strlen(newline) + 1;
   if (newlen <= len) {
@@ -75,12 +237,16 @@ void overwrite_line(Textfile *f, const char *newline) {
     // New line is longer than the current one
     // We have to copy the rest of the file
     char *file_tail = file_to_buffer(f->fp);
+    if (!file_tail) {
+      return false;
+    }
     fseek(f->fp, -len, SEEK_CUR);
     fputs(newline, f->fp);
     fputs("\n", f->fp);
     fputs(file_tail, f->fp);
     free(file_tail);
   }
+  return true;
 }
 
 void write_line(Textfile *f, const char *line) {
@@ -88,10 +254,136 @@ void write_line(Textfile *f, const char *line) {
   fputs("\n", f->fp);
 }
 
+// Remove the line that has just been read. The file's position is then the
+// beginning of the following line.
+bool delete_line(Textfile *f) {
+  const long len = (long)strlen(f->line);
+  char *file_tail = file_to_buffer(f->fp);
+  if (!file_tail) {
+    return false;
+  }
+  const long tail_len = (long)strlen(file_tail);
+  fseek(f->fp, -len, SEEK_CUR);
+  const long position = ftell(f->fp);
+  fputs(file_tail, f->fp);
+  fflush(f->fp);
+  if (ftruncate(fileno(f->fp), position + tail_len) != 0) {
+    fprintf(stderr, "ERROR: Could not truncate file.\n");
+  }
+  fseek(f->fp, position, SEEK_SET);
+  free(file_tail);
+  return true;
+}
+
+static int compare_spans(const void *a, const void *b) {
+  const long x = ((const Span *)a)->offset;
+  const long y = ((const Span *)b)->offset;
+  return (x > y) - (x < y);
+}
+
+bool delete_spans(Textfile *f, Span *spans, int n) {
+  if (n == 0) {
+    return true;
+  }
+  qsort(spans, n, sizeof(Span), compare_spans);
+  fflush(f->fp);
+  const int fd = fileno(f->fp);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+  char buffer[BLOCK_SIZE];
+  long to = spans[0].offset;
+  for (int i = 0; i < n; i++) {
+    // Move the part between span i and the next one
+    long from = spans[i].offset + spans[i].length;
+    const long end = (i + 1 < n) ? spans[i + 1].offset : (long)st.st_size;
+    while (from < end) {
+      const size_t size =
+          (end - from < BLOCK_SIZE) ? (size_t)(end - from) : BLOCK_SIZE;
+      const ssize_t got = pread(fd, buffer, size, from);
+      if (got <= 0 || pwrite(fd, buffer, got, to) != got) {
+        return false;
+      }
+      from += got;
+      to += got;
+    }
+  }
+  if (ftruncate(fd, to) != 0) {
+    fprintf(stderr, "ERROR: Could not truncate file.\n");
+  }
+  fseek(f->fp, to, SEEK_SET);
+  return true;
+}
+
 void file_close(Textfile *f) {
   fclose(f->fp);
-  if (f->line) {
+  if (f->buffer) {
+    free(f->buffer);
+  } else if (f->line) {
     free(f->line);
   }
+  free(f->path);
   free(f);
 }
+
+char *sidecar_path(const char *path, const char *suffix) {
+  char *sidecar = (char *)malloc(strlen(path) + strlen(suffix) + 1);
+  if (!sidecar) {
+    return NULL;
+  }
+  strcpy(sidecar, path);
+  strcat(sidecar, suffix);
+  return sidecar;
+}
+
+long lower_bound(Textfile *f, long end,
+                 int (*compare)(const char *line, const void *key),
+                 const void *key) {
+  long lo = 0, hi = end;
+  while (lo < hi) {
+    const long mid = lo + (hi - lo) / 2;
+    long start = lo;
+    if (mid > lo) {
+      // Start of the first line after mid
+      file_seek(f, mid - 1);
+      next_line(f);
+      start = file_tell(f);
+      if (start >= hi) {
+        start = lo;
+      }
+    }
+    file_seek(f, start);
+    if (!next_line(f)) {
+      return hi;
+    }
+    if (compare(f->line, key) < 0) {
+      lo = file_tell(f);
+    } else {
+      hi = start;
+    }
+  }
+  return lo;
+}
+
+unsigned int file_generation(const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  const long long nsec = st.st_mtimespec.tv_nsec;
+#else
+  const long long nsec = st.st_mtim.tv_nsec;
+#endif
+  // FNV-1a over the metadata that changes whenever the file is edited
+  const long long fields[4] = {(long long)st.st_mtime, nsec,
+                               (long long)st.st_size, (long long)st.st_ino};
+  const unsigned char *bytes = (const unsigned char *)fields;
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(fields); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  // 0 is reserved for missing files (and for "no verdict" of the filters)
+  return hash == 0 ? 1 : hash;
+}
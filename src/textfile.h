@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -5,11 +7,59 @@ typedef struct Textfile {
   char *line;
   size_t len;
   FILE *fp;
+  char *path;
+  size_t length; // of line, with its '\n'
+  // Files opened with file_open are read by blocks: line then points into
+  // buffer, and their position is given by file_tell rather than by fp.
+  char *buffer;
+  size_t capacity;
+  size_t size;  // bytes of the file in buffer
+  size_t next;  // start of the next line in buffer
+  long offset;  // position in the file of buffer[0]
+  char saved;   // byte of buffer replaced by the '\0' that ends line
 } Textfile;
 
+// Open path for reading, NULL if it can not be opened.
 Textfile *file_open(const char *path);
+// Open path for reading and writing, creating it if it does not exist. NULL if
+// it can not be opened.
 Textfile *file_open_rw(const char *path);
+// Read the next line, with its '\n' (if any), in f->line. It remains valid
+// until the next call.
 bool next_line(Textfile *f);
-void overwrite_line(Textfile *f, const char *newline);
+// Position in the file of the next line to be read.
+long file_tell(Textfile *f);
+// Read the file from position on.
+void file_seek(Textfile *f, long position);
+long file_size(Textfile *f);
+// Number of the line that has just been read, from 1. Slow: the file is read
+// again from its start, for error messages.
+long file_line_number(Textfile *f);
+// The line editors return false if the rest of the file can not be read, which
+// is then left unchanged.
+bool overwrite_line(Textfile *f, const char *newline);
 void write_line(Textfile *f, const char *line);
+bool delete_line(Textfile *f);
+// Bytes [offset, offset + length) of a file
+typedef struct Span {
+  long offset;
+  long length;
+} Span;
+// Delete the disjoint spans[0..n) of a file opened by file_open_rw (which are
+// sorted), moving each part of the rest of the file once. f is then at the
+// end of the file.
+bool delete_spans(Textfile *f, Span *spans, int n);
 void file_close(Textfile *f);
+
+// Offset of the first line of [0, end) that is not less than key according to
+// compare, the lines of [0, end) being sorted (binary search, as look(1)).
+long lower_bound(Textfile *f, long end,
+                 int (*compare)(const char *line, const void *key),
+                 const void *key);
+
+// Hash of the metadata of path that changes whenever the file is modified or
+// replaced, 0 if it does not exist.
+unsigned int file_generation(const char *path);
+
+// Path of a file stored next to path: <path><suffix> (to be freed).
+char *sidecar_path(const char *path, const char *suffix);
@@ -0,0 +1,507 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "textfile.h"
+#include "top.h"
+
+static const char top_suffix[] = ".top";
+
+typedef struct TopEntry {
+  double frecency;
+  int index;
+} TopEntry;
+
+static int compare_entries(const void *a, const void *b) {
+  const TopEntry *x = (const TopEntry *)a;
+  const TopEntry *y = (const TopEntry *)b;
+  if (x->frecency != y->frecency) {
+    return (x->frecency < y->frecency) ? 1 : -1;
+  }
+  return x->index - y->index;
+}
+
+// Size of the first line of the view
+#define HEADER_SIZE (TOP_BOUNDS * 48)
+
+// While they are raised, the bounds are kept in the log domain (see
+// log_visits), relative to the time of the update: bound_record is then a
+// maximum, and dominance two comparisons.
+typedef struct Bound {
+  double log_visits;
+  long long last_visit;
+} Bound;
+
+static Bound to_bound(const Record *rec, long long epoch) {
+  return (Bound){log_visits(rec->n_visits, rec->last_visit, epoch),
+                 rec->last_visit};
+}
+
+// With some slack for the rounding errors of the round trip, for the bound to
+// stay above the records.
+static Record to_record(const Bound *bound, long long epoch) {
+  return (Record){.path = "",
+                  .n_visits = visits_from_log(bound->log_visits, epoch,
+                                              bound->last_visit) *
+                              (1 + 1e-12),
+                  .last_visit = bound->last_visit};
+}
+
+// The frecency of a is at least the one of b at any later time
+static bool dominates(const Bound *a, const Bound *b) {
+  return b->last_visit <= a->last_visit && b->log_visits <= a->log_visits;
+}
+
+// Raise the bounds so that they bound b as well. The bounds form a Pareto
+// front: older ones have more visits. When there are too many of them, the
+// two consecutive bounds whose merge loosens the bound the least are merged.
+static void add_bound(Bound *bounds, int *n, Bound b, long long now) {
+  for (int i = 0; i < *n; i++) {
+    if (dominates(bounds + i, &b)) {
+      return;
+    }
+  }
+  int k = 0;
+  for (int i = 0; i < *n; i++) {
+    if (!dominates(&b, bounds + i)) {
+      bounds[k++] = bounds[i];
+    }
+  }
+  int i = k;
+  while (i > 0 && bounds[i - 1].last_visit > b.last_visit) {
+    bounds[i] = bounds[i - 1];
+    i--;
+  }
+  bounds[i] = b;
+  *n = k + 1;
+  if (*n <= TOP_BOUNDS) {
+    return;
+  }
+  // The merge of bounds j and j + 1 has the last visit of j + 1 and the log
+  // visits of j, which has more of them.
+  int best = 0;
+  double best_loss = 0;
+  for (int j = 0; j + 1 < *n; j++) {
+    const long long last_visit = bounds[j + 1].last_visit;
+    const double loss =
+        frecency_from_log(bounds[j].log_visits, now, last_visit, now) -
+        frecency_from_log(bounds[j + 1].log_visits, now, last_visit, now);
+    if (j == 0 || loss < best_loss) {
+      best = j;
+      best_loss = loss;
+    }
+  }
+  bounds[best + 1].log_visits = bounds[best].log_visits;
+  for (int j = best; j + 1 < *n; j++) {
+    bounds[j] = bounds[j + 1];
+  }
+  (*n)--;
+}
+
+static void format_bounds(const Record *bounds, int n, char *buffer) {
+  int k = 0;
+  buffer[0] = '\0';
+  for (int i = 0; i < n; i++) {
+    k += snprintf(buffer + k, HEADER_SIZE - k, "%s%.17g %lld",
+                  i > 0 ? " " : "", bounds[i].n_visits, bounds[i].last_visit);
+  }
+}
+
+static bool parse_bounds(const char *line, Record *bounds, int *n) {
+  *n = 0;
+  int consumed;
+  while (*n < TOP_BOUNDS &&
+         sscanf(line, "%lf %lld%n", &bounds[*n].n_visits,
+                &bounds[*n].last_visit, &consumed) == 2) {
+    bounds[*n].path = "";
+    bounds[*n].filter_generation = 0;
+    bounds[*n].filtered = false;
+    line += consumed;
+    (*n)++;
+  }
+  return *n > 0 || line[strspn(line, " \n")] == '\0';
+}
+
+// Replace the view of the database by the records of view[0..k), by
+// decreasing frecency, and the bounds of the other records.
+static void write_view(const char *db_path, const Record *const *view, int k,
+                       const Bound *log_bounds, int n_bounds, long long now) {
+  char *path = sidecar_path(db_path, top_suffix);
+  char *temp = path ? (char *)malloc(strlen(path) + 32) : NULL;
+  if (!path || !temp) {
+    free(path);
+    free(temp);
+    return;
+  }
+  Record bounds[TOP_BOUNDS];
+  for (int i = 0; i < n_bounds; i++) {
+    bounds[i] = to_record(log_bounds + i, now);
+  }
+
+  sprintf(temp, "%s.%ld", path, (long)getpid());
+  FILE *fp = fopen(temp, "w");
+  bool ok = (fp != NULL);
+  if (ok) {
+    char header[HEADER_SIZE];
+    format_bounds(bounds, n_bounds, header);
+    ok = fprintf(fp, "%s\n", header) > 0;
+    for (int i = 0; i < k && ok; i++) {
+      char *rec_string = record_to_string((Record *)view[i]);
+      ok = rec_string && fprintf(fp, "%s\n", rec_string) > 0;
+      free(rec_string);
+    }
+    ok = (fclose(fp) == 0) && ok;
+  }
+  if (!ok || rename(temp, path) != 0) {
+    unlink(temp);
+  }
+  free(temp);
+  free(path);
+}
+
+void top_build(const char *db_path, Record **records, int n, long long now) {
+  TopEntry *entries = (TopEntry *)malloc((n + 1) * sizeof(TopEntry));
+  const Record **view =
+      (const Record **)malloc((TOP_SIZE + 1) * sizeof(Record *));
+  if (!entries || !view) {
+    free(entries);
+    free(view);
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    entries[i].frecency =
+        frecency(records[i]->n_visits, now - records[i]->last_visit);
+    entries[i].index = i;
+  }
+  qsort(entries, n, sizeof(TopEntry), compare_entries);
+  const int k = (n < TOP_SIZE) ? n : TOP_SIZE;
+  Bound log_bounds[TOP_BOUNDS + 1];
+  int n_bounds = 0;
+  for (int i = k; i < n; i++) {
+    add_bound(log_bounds, &n_bounds, to_bound(records[entries[i].index], now),
+              now);
+  }
+  for (int i = 0; i < k; i++) {
+    view[i] = records[entries[i].index];
+  }
+  write_view(db_path, view, k, log_bounds, n_bounds, now);
+  free(view);
+  free(entries);
+}
+
+// The builder keeps the most frecent records added so far in a heap whose
+// root is the least frecent of them, and bounds the others.
+typedef struct TopCandidate {
+  TopEntry entry; // its index is the rank of addition
+  Record rec;     // with a copy of the path
+} TopCandidate;
+
+struct TopBuilder {
+  long long now;
+  TopCandidate heap[TOP_SIZE];
+  int n;
+  int n_added;
+  Bound log_bounds[TOP_BOUNDS + 1];
+  int n_bounds;
+};
+
+TopBuilder *top_builder_create(long long now) {
+  TopBuilder *builder = (TopBuilder *)malloc(sizeof(TopBuilder));
+  if (builder) {
+    builder->now = now;
+    builder->n = 0;
+    builder->n_added = 0;
+    builder->n_bounds = 0;
+  }
+  return builder;
+}
+
+// Whether a comes after b in the view
+static bool after(const TopCandidate *a, const TopCandidate *b) {
+  return compare_entries(&a->entry, &b->entry) > 0;
+}
+
+static void sift_candidates(TopCandidate *heap, int n, int i) {
+  while (true) {
+    int last = i;
+    for (int child = 2 * i + 1; child <= 2 * i + 2 && child < n; child++) {
+      if (after(heap + child, heap + last)) {
+        last = child;
+      }
+    }
+    if (last == i) {
+      return;
+    }
+    const TopCandidate swap = heap[i];
+    heap[i] = heap[last];
+    heap[last] = swap;
+    i = last;
+  }
+}
+
+bool top_builder_add(TopBuilder *builder, const Record *rec) {
+  const long long now = builder->now;
+  TopCandidate candidate = {
+      .entry = {frecency(rec->n_visits, now - rec->last_visit),
+                builder->n_added++},
+      .rec = *rec};
+  TopCandidate *heap = builder->heap;
+  if (builder->n == TOP_SIZE && !after(heap, &candidate)) {
+    add_bound(builder->log_bounds, &builder->n_bounds, to_bound(rec, now), now);
+    return true;
+  }
+  candidate.rec.path = strdup(rec->path);
+  if (!candidate.rec.path) {
+    return false;
+  }
+  if (builder->n < TOP_SIZE) {
+    // Sift up
+    int i = builder->n++;
+    while (i > 0 && after(&candidate, heap + (i - 1) / 2)) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = candidate;
+    return true;
+  }
+  add_bound(builder->log_bounds, &builder->n_bounds, to_bound(&heap->rec, now),
+            now);
+  free((char *)heap->rec.path);
+  heap[0] = candidate;
+  sift_candidates(heap, builder->n, 0);
+  return true;
+}
+
+static int compare_candidates(const void *a, const void *b) {
+  return compare_entries(&((const TopCandidate *)a)->entry,
+                         &((const TopCandidate *)b)->entry);
+}
+
+void top_builder_finish(TopBuilder *builder, const char *db_path) {
+  qsort(builder->heap, builder->n, sizeof(TopCandidate), compare_candidates);
+  const Record *view[TOP_SIZE];
+  for (int i = 0; i < builder->n; i++) {
+    view[i] = &builder->heap[i].rec;
+  }
+  write_view(db_path, view, builder->n, builder->log_bounds,
+             builder->n_bounds, builder->now);
+  top_builder_free(builder);
+}
+
+void top_builder_free(TopBuilder *builder) {
+  for (int i = 0; i < builder->n; i++) {
+    free((char *)builder->heap[i].rec.path);
+  }
+  free(builder);
+}
+
+static bool is_record_of(const char *line, const char *path, size_t len) {
+  return strncmp(line, path, len) == 0 && line[len] == '|';
+}
+
+void top_update(const char *db_path, const Record *rec, long long now) {
+  char *path = sidecar_path(db_path, top_suffix);
+  if (!path || access(path, F_OK) != 0) {
+    free(path);
+    return;
+  }
+  Textfile *f = file_open_rw(path);
+  Record bounds[TOP_BOUNDS + 1];
+  int n_bounds;
+  if (!f || !next_line(f) || !parse_bounds(f->line, bounds, &n_bounds)) {
+    // Corrupted view: queries will not use it until it is rebuilt
+    if (f) {
+      file_close(f);
+    }
+    unlink(path);
+    free(path);
+    return;
+  }
+  char *rec_string = record_to_string((Record *)rec);
+  if (!rec_string) {
+    file_close(f);
+    free(path);
+    return;
+  }
+  const size_t len = strlen(rec->path);
+  // Least frecent record of the view
+  Record min_rec;
+  char *min_buffer = NULL;
+  long min_start = -1;
+  double min_frecency = 0;
+  int n = 0;
+  bool found = false;
+  // Whether the view could be updated
+  bool updated = true;
+  while (next_line(f)) {
+    if (is_record_of(f->line, rec->path, len)) {
+      updated = overwrite_line(f, rec_string);
+      found = true;
+      break;
+    }
+    n++;
+    char *buffer = strdup(f->line);
+    Record r;
+    if (!parse_record(buffer, &r)) {
+      report_invalid_record(f);
+      free(buffer);
+      continue;
+    }
+    const double fr = frecency(r.n_visits, now - r.last_visit);
+    if (min_start < 0 || fr < min_frecency) {
+      min_start = ftell(f->fp) - (long)strlen(f->line);
+      min_frecency = fr;
+      free(min_buffer);
+      min_buffer = buffer;
+      min_rec = r;
+    } else {
+      free(buffer);
+    }
+  }
+  if (!found) {
+    if (n < TOP_SIZE) {
+      write_line(f, rec_string);
+    } else {
+      // rec, or the least frecent record of the view, leaves the view
+      Bound log_bounds[TOP_BOUNDS + 1];
+      for (int i = 0; i < n_bounds; i++) {
+        log_bounds[i] = to_bound(bounds + i, now);
+      }
+      if (frecency(rec->n_visits, now - rec->last_visit) <= min_frecency) {
+        add_bound(log_bounds, &n_bounds, to_bound(rec, now), now);
+      } else {
+        fseek(f->fp, min_start, SEEK_SET);
+        next_line(f);
+        updated = overwrite_line(f, rec_string);
+        add_bound(log_bounds, &n_bounds, to_bound(&min_rec, now), now);
+      }
+      for (int i = 0; i < n_bounds; i++) {
+        bounds[i] = to_record(log_bounds + i, now);
+      }
+      char header[HEADER_SIZE];
+      format_bounds(bounds, n_bounds, header);
+      fseek(f->fp, 0, SEEK_SET);
+      next_line(f);
+      overwrite_line(f, header);
+    }
+  }
+  free(min_buffer);
+  free(rec_string);
+  file_close(f);
+  if (!updated) {
+    unlink(path);
+  }
+  free(path);
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static int compare_line_with_path(const void *line, const void *path) {
+  return compare_line_path((const char *)line, *(const char **)path);
+}
+
+void top_remove(const char *db_path, const char **paths, int n) {
+  char *top_path = sidecar_path(db_path, top_suffix);
+  if (n == 0 || !top_path || access(top_path, F_OK) != 0) {
+    free(top_path);
+    return;
+  }
+  // The lines of the paths are found by bisection in the sorted paths, and
+  // then deleted at once
+  qsort(paths, n, sizeof(char *), compare_strings);
+  Textfile *f = file_open_rw(top_path);
+  Span *spans = (Span *)malloc(n * sizeof(Span));
+  bool removed = f && spans;
+  // Skip the bounds
+  if (removed && next_line(f)) {
+    int n_spans = 0;
+    long position = ftell(f->fp);
+    while (n_spans < n && next_line(f)) {
+      if (bsearch(f->line, paths, n, sizeof(char *), compare_line_with_path)) {
+        spans[n_spans].offset = position;
+        spans[n_spans++].length = (long)f->length;
+      }
+      position += (long)f->length;
+    }
+    removed = delete_spans(f, spans, n_spans);
+  }
+  free(spans);
+  if (f) {
+    file_close(f);
+  }
+  if (!removed) {
+    // The view can not be trusted anymore
+    unlink(top_path);
+  }
+  free(top_path);
+}
+
+bool top_load(const char *db_path, TopView *view) {
+  char *path = sidecar_path(db_path, top_suffix);
+  Textfile *f = path ? file_open(path) : NULL;
+  free(path);
+  if (!f) {
+    return false;
+  }
+  if (!next_line(f) ||
+      !parse_bounds(f->line, view->bounds, &view->n_bounds)) {
+    file_close(f);
+    return false;
+  }
+  int size = TOP_SIZE + 1;
+  view->n = 0;
+  view->records = (Record *)malloc(size * sizeof(Record));
+  view->lines = (char **)malloc(size * sizeof(char *));
+  while (view->records && view->lines && next_line(f)) {
+    if (view->n == size) {
+      size *= 2;
+      view->records = (Record *)realloc(view->records, size * sizeof(Record));
+      view->lines = (char **)realloc(view->lines, size * sizeof(char *));
+      if (!view->records || !view->lines) {
+        break;
+      }
+    }
+    view->lines[view->n] = strdup(f->line);
+    if (!parse_record(view->lines[view->n], view->records + view->n)) {
+      report_invalid_record(f);
+      free(view->lines[view->n]);
+      continue;
+    }
+    view->n++;
+  }
+  file_close(f);
+  if (!view->records || !view->lines) {
+    // The database is then searched without the view
+    for (int i = 0; view->lines && i < view->n; i++) {
+      free(view->lines[i]);
+    }
+    free(view->records);
+    free(view->lines);
+    return false;
+  }
+  return true;
+}
+
+double top_bound(const TopView *view, long long now) {
+  // Frecency of a record that was never visited
+  double bound = frecency(0, 1e18);
+  for (int i = 0; i < view->n_bounds; i++) {
+    const double f =
+        frecency(view->bounds[i].n_visits, now - view->bounds[i].last_visit);
+    if (f > bound) {
+      bound = f;
+    }
+  }
+  return bound;
+}
+
+void top_free(TopView *view) {
+  for (int i = 0; i < view->n; i++) {
+    free(view->lines[i]);
+  }
+  free(view->lines);
+  free(view->records);
+}
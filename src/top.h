@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "record.h"
+
+// Materialized view of the most frecent records of a database, stored in
+// <database>.top. Its first line holds a few "virtual" records (see
+// bound_record) such that, at any later time, the frecency of every record of
+// the database that is not in the view is bounded by the frecency of one of
+// them. Queries whose results can only come from the view are answered
+// without reading the database.
+#define TOP_BOUNDS 16
+// Size of the view: twice the number of results of interactive searches, so
+// that filtered records leave enough of them.
+#define TOP_SIZE 1000
+
+typedef struct TopView {
+  Record bounds[TOP_BOUNDS]; // sorted by last visit
+  int n_bounds;
+  Record *records;
+  char **lines; // the records' paths point into lines
+  int n;
+} TopView;
+
+// Replace the view by the most frecent of records[0..n), the records of the
+// database.
+void top_build(const char *db_path, Record **records, int n, long long now);
+
+// Builder of the view of a database that is read as a stream: top_build of
+// the records added one by one, in bounded memory.
+typedef struct TopBuilder TopBuilder;
+
+// NULL if it can not be allocated.
+TopBuilder *top_builder_create(long long now);
+
+// Returns false if rec can not be copied: the view can then not be built.
+bool top_builder_add(TopBuilder *builder, const Record *rec);
+
+// Replace the view by the most frecent of the added records, and free the
+// builder.
+void top_builder_finish(TopBuilder *builder, const char *db_path);
+
+void top_builder_free(TopBuilder *builder);
+
+// Update the view after rec has been visited. Does nothing if there is no
+// view.
+void top_update(const char *db_path, const Record *rec, long long now);
+
+// Remove paths[0..n) from the view, after they have been removed from the
+// database. The view is rewritten once, and paths is sorted.
+void top_remove(const char *db_path, const char **paths, int n);
+
+// Returns false if there is no (valid) view.
+bool top_load(const char *db_path, TopView *view);
+
+// Upper bound on the frecency of the records that are not in the view.
+double top_bound(const TopView *view, long long now);
+
+void top_free(TopView *view);
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "meta.h"
+#include "record.h"
+#include "textfile.h"
+#include "top.h"
+#include "visit.h"
+
+// The line of the database starting at position has grown by delta bytes.
+static void shift_sorted_bytes(const char *path, long position, long delta) {
+  Meta *meta = meta_load(path);
+  if (!meta) {
+    return;
+  }
+  const long sorted = (long)meta_get(meta, "sorted_bytes", 0);
+  if (position < sorted) {
+    meta_set(meta, "sorted_bytes", (double)(sorted + delta));
+    meta_save(meta);
+  }
+  meta_free(meta);
+}
+
+// Size of the region of the cold tier whose records are sorted by path (saved
+// in the metadata of the database), 0 if it can not be trusted.
+static long cold_sorted_bytes(const Meta *meta, Textfile *cold) {
+  const long sorted = (long)meta_get(meta, "cold_sorted_bytes", 0);
+  bool valid = sorted > 0 && sorted <= file_size(cold);
+  if (valid) {
+    // An archive rewritten by something else can not be trusted
+    fseek(cold->fp, sorted - 1, SEEK_SET);
+    valid = (fgetc(cold->fp) == '\n');
+  }
+  return valid ? sorted : 0;
+}
+
+// Parse the line that has just been read from cold in *buffer, which is left
+// NULL if the line is malformed.
+static bool read_cold_record(Textfile *cold, Record *rec, char **buffer) {
+  *buffer = strdup(cold->line);
+  if (*buffer && parse_record(*buffer, rec)) {
+    return true;
+  }
+  if (*buffer) {
+    report_invalid_record(cold);
+  }
+  free(*buffer);
+  *buffer = NULL;
+  return false;
+}
+
+// Remove the record of path, whose lines start with prefix, from the cold
+// tier, if any. It is looked up by bisection in the sorted region of the
+// archive, and then among the lines archived after it. The record is parsed
+// in *buffer, to be freed by the caller.
+static bool take_from_cold_tier(const char *db_path, const char *path,
+                                const char *prefix, Record *rec,
+                                char **buffer) {
+  char *cold_path = sidecar_path(db_path, COLD_SUFFIX);
+  Textfile *cold = (cold_path && access(cold_path, F_OK) == 0)
+                       ? file_open_rw(cold_path)
+                       : NULL;
+  free(cold_path);
+  Meta *meta = cold ? meta_load(db_path) : NULL;
+  if (!meta) {
+    if (cold) {
+      file_close(cold);
+    }
+    return false;
+  }
+  const long sorted = cold_sorted_bytes(meta, cold);
+  const size_t n = strlen(prefix);
+  long start = lower_bound(cold, sorted, compare_line_path, path);
+  file_seek(cold, start);
+  bool found = start < sorted && next_line(cold) &&
+               strncmp(cold->line, prefix, n) == 0 &&
+               read_cold_record(cold, rec, buffer);
+  if (!found) {
+    file_seek(cold, sorted);
+    start = sorted;
+    while (next_line(cold)) {
+      if (strncmp(cold->line, prefix, n) == 0 &&
+          read_cold_record(cold, rec, buffer)) {
+        found = true;
+        break;
+      }
+      start += (long)cold->length;
+    }
+  }
+  if (found) {
+    // A record that stays archived must not be visited twice
+    Span span = {.offset = start, .length = (long)cold->length};
+    found = delete_spans(cold, &span, 1);
+    if (!found) {
+      free(*buffer);
+      *buffer = NULL;
+    } else if (start < sorted) {
+      meta_set(meta, "cold_sorted_bytes", (double)(sorted - span.length));
+      meta_save(meta);
+    }
+  }
+  meta_free(meta);
+  file_close(cold);
+  return found;
+}
+
+// Write the visited record rec over the line that has just been read from f,
+// or after the last line if rec is new. Returns false if it fails.
+static bool write_visit(Textfile *f, const char *db_path, Record *rec,
+                        bool added, long long now) {
+  char *rec_string = record_to_string(rec);
+  if (!rec_string) {
+    return false;
+  }
+  if (added) {
+    write_line(f, rec_string);
+  } else {
+    const long line_len = (long)strlen(f->line);
+    const long line_start = ftell(f->fp) - line_len;
+    const long growth = (long)strlen(rec_string) + 1 - line_len;
+    if (!overwrite_line(f, rec_string)) {
+      free(rec_string);
+      return false;
+    }
+    if (growth > 0) {
+      shift_sorted_bytes(db_path, line_start, growth);
+    }
+  }
+  top_update(db_path, rec, now);
+  journal_append(db_path, rec, now);
+  free(rec_string);
+  return true;
+}
+
+Visit record_visit(const char *db_path, const char *path, double weight,
+                   long long now, Filters *filters) {
+  Visit visit = {
+      .outcome = VISIT_failed, .n_lines = 0, .added = false, .stale = false};
+  Textfile *f = file_open_rw(db_path);
+  const size_t n = strlen(path) + 2;
+  char *prefix = (char *)malloc(n * sizeof(char));
+  if (!f || !prefix) {
+    if (f) {
+      file_close(f);
+    }
+    free(prefix);
+    return visit;
+  }
+  strcpy(prefix, path);
+  prefix[n - 2] = '|';
+  prefix[n - 1] = '\0';
+  Record rec;
+  // Copy of the line of the record, that parse_record modifies
+  char *buffer = NULL;
+  while (next_line(f)) {
+    visit.n_lines++;
+    if (strncmp(f->line, prefix, n - 1) == 0) {
+      buffer = strdup(f->line);
+      if (!buffer) {
+        break;
+      }
+      if (!parse_record(buffer, &rec)) {
+        // The line is replaced by a new record
+        report_invalid_record(f);
+        rec = (Record){.path = path, .n_visits = 0, .last_visit = now};
+      }
+      break;
+    }
+  }
+  if (!buffer && !feof(f->fp)) {
+    free(prefix);
+    file_close(f);
+    return visit;
+  }
+  visit.added = (buffer == NULL);
+  if (visit.added) {
+    // The entry may have been archived: it is then brought back
+    if (take_from_cold_tier(db_path, path, prefix, &rec, &buffer)) {
+      update_record(&rec, now, weight);
+    } else {
+      rec.n_visits = weight;
+      rec.last_visit = now;
+    }
+    rec.path = path;
+    rec.filter_generation = 0;
+  } else {
+    // The verdict stored in the record spares us from reading the filters
+    visit.stale = (rec.filter_generation != filters->generation);
+    update_record(&rec, now, weight);
+  }
+  if (filters_match(filters, &rec)) {
+    visit.outcome = VISIT_filtered;
+  } else if (write_visit(f, db_path, &rec, visit.added, now)) {
+    visit.outcome = VISIT_recorded;
+  }
+  free(buffer);
+  free(prefix);
+  file_close(f);
+  return visit;
+}
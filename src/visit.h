@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "glob.h"
+
+// Archive of the entries evicted from a database (the "cold tier"). A visit
+// brings its entry back to the database.
+#define COLD_SUFFIX ".cold"
+
+typedef enum VISIT {
+  VISIT_recorded,
+  VISIT_filtered, // the path matches the filters: nothing was recorded
+  VISIT_failed,   // the database could not be opened or rewritten
+} VISIT;
+
+typedef struct Visit {
+  VISIT outcome;
+  int n_lines; // of the database before the visit
+  bool added;  // the path was not in the database
+  bool stale;  // its record carried the verdict of older filters
+} Visit;
+
+// Record a visit of path, of the given weight, at time now, in the database
+// at db_path (created if it does not exist) and in its views (see top.h and
+// journal.h). Failures are not printed: the caller reports them.
+Visit record_visit(const char *db_path, const char *path, double weight,
+                   long long now, Filters *filters);
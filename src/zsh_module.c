@@ -0,0 +1,79 @@
+// zsh module jumper/jumper: once loaded with `zmodload jumper/jumper` (see
+// the makefile and `jumper shell zsh`), the command jumper is a builtin that
+// runs in the process of the shell. It is built by zsh's build system, from
+// jumper.mdd.
+#include "jumper.mdh"
+#include "zsh_module.pro"
+
+#include "jumper.h"
+
+/**/
+static int
+bin_jumper(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    int argc = arrlen(args) + 1;
+    char **argv = (char **)zalloc((argc + 1) * sizeof(char *));
+    int status;
+
+    argv[0] = nam;
+    memcpy(argv + 1, args, argc * sizeof(char *));
+    status = jumper_main(argc, argv);
+    zfree(argv, (argc + 1) * sizeof(char *));
+    return status;
+}
+
+// The options are parsed by jumper
+static struct builtin bintab[] = {
+    BUILTIN("jumper", BINF_HANDLES_OPTS, bin_jumper, 0, -1, 0, NULL, NULL),
+};
+
+static struct features module_features = {
+    bintab, sizeof(bintab) / sizeof(*bintab),
+    NULL, 0,
+    NULL, 0,
+    NULL, 0,
+    0
+};
+
+/**/
+int
+setup_(UNUSED(Module m))
+{
+    return 0;
+}
+
+/**/
+int
+features_(Module m, char ***features)
+{
+    *features = featuresarray(m, &module_features);
+    return 0;
+}
+
+/**/
+int
+enables_(Module m, int **enables)
+{
+    return handlefeatures(m, &module_features, enables);
+}
+
+/**/
+int
+boot_(UNUSED(Module m))
+{
+    return 0;
+}
+
+/**/
+int
+cleanup_(Module m)
+{
+    return setfeatureenables(m, &module_features, NULL);
+}
+
+/**/
+int
+finish_(UNUSED(Module m))
+{
+    return 0;
+}
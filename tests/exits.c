@@ -0,0 +1,113 @@
+// Tests of the error exits of jumper_main, that the builtins of the shells
+// call repeatedly in their own process (see builtin.c). Run with `make test`.
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jumper.h"
+
+// Number of the open file descriptors of the process
+static int count_fds(void) {
+  DIR *dir = opendir("/proc/self/fd");
+  if (!dir) {
+    return -1;
+  }
+  int n = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    n += entry->d_name[0] != '.';
+  }
+  closedir(dir);
+  return n;
+}
+
+// Number of the entries of dir whose names start with prefix, which are
+// removed if remove.
+static int scan_dir(const char *dir, const char *prefix, bool remove) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    return -1;
+  }
+  int n = 0;
+  struct dirent *entry;
+  while ((entry = readdir(d))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        strncmp(entry->d_name, prefix, strlen(prefix)) != 0) {
+      continue;
+    }
+    n++;
+    if (remove) {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(d);
+  return n;
+}
+
+static int merge(const char *source, const char *output) {
+  char mode[] = "merge";
+  char output_option[] = "-O";
+  char *argv[] = {"jumper", mode, (char *)source, output_option,
+                  (char *)output, NULL};
+  return jumper_main(5, argv);
+}
+
+int main(void) {
+  char dir[] = "/tmp/jumper_exits_XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  char source[64], database[64], missing[64];
+  snprintf(source, sizeof(source), "%s/source", dir);
+  snprintf(database, sizeof(database), "%s/db", dir);
+  snprintf(missing, sizeof(missing), "%s/missing/db", dir);
+  FILE *fp = fopen(source, "w");
+  if (!fp) {
+    perror("fopen");
+    return EXIT_FAILURE;
+  }
+  fputs("/home/user/b|2|1700000000\n/home/user/a|1|1700000000\n", fp);
+  fclose(fp);
+
+  int n_failures = 0;
+  // The merged database is sorted: a merge then reads it as a run, which is
+  // open when the merge fails to create its output in a missing directory.
+  if (merge(source, database) != EXIT_SUCCESS) {
+    printf("FAILED: merge into %s\n", database);
+    n_failures++;
+  }
+  fflush(stdout);
+  if (!freopen("/dev/null", "w", stderr)) {
+    return EXIT_FAILURE;
+  }
+  const int fds = count_fds();
+  for (int i = 0; i < 100; i++) {
+    if (merge(database, missing) != EXIT_FAILURE) {
+      printf("FAILED: merge into %s did not fail\n", missing);
+      n_failures++;
+      break;
+    }
+  }
+  if (count_fds() != fds) {
+    printf("FAILED: %d file descriptors before the failed merges, %d after\n",
+           fds, count_fds());
+    n_failures++;
+  }
+  if (scan_dir(dir, ".jumper_", false) != 0) {
+    printf("FAILED: the failed merges left temporary files\n");
+    n_failures++;
+  }
+
+  scan_dir(dir, "", true);
+  rmdir(dir);
+  if (n_failures == 0) {
+    printf("exits: OK\n");
+  }
+  return n_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
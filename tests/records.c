@@ -0,0 +1,48 @@
+// Tests of the parser of the database's lines. Run with `make test`.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "record.h"
+
+// Only called for files, which these tests do not read
+void jumper_exit(int status) { exit(status); }
+
+static int n_failures = 0;
+
+// Parse line, which should be valid iff valid, into the given fields.
+static void check(const char *line, bool valid, const char *path,
+                  double n_visits, long long last_visit) {
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer), "%s", line);
+  Record rec;
+  const bool parsed = parse_record(buffer, &rec);
+  const bool ok =
+      (parsed == valid) &&
+      (!valid || (strcmp(rec.path, path) == 0 && rec.n_visits == n_visits &&
+                  rec.last_visit == last_visit));
+  if (!ok) {
+    printf("FAILED: parse_record(\"%s\")\n", line);
+    n_failures++;
+  }
+}
+
+int main(void) {
+  check("/home/user|3|1700000000\n", true, "/home/user", 3, 1700000000);
+  check("/home/user|2.500000|1700000000", true, "/home/user", 2.5, 1700000000);
+  // Lines written on Windows, or edited by hand
+  check("/crlf/dir|3|1700000000\r\n", true, "/crlf/dir", 3, 1700000000);
+  check("/crlf/dir|3|1700000000\r", true, "/crlf/dir", 3, 1700000000);
+  check("/blank/dir|3|1700000000 \t\n", true, "/blank/dir", 3, 1700000000);
+  check("/crlf/dir|3|1700000000|1f:1\r\n", true, "/crlf/dir", 3, 1700000000);
+  // Lines padded by shorter overwrites
+  check("/home/user|3|1700000000      \n", true, "/home/user", 3, 1700000000);
+  check("/home/user|3|1700000000x\n", false, NULL, 0, 0);
+  check("/home/user|3\n", false, NULL, 0, 0);
+  check("|3|1700000000\n", false, NULL, 0, 0);
+  check("/home/user\n", false, NULL, 0, 0);
+  if (n_failures == 0) {
+    printf("records: OK\n");
+  }
+  return n_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}